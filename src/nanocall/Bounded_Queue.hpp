@@ -0,0 +1,110 @@
+#ifndef __BOUNDED_QUEUE_HPP
+#define __BOUNDED_QUEUE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/**
+ * A blocking FIFO queue of bounded capacity, used to connect the stages of a pipeline.
+ * push() blocks while the queue is full; pop() blocks while the queue is empty.
+ * Items can also be given a weight, such as their size in bytes: if max_weight is
+ * non-zero, push() also blocks while the total weight of the queued items would exceed it,
+ * unless the queue is empty, so that a single heavy item can always get through.
+ * Each of the n_producers calls close() when it is done; once all have, and the queue
+ * drains, pop() returns false.
+ */
+template < typename T >
+class Bounded_Queue
+{
+public:
+    explicit Bounded_Queue(size_t capacity, unsigned n_producers = 1, size_t max_weight = 0)
+        : _capacity(std::max(capacity, size_t(1))), _max_weight(max_weight), _weight(0), _n_open(n_producers) {}
+    Bounded_Queue(const Bounded_Queue&) = delete;
+    Bounded_Queue& operator = (const Bounded_Queue&) = delete;
+
+    size_t capacity() const { return _capacity; }
+    size_t max_weight() const { return _max_weight; }
+    size_t weight() const
+    {
+        std::lock_guard< std::mutex > lock(_mutex);
+        return _weight;
+    }
+    size_t size() const
+    {
+        std::lock_guard< std::mutex > lock(_mutex);
+        return _q.size();
+    }
+
+    void push(T&& v, size_t weight = 0)
+    {
+        std::unique_lock< std::mutex > lock(_mutex);
+        assert(_n_open > 0);
+        _not_full_cv.wait(lock, [&] () {
+            return _q.size() < _capacity
+                and (_max_weight == 0 or _q.empty() or _weight + weight <= _max_weight);
+        });
+        _q.emplace_back(std::move(v), weight);
+        _weight += weight;
+        lock.unlock();
+        _not_empty_cv.notify_one();
+    }
+    void push(const T& v, size_t weight = 0)
+    {
+        T tmp(v);
+        push(std::move(tmp), weight);
+    }
+
+    /**
+     * Pop the next item into v; return false if the queue is closed and empty.
+     */
+    bool pop(T& v)
+    {
+        std::unique_lock< std::mutex > lock(_mutex);
+        _not_empty_cv.wait(lock, [&] () { return not _q.empty() or _n_open == 0; });
+        if (_q.empty()) return false;
+        v = std::move(_q.front().first);
+        _weight -= _q.front().second;
+        _q.pop_front();
+        lock.unlock();
+        // with weights, the item freed may make room for any of the waiting producers
+        if (_max_weight == 0)
+        {
+            _not_full_cv.notify_one();
+        }
+        else
+        {
+            _not_full_cv.notify_all();
+        }
+        return true;
+    }
+
+    /**
+     * Signal that one producer is done.
+     */
+    void close()
+    {
+        {
+            std::lock_guard< std::mutex > lock(_mutex);
+            assert(_n_open > 0);
+            --_n_open;
+        }
+        _not_empty_cv.notify_all();
+    }
+
+private:
+    const size_t _capacity;
+    const size_t _max_weight;
+    size_t _weight;
+    unsigned _n_open;
+    // items, with their weights
+    std::deque< std::pair< T, size_t > > _q;
+    mutable std::mutex _mutex;
+    std::condition_variable _not_full_cv;
+    std::condition_variable _not_empty_cv;
+}; // class Bounded_Queue
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef __EMISSION_MATRIX_HPP
+#define __EMISSION_MATRIX_HPP
+
+#include <vector>
+
+#include "Pore_Model.hpp"
+#include "Event.hpp"
+
+/**
+ * Sources of emission probabilities for the dynamic programming kernels.
+ * A source provides, for event i, the log emission probabilities of states [begin, end):
+ *   void row(unsigned i, Float_Type* out, unsigned begin, unsigned end) const;
+ */
+
+/**
+ * Emissions computed on demand from a scaled pore model and a view of an event sequence,
+ * with the drift correction applied by the view.
+ */
+template < typename Float_Type, unsigned Kmer_Size = 6 >
+class Pore_Model_Emissions
+{
+public:
+    typedef Pore_Model< Float_Type, Kmer_Size > Pore_Model_Type;
+    typedef Event_Sequence_View< Float_Type > Event_Sequence_View_Type;
+    static const unsigned n_states = Pore_Model_Type::n_states;
+
+    Pore_Model_Emissions(const Pore_Model_Type& pm, const Event_Sequence_View_Type& ev)
+        : _pm_ptr(&pm), _ev(ev) {}
+
+    unsigned n_events() const { return _ev.size(); }
+    void row(unsigned i, Float_Type* out, unsigned begin = 0, unsigned end = n_states) const
+    {
+        _pm_ptr->log_pr_emission_row(_ev[i], out, begin, end);
+    }
+    Float_Type log_pr_emission(unsigned i, unsigned j) const
+    {
+        return _pm_ptr->log_pr_emission(j, _ev[i]);
+    }
+
+private:
+    const Pore_Model_Type* _pm_ptr;
+    Event_Sequence_View_Type _ev;
+}; // class Pore_Model_Emissions
+
+/**
+ * Emissions precomputed once for all (event, state) pairs, stored as float.
+ * Used to share emissions between forward-backward, training, and Viterbi on the same
+ * (scaled model, corrected events) pair.
+ */
+template < typename Float_Type, unsigned Kmer_Size = 6 >
+class Emission_Matrix
+{
+public:
+    typedef Pore_Model< Float_Type, Kmer_Size > Pore_Model_Type;
+    typedef Event_Sequence_View< Float_Type > Event_Sequence_View_Type;
+    static const unsigned n_states = Pore_Model_Type::n_states;
+
+    void clear() { _m.clear(); }
+    unsigned n_events() const { return _m.size() / n_states; }
+
+    void fill(const Pore_Model_Type& pm, const Event_Sequence_View_Type& ev)
+    {
+        std::vector< Float_Type > tmp(n_states);
+        _m.resize(ev.size() * n_states);
+        for (unsigned i = 0; i < ev.size(); ++i)
+        {
+            pm.log_pr_emission_row(ev[i], &tmp[0]);
+            std::copy(tmp.begin(), tmp.end(), _m.begin() + i * n_states);
+        }
+    }
+
+    void row(unsigned i, Float_Type* out, unsigned begin = 0, unsigned end = n_states) const
+    {
+        std::copy(_m.begin() + i * n_states + begin, _m.begin() + i * n_states + end, out + begin);
+    }
+    Float_Type log_pr_emission(unsigned i, unsigned j) const
+    {
+        return _m[i * n_states + j];
+    }
+
+private:
+    std::vector< float > _m;
+}; // class Emission_Matrix
+
+#endif
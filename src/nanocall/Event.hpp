@@ -2,6 +2,7 @@
 #define __EVENT_HPP
 
 #include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <iostream>
 #include <vector>
@@ -18,14 +19,10 @@ public:
     Float_Type stdv;
     Float_Type start;
     Float_Type length;
-    Float_Type log_mean;
     Float_Type log_stdv;
-    Float_Type log_start;
     void update_logs()
     {
-        log_mean = std::log(mean);
         log_stdv = std::log(stdv);
-        log_start = std::log(start);
     }
     friend std::ostream & operator << (std::ostream& os, const Event< Float_Type >& ev)
     {
@@ -46,20 +43,135 @@ public:
     }
 }; // class Event
 
+/**
+ * Event sequence, stored by columns.
+ * Only the columns used by emissions are kept; drift correction is left to views.
+ */
 template < typename Float_Type >
-struct Event_Sequence
-    : std::deque< Event< Float_Type > >
+class Event_Sequence
 {
-    typedef std::deque< Event< Float_Type > > Base;
-    using Base::Base;
-    void apply_drift_correction(Float_Type drift)
+public:
+    typedef Event< Float_Type > Event_Type;
+
+    size_t size() const { return _mean.size(); }
+    bool empty() const { return _mean.empty(); }
+    void clear()
+    {
+        _mean.clear();
+        _stdv.clear();
+        _start.clear();
+        _length.clear();
+        _log_stdv.clear();
+    }
+    void reserve(size_t n)
+    {
+        _mean.reserve(n);
+        _stdv.reserve(n);
+        _start.reserve(n);
+        _length.reserve(n);
+        _log_stdv.reserve(n);
+    }
+    void push_back(const Event_Type& e)
+    {
+        _mean.push_back(e.mean);
+        _stdv.push_back(e.stdv);
+        _start.push_back(e.start);
+        _length.push_back(e.length);
+        _log_stdv.push_back(e.log_stdv);
+    }
+
+    Event_Type operator [] (size_t i) const
+    {
+        Event_Type e;
+        e.mean = _mean[i];
+        e.stdv = _stdv[i];
+        e.start = _start[i];
+        e.length = _length[i];
+        e.log_stdv = _log_stdv[i];
+        return e;
+    }
+    Event_Type back() const { return (*this)[size() - 1]; }
+
+    // columns
+    const std::vector< Float_Type >& mean() const { return _mean; }
+    const std::vector< Float_Type >& stdv() const { return _stdv; }
+    const std::vector< Float_Type >& start() const { return _start; }
+    const std::vector< Float_Type >& length() const { return _length; }
+    const std::vector< Float_Type >& log_stdv() const { return _log_stdv; }
+
+    // bytes held by the columns
+    size_t mem_size() const
+    {
+        return (_mean.capacity() + _stdv.capacity() + _start.capacity() + _length.capacity()
+                + _log_stdv.capacity()) * sizeof(Float_Type);
+    }
+
+    // replace contents with n events, given by columns
+    void assign(const Float_Type* mean, const Float_Type* stdv, const Float_Type* start,
+                const Float_Type* length, const Float_Type* log_stdv, size_t n)
     {
-        for (auto& e : *this)
-        {
-            e.mean -= drift * e.start;
-            e.update_logs();
-        }
+        _mean.assign(mean, mean + n);
+        _stdv.assign(stdv, stdv + n);
+        _start.assign(start, start + n);
+        _length.assign(length, length + n);
+        _log_stdv.assign(log_stdv, log_stdv + n);
     }
-}; // struct Event_Sequence
+
+private:
+    std::vector< Float_Type > _mean;
+    std::vector< Float_Type > _stdv;
+    std::vector< Float_Type > _start;
+    std::vector< Float_Type > _length;
+    std::vector< Float_Type > _log_stdv;
+}; // class Event_Sequence
+
+/**
+ * Events [offset, offset + size) of an event sequence, with an optional drift correction:
+ * the mean of an event is taken to be mean - drift * start, as events are read by the
+ * emission code. Views do not own the events, and are cheap to copy.
+ */
+template < typename Float_Type >
+class Event_Sequence_View
+{
+public:
+    typedef Event< Float_Type > Event_Type;
+    typedef Event_Sequence< Float_Type > Event_Sequence_Type;
+
+    Event_Sequence_View() : _seq_ptr(nullptr), _offset(0), _size(0), _drift(0) {}
+    // all events of seq; implicit, so that sequences can be used where views are expected
+    Event_Sequence_View(const Event_Sequence_Type& seq, Float_Type drift = 0)
+        : _seq_ptr(&seq), _offset(0), _size(seq.size()), _drift(drift) {}
+    Event_Sequence_View(const Event_Sequence_Type& seq, size_t offset, size_t size, Float_Type drift = 0)
+        : _seq_ptr(&seq), _offset(offset), _size(size), _drift(drift)
+    {
+        assert(offset + size <= seq.size());
+    }
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    size_t offset() const { return _offset; }
+    Float_Type drift() const { return _drift; }
+    // same events, with the given drift correction
+    Event_Sequence_View with_drift(Float_Type drift) const
+    {
+        Event_Sequence_View res(*this);
+        res._drift = drift;
+        return res;
+    }
+
+    Event_Type operator [] (size_t i) const
+    {
+        assert(i < _size);
+        Event_Type e = (*_seq_ptr)[_offset + i];
+        e.mean -= _drift * e.start;
+        return e;
+    }
+
+private:
+    const Event_Sequence_Type* _seq_ptr;
+    size_t _offset;
+    size_t _size;
+    Float_Type _drift;
+}; // class Event_Sequence_View
 
 #endif
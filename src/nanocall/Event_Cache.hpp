@@ -0,0 +1,457 @@
+#ifndef __EVENT_CACHE_HPP
+#define __EVENT_CACHE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Event.hpp"
+#include "logger.hpp"
+
+/**
+ * Binary cache of read summaries and filtered events, used to skip fast5 files on re-runs.
+ *
+ * Layout, in native byte order, with all offsets 8-byte aligned:
+ * - header: magic, version, float size, and the options which affect the filtered events;
+ * - one record per read: summary fields, size and modification time of the fast5 file,
+ *   file name and read id, then for each strand, the event columns mean, stdv, start,
+ *   length, log_stdv;
+ * - index: record offsets.
+ * Caches are memory-mapped for reading, and event columns are copied out without parsing.
+ * Records of fast5 files which changed since they were cached are ignored.
+ * A cache is written to <file>.tmp, then renamed to <file> when complete. If records are
+ * added to, or ignored in, a cache being read, a replacement is written with the records
+ * still valid and the ones added.
+ */
+template < typename Float_Type >
+class Event_Cache
+{
+public:
+    typedef Event_Sequence< Float_Type > Event_Sequence_Type;
+    static const unsigned n_columns = 5;
+
+    /**
+     * Options which affect the filtered events; a cache is only used with the same options.
+     */
+    struct Options
+    {
+        uint32_t double_strand_scaling;
+        uint32_t min_read_len;
+        uint32_t max_read_len;
+
+        bool operator == (const Options& other) const
+        {
+            return double_strand_scaling == other.double_strand_scaling
+                and min_read_len == other.min_read_len
+                and max_read_len == other.max_read_len;
+        }
+    }; // struct Options
+
+    /**
+     * Summary and events of one read. For records found in a cache, columns point into
+     * the mapped file; for records being added, they point to the events of the read.
+     */
+    struct Record
+    {
+        std::string file_name;
+        std::string read_id;
+        uint64_t file_size;
+        int64_t file_mtime;
+        std::array< unsigned, 4 > strand_bounds;
+        unsigned num_ed_events;
+        Float_Type sampling_rate;
+        Float_Type abasic_level;
+        std::array< size_t, 2 > n_events;
+        std::array< std::array< const Float_Type*, n_columns >, 2 > columns;
+
+        void get_events(unsigned st, Event_Sequence_Type& events) const
+        {
+            const auto& c = columns[st];
+            events.assign(c[0], c[1], c[2], c[3], c[4], n_events[st]);
+        }
+        void set_events(unsigned st, const Event_Sequence_Type& events)
+        {
+            n_events[st] = events.size();
+            columns[st] = {{ events.mean().data(), events.stdv().data(), events.start().data(),
+                             events.length().data(), events.log_stdv().data() }};
+        }
+    }; // struct Record
+
+    Event_Cache() : _map_ptr(nullptr), _map_size(0), _pos(0), _write_failed(false) {}
+    Event_Cache(const Event_Cache&) = delete;
+    Event_Cache& operator = (const Event_Cache&) = delete;
+    ~Event_Cache() { close(); }
+
+    bool reading() const { return _map_ptr != nullptr; }
+    bool writing() const { return _ofs.is_open(); }
+    bool is_open() const { return reading() or writing(); }
+    size_t n_records() const { return reading()? _record_m.size() : _index_v.size(); }
+
+    /**
+     * Open cache file fn: for reading if it exists and was built with the same options,
+     * otherwise for writing. Return false if the cache cannot be written.
+     */
+    bool open(const std::string& fn, const Options& options)
+    {
+        close();
+        _file_name = fn;
+        _options = options;
+        return open_read() or open_write();
+    }
+
+    /**
+     * Find the record of a fast5 file; nullptr if absent, if the file changed since
+     * it was cached, or if not reading. Thread-safe.
+     */
+    const Record* find(const std::string& file_name)
+    {
+        auto it = _record_m.find(file_name);
+        if (it == _record_m.end())
+        {
+            return nullptr;
+        }
+        uint64_t file_size;
+        int64_t file_mtime;
+        if (not get_file_stamp(file_name, file_size, file_mtime)
+            or file_size != it->second.file_size or file_mtime != it->second.file_mtime)
+        {
+            LOG("Event_Cache", info)
+                << "event cache [" << _file_name << "]: ignoring stale record [" << file_name << "]" << std::endl;
+            std::lock_guard< std::mutex > lock(_mutex);
+            _dropped_s.insert(file_name);
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    /**
+     * Add a record, stamped with the current size and modification time of its fast5 file.
+     * If reading, this starts writing a replacement cache. Thread-safe.
+     */
+    void add(const Record& rec)
+    {
+        assert(is_open());
+        Record stamped_rec(rec);
+        if (not get_file_stamp(rec.file_name, stamped_rec.file_size, stamped_rec.file_mtime))
+        {
+            return;
+        }
+        std::lock_guard< std::mutex > lock(_mutex);
+        if (not writing() and (_write_failed or not open_write()))
+        {
+            _write_failed = true;
+            return;
+        }
+        _dropped_s.insert(rec.file_name);
+        write_record(stamped_rec);
+    }
+
+    /**
+     * Complete a cache being written, or unmap a cache being read.
+     * Return false if a cache being written could not be completed.
+     */
+    bool close()
+    {
+        bool ok = true;
+        if (reading() and not _dropped_s.empty() and not writing())
+        {
+            open_write();
+        }
+        if (reading() and writing())
+        {
+            // carry over the records read which were neither stale nor replaced
+            for (const auto& p : _record_m)
+            {
+                if (not _dropped_s.count(p.first))
+                {
+                    write_record(p.second);
+                }
+            }
+        }
+        if (writing())
+        {
+            Header h = make_header();
+            h.n_records = _index_v.size();
+            h.index_offset = _pos;
+            write(_index_v.data(), _index_v.size() * sizeof(uint64_t));
+            _ofs.seekp(0);
+            _ofs.write(reinterpret_cast< const char* >(&h), sizeof(h));
+            _ofs.close();
+            std::string tmp_file_name = _file_name + ".tmp";
+            ok = not _ofs.fail() and std::rename(tmp_file_name.c_str(), _file_name.c_str()) == 0;
+            if (ok)
+            {
+                LOG("Event_Cache", info)
+                    << "event cache [" << _file_name << "]: wrote records [" << _index_v.size() << "]" << std::endl;
+            }
+            else
+            {
+                LOG("Event_Cache", error) << "event cache [" << _file_name << "]: write failed" << std::endl;
+                std::remove(tmp_file_name.c_str());
+            }
+            _index_v.clear();
+            _pos = 0;
+        }
+        if (reading())
+        {
+            munmap(const_cast< char* >(_map_ptr), _map_size);
+            _map_ptr = nullptr;
+            _map_size = 0;
+            _record_m.clear();
+        }
+        _dropped_s.clear();
+        _write_failed = false;
+        return ok;
+    }
+
+private:
+    static const uint32_t version = 2;
+    static const uint32_t byte_order = 0x01020304;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t float_size;
+        uint32_t byte_order;
+        Options options;
+        uint64_t n_records;
+        uint64_t index_offset;
+    }; // struct Header
+
+    struct Record_Header
+    {
+        uint64_t file_name_size;
+        uint64_t read_id_size;
+        uint64_t file_size;
+        int64_t file_mtime;
+        uint32_t strand_bounds[4];
+        uint32_t num_ed_events;
+        uint32_t padding;
+        uint64_t n_events[2];
+        double sampling_rate;
+        double abasic_level;
+    }; // struct Record_Header
+
+    static_assert(sizeof(Header) % 8 == 0, "Event_Cache: unaligned header");
+    static_assert(sizeof(Record_Header) % 8 == 0, "Event_Cache: unaligned record header");
+
+    static size_t padded(size_t n) { return (n + 7) & ~size_t(7); }
+
+    static bool get_file_stamp(const std::string& fn, uint64_t& file_size, int64_t& file_mtime)
+    {
+        struct stat st;
+        if (stat(fn.c_str(), &st) != 0)
+        {
+            return false;
+        }
+        file_size = st.st_size;
+        file_mtime = st.st_mtime;
+        return true;
+    }
+
+    Header make_header() const
+    {
+        Header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, "NCEVCACH", 8);
+        h.version = version;
+        h.float_size = sizeof(Float_Type);
+        h.byte_order = byte_order;
+        h.options = _options;
+        return h;
+    }
+
+    bool open_read()
+    {
+        int fd = ::open(_file_name.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 and size_t(st.st_size) >= sizeof(Header))
+        {
+            p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (p == MAP_FAILED)
+        {
+            LOG("Event_Cache", warning) << "event cache [" << _file_name << "]: cannot map file" << std::endl;
+            return false;
+        }
+        _map_ptr = static_cast< const char* >(p);
+        _map_size = st.st_size;
+        if (not index_records())
+        {
+            close();
+            return false;
+        }
+        LOG("Event_Cache", info)
+            << "event cache [" << _file_name << "]: read records [" << _record_m.size() << "]" << std::endl;
+        return true;
+    }
+
+    // check the header, and index the records of a mapped cache file
+    bool index_records()
+    {
+        Header h;
+        std::memcpy(&h, _map_ptr, sizeof(h));
+        Header h_crt = make_header();
+        if (std::memcmp(h.magic, h_crt.magic, 8) != 0 or h.version != version
+            or h.float_size != sizeof(Float_Type) or h.byte_order != byte_order)
+        {
+            LOG("Event_Cache", warning)
+                << "event cache [" << _file_name << "]: incompatible format; rebuilding" << std::endl;
+            return false;
+        }
+        if (not (h.options == _options))
+        {
+            LOG("Event_Cache", warning)
+                << "event cache [" << _file_name << "]: built with different options; rebuilding" << std::endl;
+            return false;
+        }
+        if (h.index_offset > _map_size or h.n_records > (_map_size - h.index_offset) / sizeof(uint64_t))
+        {
+            LOG("Event_Cache", warning) << "event cache [" << _file_name << "]: truncated; rebuilding" << std::endl;
+            return false;
+        }
+        const uint64_t* index = reinterpret_cast< const uint64_t* >(_map_ptr + h.index_offset);
+        for (uint64_t i = 0; i < h.n_records; ++i)
+        {
+            Record rec;
+            if (not get_record(index[i], h.index_offset, rec))
+            {
+                LOG("Event_Cache", warning) << "event cache [" << _file_name << "]: corrupt; rebuilding" << std::endl;
+                _record_m.clear();
+                return false;
+            }
+            std::string key = rec.file_name;
+            _record_m[key] = std::move(rec);
+        }
+        return true;
+    }
+
+    bool get_record(uint64_t offset, uint64_t end, Record& rec) const
+    {
+        if (offset % 8 != 0 or offset > end or end - offset < sizeof(Record_Header)) return false;
+        Record_Header h;
+        std::memcpy(&h, _map_ptr + offset, sizeof(h));
+        offset += sizeof(h);
+        // sizes are untrusted: compare each against the space left, so that sums cannot wrap
+        if (h.file_name_size > end - offset or h.read_id_size > end - offset - h.file_name_size) return false;
+        rec.file_name.assign(_map_ptr + offset, h.file_name_size);
+        rec.read_id.assign(_map_ptr + offset + h.file_name_size, h.read_id_size);
+        rec.file_size = h.file_size;
+        rec.file_mtime = h.file_mtime;
+        if (padded(h.file_name_size + h.read_id_size) > end - offset) return false;
+        offset += padded(h.file_name_size + h.read_id_size);
+        std::copy(h.strand_bounds, h.strand_bounds + 4, rec.strand_bounds.begin());
+        rec.num_ed_events = h.num_ed_events;
+        rec.sampling_rate = h.sampling_rate;
+        rec.abasic_level = h.abasic_level;
+        for (unsigned st = 0; st < 2; ++st)
+        {
+            rec.n_events[st] = h.n_events[st];
+            if (h.n_events[st] > (end - offset) / (n_columns * sizeof(Float_Type))) return false;
+            for (unsigned k = 0; k < n_columns; ++k)
+            {
+                rec.columns[st][k] = reinterpret_cast< const Float_Type* >(_map_ptr + offset);
+                offset += h.n_events[st] * sizeof(Float_Type);
+            }
+            if (padded(offset) > end) return false;
+            offset = padded(offset);
+        }
+        return true;
+    }
+
+    bool open_write()
+    {
+        _ofs.open(_file_name + ".tmp", std::ios::binary | std::ios::trunc);
+        if (not _ofs.is_open())
+        {
+            LOG("Event_Cache", error)
+                << "event cache [" << _file_name << "]: cannot write: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        _pos = 0;
+        Header h = make_header();
+        write(&h, sizeof(h));
+        LOG("Event_Cache", info) << "event cache [" << _file_name << "]: writing" << std::endl;
+        return true;
+    }
+
+    // append a record; with _mutex held, unless single-threaded
+    void write_record(const Record& rec)
+    {
+        Record_Header h;
+        std::memset(&h, 0, sizeof(h));
+        h.file_name_size = rec.file_name.size();
+        h.read_id_size = rec.read_id.size();
+        h.file_size = rec.file_size;
+        h.file_mtime = rec.file_mtime;
+        std::copy(rec.strand_bounds.begin(), rec.strand_bounds.end(), h.strand_bounds);
+        h.num_ed_events = rec.num_ed_events;
+        h.n_events[0] = rec.n_events[0];
+        h.n_events[1] = rec.n_events[1];
+        h.sampling_rate = rec.sampling_rate;
+        h.abasic_level = rec.abasic_level;
+        _index_v.push_back(_pos);
+        write(&h, sizeof(h));
+        write(rec.file_name.data(), rec.file_name.size());
+        write(rec.read_id.data(), rec.read_id.size());
+        pad();
+        for (unsigned st = 0; st < 2; ++st)
+        {
+            for (unsigned k = 0; k < n_columns; ++k)
+            {
+                write(rec.columns[st][k], rec.n_events[st] * sizeof(Float_Type));
+            }
+            pad();
+        }
+    }
+
+    void write(const void* p, size_t n)
+    {
+        _ofs.write(static_cast< const char* >(p), n);
+        _pos += n;
+    }
+    void pad()
+    {
+        static const char zeros[8] = {};
+        write(zeros, padded(_pos) - _pos);
+    }
+
+    std::string _file_name;
+    Options _options;
+    // reading
+    const char* _map_ptr;
+    size_t _map_size;
+    std::unordered_map< std::string, Record > _record_m;
+    // records read which are stale or replaced
+    std::unordered_set< std::string > _dropped_s;
+    // writing
+    std::ofstream _ofs;
+    uint64_t _pos;
+    std::vector< uint64_t > _index_v;
+    bool _write_failed;
+    std::mutex _mutex;
+}; // class Event_Cache
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef __FAST5_IMAGE_HPP
+#define __FAST5_IMAGE_HPP
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "logger.hpp"
+
+/**
+ * Staged image of a fast5 file.
+ * If staging_dir() is set, the file is read with one large sequential read, and written to
+ * a temporary file in staging_dir(), normally on a memory-backed filesystem such as /dev/shm.
+ * The many small reads done by HDF5 while parsing the file then hit memory instead of the
+ * original storage. The copy is done outside of any HDF5 lock, so several threads can stage
+ * files in parallel. The staged file is removed on destruction.
+ * If staging is disabled, or it fails, path() is the original file name.
+ */
+class Fast5_Image
+{
+public:
+    /**
+     * Directory for staged images (empty: disabled).
+     */
+    static std::string& staging_dir()
+    {
+        static std::string _staging_dir;
+        return _staging_dir;
+    }
+
+    explicit Fast5_Image(const std::string& file_name) : _path(file_name), _staged(false)
+    {
+        if (staging_dir().empty()) return;
+        std::vector< char > buf;
+        if (not read_file(file_name, buf)) return;
+        std::string tmp_name = staging_dir() + "/nanocall.XXXXXX";
+        std::vector< char > tmp_name_v(tmp_name.begin(), tmp_name.end());
+        tmp_name_v.push_back('\0');
+        int fd = mkstemp(tmp_name_v.data());
+        if (fd < 0)
+        {
+            LOG("Fast5_Image", warning)
+                << staging_dir() << ": cannot create staging file: " << std::strerror(errno) << std::endl;
+            return;
+        }
+        bool ok = write_all(fd, buf);
+        ok = (close(fd) == 0) and ok;
+        if (not ok)
+        {
+            LOG("Fast5_Image", warning)
+                << tmp_name_v.data() << ": cannot write staging file: " << std::strerror(errno) << std::endl;
+            unlink(tmp_name_v.data());
+            return;
+        }
+        _path = tmp_name_v.data();
+        _staged = true;
+        LOG("Fast5_Image", debug)
+            << "staged [" << file_name << "] as [" << _path << "] bytes [" << buf.size() << "]" << std::endl;
+    }
+    Fast5_Image(const Fast5_Image&) = delete;
+    Fast5_Image& operator = (const Fast5_Image&) = delete;
+    ~Fast5_Image()
+    {
+        if (_staged)
+        {
+            unlink(_path.c_str());
+        }
+    }
+
+    const std::string& path() const { return _path; }
+    bool staged() const { return _staged; }
+
+private:
+    static bool read_file(const std::string& file_name, std::vector< char >& buf)
+    {
+        int fd = open(file_name.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        bool ok = (fstat(fd, &st) == 0);
+        if (ok)
+        {
+            buf.resize(st.st_size);
+            size_t n = 0;
+            while (n < buf.size())
+            {
+                ssize_t k = read(fd, buf.data() + n, buf.size() - n);
+                if (k < 0 and errno == EINTR) continue;
+                if (k <= 0) break;
+                n += k;
+            }
+            ok = (n == buf.size());
+        }
+        close(fd);
+        return ok;
+    }
+    static bool write_all(int fd, const std::vector< char >& buf)
+    {
+        size_t n = 0;
+        while (n < buf.size())
+        {
+            ssize_t k = write(fd, buf.data() + n, buf.size() - n);
+            if (k < 0 and errno == EINTR) continue;
+            if (k <= 0) return false;
+            n += k;
+        }
+        return true;
+    }
+
+    std::string _path;
+    bool _staged;
+}; // class Fast5_Image
+
+#endif
@@ -5,15 +5,14 @@
 #include <string>
 #include <vector>
 #include <memory>
-
-#ifndef H5_HAVE_THREADSAFE
 #include <mutex>
-#endif
 
 #include "Pore_Model.hpp"
 #include "State_Transitions.hpp"
 #include "Event.hpp"
+#include "Event_Cache.hpp"
 #include "fast5.hpp"
+#include "Fast5_Image.hpp"
 #include "alg.hpp"
 
 template < typename Float_Type >
@@ -26,6 +25,7 @@ public:
     typedef Event< Float_Type > Event_Type;
     typedef Event_Sequence< Float_Type > Event_Sequence_Type;
     typedef State_Transition_Parameters< Float_Type > State_Transition_Parameters_Type;
+    typedef typename Event_Cache< Float_Type >::Record Event_Cache_Record_Type;
 
     std::string file_name;
     std::string base_file_name;
@@ -39,6 +39,8 @@ public:
     Float_Type sampling_rate;
     Float_Type abasic_level;
     bool valid;
+    // an HDF5 error occurred after the file was opened; the summary must not be cached
+    bool io_error;
     bool scale_strands_together;
 
     // from fast5 file
@@ -82,165 +84,123 @@ public:
         return _max_read_len;
     }
 
-    Fast5_Summary() : valid(false) {}
+    /**
+     * Mutex guarding HDF5 calls, used when the HDF5 library is not thread-safe.
+     */
+    static std::mutex& fast5_mutex()
+    {
+        static std::mutex _fast5_mutex;
+        return _fast5_mutex;
+    }
+
+    Fast5_Summary() : valid(false), io_error(false) {}
     Fast5_Summary(const std::string fn, const Pore_Model_Dict_Type& models, bool sst)
-        : valid(false) { summarize(fn, models, sst); }
+        : valid(false), io_error(false) { summarize(fn, models, sst); }
 
+    /**
+     * Summarize a read from its fast5 file. If the file cannot be opened, the summary is
+     * left invalid.
+     */
     void summarize(const std::string& fn, const Pore_Model_Dict_Type& models, bool sst)
     {
         valid = true;
-        // initialize fields
-        file_name = fn;
-        auto pos = file_name.find_last_of('/');
-        base_file_name = (pos != std::string::npos? file_name.substr(pos + 1) : file_name);
-        if (base_file_name.substr(base_file_name.size() - 6) == ".fast5")
-        {
-            base_file_name.resize(base_file_name.size() - 6);
-        }
-        read_id = base_file_name;
-        strand_bounds = {{ 0, 0, 0, 0 }};
-        time_length = {{ 0.0, 0.0 }};
-        num_ed_events = 0;
-        abasic_level = 0.0;
-        fast5::File f;
+        io_error = false;
+        drop_events();
+        init_fields(fn);
+        Fast5_Image image(file_name); // outside the HDF5 lock
         do
         {
-            try
+            // the HDF5 lock is only held while reading the file
+            if (not read_fast5(image.path()))
             {
-                // open file
-                f.open(file_name); // can throw
-                // get sampling rate
-                sampling_rate = f.get_sampling_rate(); // can throw
-                if (sampling_rate < 1000.0 or sampling_rate > 10000.0)
-                {
-                    LOG("Fast5_Summary", warning) << file_name << ": unexpected sampling rate: " << sampling_rate << std::endl;
-                    break;
-                }
-                // get ed events
-                if (not f.have_eventdetection_events())
-                {
-                    LOG("Fast5_Summary", info) << file_name << ": no eventdetection events" << std::endl;
-                    break;
-                }
-                load_ed_events(&f);
-                num_ed_events = ed_events().size();
-                if (num_ed_events < 100 + min_read_len())
-                {
-                    LOG("Fast5_Summary", info) << file_name << ": not enough eventdetection events: " << num_ed_events << std::endl;
-                    num_ed_events = 0;
-                    break;
-                }
-                if (num_ed_events > max_read_len())
-                {
-                    LOG("Fast5_Summary", info) << file_name << ": too many eventdetection events: " << num_ed_events << std::endl;
-                    num_ed_events = 0;
-                    break;
-                }
-                // get ed event params
-                auto ed_params = f.get_eventdetection_event_parameters(); // can throw
-                if (not ed_params.read_id.empty())
-                {
-                    read_id = ed_params.read_id;
-                }
-                // get abasic level
-                abasic_level = detect_abasic_level();
-                if (abasic_level <= 1.0)
-                {
-                    LOG("Fast5_Summary", info) << file_name << ": abasic level too low: " << abasic_level << std::endl;
-                    num_ed_events = 0;
-                    break;
-                }
-                // detect strands
-                detect_strands();
-                if (strand_bounds[1] <= strand_bounds[0])
-                {
-                    LOG("Fast5_Summary", info) << file_name << ": no template strand detected" << std::endl;
-                    num_ed_events = 0;
-                    break;
-                }
-                scale_strands_together = (sst
-                                          and strand_bounds[1] - strand_bounds[0] >= min_read_len()
-                                          and strand_bounds[3] - strand_bounds[2] >= min_read_len());
-                // compute time lengths
-                load_events(&f);
-                for (unsigned st = 0; st < 2; ++st)
-                {
-                    if (events(st).size() < min_read_len()) continue;
-                    time_length[st] = events(st).rbegin()->start + events(st).rbegin()->length;
-                }
-                //
-                // compute initial model scalings
-                //
-                if (scale_strands_together)
-                {
-                    auto r0 = alg::mean_stdv_of< Float_Type >(
-                        events(0),
-                        [] (const Event_Type& ev) { return ev.mean; });
-                    auto r1 = alg::mean_stdv_of< Float_Type >(
-                        events(1),
-                        [] (const Event_Type& ev) { return ev.mean; });
-                    for (const auto& p0 : models)
-                        if (p0.second.strand() == 0 or p0.second.strand() == 2)
-                            for (const auto& p1 : models)
-                                if (p1.second.strand() == 1 or p1.second.strand() == 2)
-                                {
-                                    std::array< std::string, 2 > m_name = {{ p0.first, p1.first }};
-                                    Pore_Model_Parameters_Type pm_params;
-                                    pm_params.scale = (r0.second / p0.second.stdv()
-                                                       + r1.second / p1.second.stdv()) / 2;
-                                    pm_params.shift = (r0.first - pm_params.scale * p0.second.mean()
-                                                       + r1.first - pm_params.scale * p1.second.mean()) / 2;
-                                    LOG("Fast5_Summary", debug)
-                                        << "initial_scaling read [" << read_id
-                                        << "] strand [2] model [" << m_name[0] << "+" << m_name[1]
-                                        << "] pm_params [" << pm_params << "]" << std::endl;
-                                    pm_params_m[m_name] = std::move(pm_params);
-                                    st_params_m[m_name][0] = State_Transition_Parameters_Type();
-                                    st_params_m[m_name][1] = State_Transition_Parameters_Type();
-                                }
-                }
-                else // not scale_strands_together
-                {
-                    for (unsigned st = 0; st < 2; ++st)
-                    {
-                        if (events(st).size() < min_read_len()) continue;
-                        auto r = alg::mean_stdv_of< Float_Type >(
-                            events(st),
-                            [] (const Event_Type& ev) { return ev.mean; });
-                        for (const auto& p : models)
-                        {
-                            if (p.second.strand() == st or p.second.strand() == 2)
-                            {
-                                std::array< std::string, 2 > m_name;
-                                m_name[st] = p.first;
-                                Pore_Model_Parameters_Type pm_params;
-                                pm_params.scale = r.second / p.second.stdv();
-                                pm_params.shift = r.first - pm_params.scale * p.second.mean();
-                                LOG("Fast5_Summary", debug)
-                                    << "initial_scaling read [" << read_id
-                                    << "] strand [" << st
-                                    << "] model [" << m_name[st]
-                                    << "] pm_params [" << pm_params << "]" << std::endl;
-                                pm_params_m[m_name] = std::move(pm_params);
-                                st_params_m[m_name][st] = State_Transition_Parameters_Type();
-                            }
-                        }
-                    }
-                }
+                num_ed_events = 0;
+                break;
             }
-            catch (hdf5_tools::Exception& e)
+            // get abasic level
+            abasic_level = detect_abasic_level();
+            if (abasic_level <= 1.0)
             {
-                LOG(warning) << file_name << ": HDF5 error: " << e.what() << std::endl;
+                LOG("Fast5_Summary", info) << file_name << ": abasic level too low: " << abasic_level << std::endl;
+                num_ed_events = 0;
+                break;
+            }
+            // detect strands
+            detect_strands();
+            if (strand_bounds[1] <= strand_bounds[0])
+            {
+                LOG("Fast5_Summary", info) << file_name << ": no template strand detected" << std::endl;
                 num_ed_events = 0;
+                break;
             }
+            scale_strands_together = can_scale_strands_together(sst);
+            load_events();
+            init_scalings(models);
         } while (false);
-        drop_events();
+        // keep the filtered events until drop_events(), saving a second file open
+        if (num_ed_events == 0)
+        {
+            drop_events();
+        }
         ed_events_ptr.reset();
     } // summarize
 
+    /**
+     * Summarize a read from its event cache record, without opening its fast5 file.
+     * The filtered events are restored from the cache.
+     */
+    void summarize(const Event_Cache_Record_Type& rec, const Pore_Model_Dict_Type& models, bool sst)
+    {
+        valid = true;
+        io_error = false;
+        drop_events();
+        init_fields(rec.file_name);
+        read_id = rec.read_id;
+        strand_bounds = rec.strand_bounds;
+        num_ed_events = rec.num_ed_events;
+        sampling_rate = rec.sampling_rate;
+        abasic_level = rec.abasic_level;
+        if (num_ed_events == 0) return;
+        scale_strands_together = can_scale_strands_together(sst);
+        for (unsigned st = 0; st < 2; ++st)
+        {
+            events_ptr[st].reset(new Event_Sequence_Type());
+            rec.get_events(st, events(st));
+        }
+        init_scalings(models);
+    }
+
+    /**
+     * Event cache record of this read. If the read has events, they must be loaded.
+     */
+    Event_Cache_Record_Type cache_record() const
+    {
+        Event_Cache_Record_Type rec;
+        rec.file_name = file_name;
+        rec.read_id = read_id;
+        rec.strand_bounds = strand_bounds;
+        rec.num_ed_events = num_ed_events;
+        rec.sampling_rate = sampling_rate;
+        rec.abasic_level = abasic_level;
+        rec.n_events = {{ 0, 0 }};
+        rec.columns = {};
+        if (num_ed_events > 0)
+        {
+            for (unsigned st = 0; st < 2; ++st)
+            {
+                rec.set_events(st, events(st));
+            }
+        }
+        return rec;
+    }
+
     void load_events(fast5::File* f_p = nullptr)
     {
         assert(valid);
+        if (events_ptr[0] and events_ptr[1])
+        {
+            // kept since summarize()
+            return;
+        }
         drop_events();
         if (num_ed_events == 0)
         {
@@ -249,14 +209,18 @@ public:
         bool must_load_ed_events = not ed_events_ptr;
         if (must_load_ed_events)
         {
+            bool must_open_file = not f_p;
+            std::unique_ptr< Fast5_Image > image_ptr;
+            if (must_open_file)
+            {
+                image_ptr.reset(new Fast5_Image(file_name)); // outside the HDF5 lock
+            }
 #ifndef H5_HAVE_THREADSAFE
-            static std::mutex fast5_mutex;
-            std::lock_guard< std::mutex > fast5_lock(fast5_mutex);
+            std::lock_guard< std::mutex > fast5_lock(fast5_mutex());
 #endif
-            bool must_open_file = not f_p;
             if (must_open_file)
             {
-                f_p = new fast5::File(file_name);
+                f_p = new fast5::File(image_ptr->path());
             }
             assert(f_p->is_open());
             load_ed_events(f_p);
@@ -268,6 +232,7 @@ public:
         for (unsigned st = 0; st < 2; ++st)
         {
             events_ptr[st] = typename decltype(events_ptr)::value_type(new typename decltype(events_ptr)::value_type::element_type ());
+            events(st).reserve(strand_bounds[2 * st + 1] - strand_bounds[2 * st]);
             for (unsigned j = strand_bounds[2 * st]; j < strand_bounds[2 * st + 1]; ++j)
             {
                 if (filter_ed_event(ed_events()[j], abasic_level))
@@ -278,7 +243,7 @@ public:
                     e.start = (ed_events()[j].start - ed_events()[strand_bounds[scale_strands_together? 0 : 2 * st]].start) / sampling_rate;
                     e.length = ed_events()[j].length / sampling_rate;
                     e.update_logs();
-                    events(st).emplace_back(std::move(e));
+                    events(st).push_back(e);
                 }
             }
         }
@@ -287,6 +252,19 @@ public:
             ed_events_ptr.reset();
         }
     }
+    // bytes held by the filtered events
+    size_t events_mem_size() const
+    {
+        size_t res = 0;
+        for (unsigned st = 0; st < 2; ++st)
+        {
+            if (events_ptr[st])
+            {
+                res += events_ptr[st]->mem_size();
+            }
+        }
+        return res;
+    }
     void drop_events()
     {
         for (unsigned st = 0; st < 2; ++st)
@@ -361,6 +339,161 @@ public:
     }
 
 private:
+    // read sampling rate, eventdetection events and read id from the fast5 file at path,
+    // under the HDF5 lock; return false if the read is to be skipped
+    bool read_fast5(const std::string& path)
+    {
+#ifndef H5_HAVE_THREADSAFE
+        std::lock_guard< std::mutex > fast5_lock(fast5_mutex());
+#endif
+        fast5::File f;
+        try
+        {
+            // open file
+            f.open(path); // can throw
+            // get sampling rate
+            sampling_rate = f.get_sampling_rate(); // can throw
+            if (sampling_rate < 1000.0 or sampling_rate > 10000.0)
+            {
+                LOG("Fast5_Summary", warning) << file_name << ": unexpected sampling rate: " << sampling_rate << std::endl;
+                return false;
+            }
+            // get ed events
+            if (not f.have_eventdetection_events())
+            {
+                LOG("Fast5_Summary", info) << file_name << ": no eventdetection events" << std::endl;
+                return false;
+            }
+            load_ed_events(&f);
+            num_ed_events = ed_events().size();
+            if (num_ed_events < 100 + min_read_len())
+            {
+                LOG("Fast5_Summary", info) << file_name << ": not enough eventdetection events: " << num_ed_events << std::endl;
+                return false;
+            }
+            if (max_read_len() > 0 and num_ed_events > max_read_len())
+            {
+                LOG("Fast5_Summary", info) << file_name << ": too many eventdetection events: " << num_ed_events << std::endl;
+                return false;
+            }
+            // get ed event params
+            auto ed_params = f.get_eventdetection_event_parameters(); // can throw
+            if (not ed_params.read_id.empty())
+            {
+                read_id = ed_params.read_id;
+            }
+        }
+        catch (hdf5_tools::Exception& e)
+        {
+            if (not f.is_open())
+            {
+                // not a fast5 file
+                LOG("Fast5_Summary", info) << file_name << ": cannot open: " << e.what() << std::endl;
+                valid = false;
+            }
+            else
+            {
+                LOG(warning) << file_name << ": HDF5 error: " << e.what() << std::endl;
+                io_error = true;
+            }
+            return false;
+        }
+        return true;
+    } // read_fast5
+
+    void init_fields(const std::string& fn)
+    {
+        file_name = fn;
+        auto pos = file_name.find_last_of('/');
+        base_file_name = (pos != std::string::npos? file_name.substr(pos + 1) : file_name);
+        if (base_file_name.size() >= 6 and base_file_name.substr(base_file_name.size() - 6) == ".fast5")
+        {
+            base_file_name.resize(base_file_name.size() - 6);
+        }
+        read_id = base_file_name;
+        strand_bounds = {{ 0, 0, 0, 0 }};
+        time_length = {{ 0.0, 0.0 }};
+        num_ed_events = 0;
+        sampling_rate = 0.0;
+        abasic_level = 0.0;
+    }
+
+    bool can_scale_strands_together(bool sst) const
+    {
+        return (sst
+                and strand_bounds[1] - strand_bounds[0] >= min_read_len()
+                and strand_bounds[3] - strand_bounds[2] >= min_read_len());
+    }
+
+    // compute time lengths and initial model scalings, from the filtered events
+    void init_scalings(const Pore_Model_Dict_Type& models)
+    {
+        for (unsigned st = 0; st < 2; ++st)
+        {
+            if (events(st).size() < min_read_len()) continue;
+            time_length[st] = events(st).back().start + events(st).back().length;
+        }
+        //
+        // compute initial model scalings
+        //
+        if (scale_strands_together)
+        {
+            auto r0 = alg::mean_stdv_of< Float_Type >(
+                events(0).mean(),
+                [] (Float_Type x) { return x; });
+            auto r1 = alg::mean_stdv_of< Float_Type >(
+                events(1).mean(),
+                [] (Float_Type x) { return x; });
+            for (const auto& p0 : models)
+                if (p0.second.strand() == 0 or p0.second.strand() == 2)
+                    for (const auto& p1 : models)
+                        if (p1.second.strand() == 1 or p1.second.strand() == 2)
+                        {
+                            std::array< std::string, 2 > m_name = {{ p0.first, p1.first }};
+                            Pore_Model_Parameters_Type pm_params;
+                            pm_params.scale = (r0.second / p0.second.stdv()
+                                               + r1.second / p1.second.stdv()) / 2;
+                            pm_params.shift = (r0.first - pm_params.scale * p0.second.mean()
+                                               + r1.first - pm_params.scale * p1.second.mean()) / 2;
+                            LOG("Fast5_Summary", debug)
+                                << "initial_scaling read [" << read_id
+                                << "] strand [2] model [" << m_name[0] << "+" << m_name[1]
+                                << "] pm_params [" << pm_params << "]" << std::endl;
+                            pm_params_m[m_name] = std::move(pm_params);
+                            st_params_m[m_name][0] = State_Transition_Parameters_Type();
+                            st_params_m[m_name][1] = State_Transition_Parameters_Type();
+                        }
+        }
+        else // not scale_strands_together
+        {
+            for (unsigned st = 0; st < 2; ++st)
+            {
+                if (events(st).size() < min_read_len()) continue;
+                auto r = alg::mean_stdv_of< Float_Type >(
+                    events(st).mean(),
+                    [] (Float_Type x) { return x; });
+                for (const auto& p : models)
+                {
+                    if (p.second.strand() == st or p.second.strand() == 2)
+                    {
+                        std::array< std::string, 2 > m_name;
+                        m_name[st] = p.first;
+                        Pore_Model_Parameters_Type pm_params;
+                        pm_params.scale = r.second / p.second.stdv();
+                        pm_params.shift = r.first - pm_params.scale * p.second.mean();
+                        LOG("Fast5_Summary", debug)
+                            << "initial_scaling read [" << read_id
+                            << "] strand [" << st
+                            << "] model [" << m_name[st]
+                            << "] pm_params [" << pm_params << "]" << std::endl;
+                        pm_params_m[m_name] = std::move(pm_params);
+                        st_params_m[m_name][st] = State_Transition_Parameters_Type();
+                    }
+                }
+            }
+        }
+    } // init_scalings()
+
     void load_ed_events(fast5::File* f_p)
     {
         ed_events_ptr = decltype(ed_events_ptr)(new typename decltype(ed_events_ptr)::element_type(f_p->get_eventdetection_events()));
@@ -1,13 +1,19 @@
 #ifndef __FORWARD_BACKWARD_HPP
 #define __FORWARD_BACKWARD_HPP
 
+#include <algorithm>
+#include <array>
+#include <cassert>
 #include <cmath>
 #include <iostream>
+#include <limits>
 #include <vector>
 #include <set>
 
 #include "Pore_Model.hpp"
+#include "Emission_Matrix.hpp"
 #include "State_Transitions.hpp"
+#include "Thread_Team.hpp"
 #include "logsumset.hpp"
 #include "logger.hpp"
 
@@ -17,140 +23,997 @@ class Forward_Backward
 public:
     typedef Kmer< Kmer_Size > Kmer_Type;
     typedef Pore_Model< Float_Type, Kmer_Size > Pore_Model_Type;
+    typedef Pore_Model_Emissions< Float_Type, Kmer_Size > Pore_Model_Emissions_Type;
     typedef State_Transitions< Float_Type, Kmer_Size > State_Transitions_Type;
+    typedef typename State_Transitions_Type::State_Transition_Groups_Type State_Transition_Groups_Type;
+    typedef typename State_Transitions_Type::State_Transition_Table_Type State_Transition_Table_Type;
     typedef Event< Float_Type > Event_Type;
-    typedef Event_Sequence< Float_Type > Event_Sequence_Type;
+    typedef Event_Sequence_View< Float_Type > Event_Sequence_View_Type;
     typedef logsum::logsumset< Float_Type > LogSumSet_Type;
-
-    struct Matrix_Entry
-    {
-        Float_Type alpha; // := Pr[ E_1 ... E_i, S_i = j ]
-        Float_Type beta;  // := Pr[ E_{i+1} ... E_n | S_i = j ]
-    }; // struct Matrix_Entry
+    // pairs (state, posterior)
+    typedef std::vector< std::pair< unsigned, Float_Type > > Sparse_Posterior_Type;
 
     static const unsigned n_states = Pore_Model_Type::n_states;
 
-    void clear() { _m.clear(); }
-    unsigned n_events() const { return _m.size() / n_states; }
+    void clear()
+    {
+        _alpha.clear(); _beta.clear(); _alpha_cp.clear();
+        _alpha_scale.clear(); _beta_scale.clear(); _post_scale.clear();
+        _n_events = 0; _filled = false;
+    }
+    // number of events of the last fill() or sweep()
+    unsigned n_events() const { return _n_events; }
+    // whether the full tables are stored, i.e., the last call was to fill()
+    bool filled() const { return _filled; }
 
     // i: event index
     // j: state/kmer index
-    const Matrix_Entry& cell(unsigned i, unsigned j) const { return _m[i * n_states + j]; }
-    Matrix_Entry& cell(unsigned i, unsigned j) { return _m[i * n_states + j]; }
+    // alpha(i, j) := Pr[ E_1 ... E_i, S_i = j ]
+    // beta(i, j) := Pr[ E_{i+1} ... E_n | S_i = j ]
+    // log_alpha(), log_beta() and (log_)posterior() are only valid after fill()
+    Float_Type log_alpha(unsigned i, unsigned j) const
+    {
+        assert(_filled and i < _n_events);
+        return _scaled
+            ? std::log(_alpha[i * n_states + j]) + _alpha_scale[i]
+            : _alpha[i * n_states + j];
+    }
+    Float_Type log_beta(unsigned i, unsigned j) const
+    {
+        assert(_filled and i < _n_events);
+        return _scaled
+            ? std::log(_beta[i * n_states + j]) + _beta_scale[i]
+            : _beta[i * n_states + j];
+    }
 
-    Float_Type log_posterior(unsigned i, unsigned j) const { return cell(i, j).alpha + cell(i, j).beta - _log_pr_data; }
+    Float_Type log_posterior(unsigned i, unsigned j) const
+    {
+        return _scaled
+            ? std::log(posterior(i, j))
+            : log_alpha(i, j) + log_beta(i, j) - _log_pr_data;
+    }
+    // Pr[ S_i = j | E_1 ... E_n ]; no exp() needed in scaled() mode
+    Float_Type posterior(unsigned i, unsigned j) const
+    {
+        assert(_filled and i < _n_events);
+        return _scaled
+            ? double(_alpha[i * n_states + j]) * _beta[i * n_states + j] * _post_scale[i]
+            : std::exp(log_posterior(i, j));
+    }
     Float_Type log_pr_data() const { return _log_pr_data; }
+    /**
+     * Sparse posterior of event i: states with posterior(i, j) >= sparse_min_posterior(),
+     * by decreasing posterior, up to a total of sparse_max_mass().
+     */
+    void sparse_posterior(unsigned i, Sparse_Posterior_Type& res) const
+    {
+        make_sparse_posterior([&] (unsigned j) { return posterior(i, j); }, res);
+    }
+    // same, from the posteriors p_fn(j) of all states j, e.g., of a row passed to a sweep() visitor
+    template < typename Posterior_Fn >
+    static void make_sparse_posterior(Posterior_Fn&& p_fn, Sparse_Posterior_Type& res)
+    {
+        res.clear();
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            Float_Type p = p_fn(j);
+            if (p >= sparse_min_posterior())
+            {
+                res.emplace_back(j, p);
+            }
+        }
+        std::sort(res.begin(), res.end(), [] (const std::pair< unsigned, Float_Type >& lhs,
+                                              const std::pair< unsigned, Float_Type >& rhs) {
+            return lhs.second > rhs.second;
+        });
+        double s = 0.0;
+        unsigned k = 0;
+        while (k < res.size() and s < sparse_max_mass())
+        {
+            s += res[k++].second;
+        }
+        res.resize(k);
+    }
+    // scaled() mode: log of the factor by which row i of alpha, resp. beta, is divided;
+    // during sweep(), beta scales are available for the rows passed to the visitor
+    double log_alpha_scale(unsigned i) const { return _alpha_scale[i]; }
+    double log_beta_scale(unsigned i) const { return _beta_scale[i]; }
 
     static unsigned& n_threads() { static unsigned _n_threads = 1; return _n_threads; }
+    /**
+     * Work in probability space: every alpha and beta row is normalized to sum 1,
+     * and the log of its scale is kept separately, so that the kernels need
+     * one exp() per cell (for the emission) and no log().
+     * Rows whose sum is not a normal Float_Type number are recomputed in log space.
+     */
+    static bool& scaled() { static bool _scaled = true; return _scaled; }
+    /**
+     * Parameters of sparse_posterior(): minimum posterior of a state, and cap on the total posterior.
+     */
+    static Float_Type& sparse_min_posterior() { static Float_Type _sparse_min_posterior = 1.0e-5; return _sparse_min_posterior; }
+    static Float_Type& sparse_max_mass() { static Float_Type _sparse_max_mass = .9999; return _sparse_max_mass; }
+    /**
+     * Per-thread memory budget for sweep(), in bytes; 0: unlimited.
+     * If the alpha rows of a full event sequence exceed it, only every
+     * sqrt(n)-th row is kept, and segments are recomputed during the backward pass.
+     */
+    static size_t& max_mem() { static size_t _max_mem = 0; return _max_mem; }
 
+    /**
+     * Compute and store the full alpha and beta tables.
+     */
     void fill(const Pore_Model_Type& pm,
               const State_Transitions_Type& st,
-              const Event_Sequence_Type& ev)
+              const Event_Sequence_View_Type& ev)
+    {
+        fill(Pore_Model_Emissions_Type(pm, ev), st);
+    }
+    /**
+     * Same, with emissions from a source such as an Emission_Matrix.
+     */
+    template < typename Emissions >
+    void fill(const Emissions& em,
+              const State_Transitions_Type& st)
     {
         clear();
-        unsigned n_events = ev.size();
-        _m.resize(n_states * n_events);
-        Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
-        LogSumSet_Type s(false);
+        _scaled = scaled();
+        unsigned n_events = em.n_events();
+        _n_events = n_events;
+        _filled = true;
+        _alpha.resize(n_states * n_events);
+        _beta.resize(n_states * n_events);
+        _alpha_scale.resize(n_events);
+        _beta_scale.resize(n_events);
+        Thread_Team& team = Thread_Team::thread_team(n_threads());
+        init_scratch(st, team);
         //
-        // forward: alpha, i == 0
+        // forward: alpha
         //
+        _alpha_scale[0] = fill_first_alpha_row(em, &_alpha[0]);
+        for (unsigned i = 1; i < n_events; ++i)
         {
-            unsigned i = 0;
             LOG("Forward_Backward", debug1) << "forward: i=" << i << std::endl;
-            for (unsigned j = 0; j < n_states; ++j)
-            {
-                cell(i, j).alpha = pm.log_pr_emission(j, ev[0]) - log_n_states;
-                LOG("Forward_Backward", debug2)
-                    << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
-                    << " alpha=" << cell(i, j).alpha << std::endl;
-            }
+            _alpha_scale[i] = _alpha_scale[i - 1]
+                + fill_alpha_row(team, em, st, i, &_alpha[(i - 1) * n_states], &_alpha[i * n_states]);
         }
+        _log_pr_data = compute_log_pr_data(&_alpha[(n_events - 1) * n_states], _alpha_scale[n_events - 1]);
         //
-        // forward: alpha, i > 0
+        // backward: beta
         //
-        for (unsigned i = 1; i < ev.size(); ++i)
+        _beta_scale[n_events - 1] = fill_last_beta_row(&_beta[(n_events - 1) * n_states]);
+        for (unsigned ip1 = n_events - 1; ip1 > 0; --ip1)
         {
-            LOG("Forward_Backward", debug1) << "forward: i=" << i << std::endl;
-            for (unsigned j = 0; j < n_states; ++j)
+            LOG("Forward_Backward", debug1) << "backward: i=" << ip1 - 1 << std::endl;
+            _beta_scale[ip1 - 1] = _beta_scale[ip1]
+                + fill_beta_row(team, em, st, ip1, &_beta[ip1 * n_states], &_beta[(ip1 - 1) * n_states]);
+        }
+        if (_scaled)
+        {
+            _post_scale.resize(n_events);
+            for (unsigned i = 0; i < n_events; ++i)
             {
-                s.clear();
-                for (const auto& p : st.neighbours(j).from_v)
-                {
-                    const unsigned& j_prev = p.first;
-                    const Float_Type& log_pr_transition = p.second;
-                    s.add(log_pr_transition + cell(i - 1, j_prev).alpha);
-                }
-                cell(i, j).alpha = pm.log_pr_emission(j, ev[i]) + s.val();
-                LOG("Forward_Backward", debug2)
-                    << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
-                    << " alpha=" << cell(i, j).alpha << std::endl;
+                // _log_pr_data is rounded to Float_Type; its double value is the scale of the last alpha row
+                _post_scale[i] = std::exp(_alpha_scale[i] + _beta_scale[i] - _alpha_scale[n_events - 1]);
             }
         }
+    }
+
+    /**
+     * Run forward-backward without storing the tables, within the max_mem() budget.
+     * Rows are passed to a visitor in decreasing order of i, as
+     * visitor(i, alpha_i, beta_i, beta_{i+1}), with beta_{i+1} == nullptr for the last event.
+     * In scaled() mode, the rows hold probabilities divided by exp(log_alpha_scale(i)),
+     * resp. exp(log_beta_scale(i)); otherwise, they hold log probabilities.
+     * log_pr_data() is available from the first call on.
+     */
+    template < typename Row_Visitor >
+    void sweep(const Pore_Model_Type& pm,
+               const State_Transitions_Type& st,
+               const Event_Sequence_View_Type& ev,
+               Row_Visitor&& visitor)
+    {
+        sweep(Pore_Model_Emissions_Type(pm, ev), st, std::forward< Row_Visitor >(visitor));
+    }
+    template < typename Emissions, typename Row_Visitor >
+    void sweep(const Emissions& em,
+               const State_Transitions_Type& st,
+               Row_Visitor&& visitor)
+    {
+        clear();
+        _scaled = scaled();
+        unsigned n_events = em.n_events();
+        _n_events = n_events;
+        Thread_Team& team = Thread_Team::thread_team(n_threads());
+        init_scratch(st, team);
+        _alpha_scale.resize(n_events);
+        _beta_scale.resize(n_events);
+        // alpha rows [c, c + seg_len) are recomputed from row c, for c a multiple of seg_len;
+        // rows of the last segment are kept from the forward pass
+        unsigned seg_len = segment_length(n_events);
+        unsigned last_cp = ((n_events - 1) / seg_len) * seg_len;
+        _alpha.resize(std::min(seg_len, n_events) * n_states);
+        _alpha_cp.resize((last_cp / seg_len) * n_states);
+        _beta.resize(2 * n_states);
+        LOG("Forward_Backward", debug)
+            << "n_events=" << n_events << " seg_len=" << seg_len
+            << " n_checkpoints=" << last_cp / seg_len << std::endl;
+        // alpha row i, in either the checkpoint or the segment
+        auto alpha_row = [&] (unsigned i) {
+            return i >= last_cp? &_alpha[(i - last_cp) * n_states] : &_alpha_cp[(i / seg_len) * n_states];
+        };
         //
-        // backward: beta, i == n-1
+        // forward: alpha
         //
+        _alpha_scale[0] = fill_first_alpha_row(em, alpha_row(0));
+        for (unsigned i = 1; i < n_events; ++i)
         {
-            unsigned i = ev.size() - 1;
-            LOG("Forward_Backward", debug1) << "backward: i=" << i << std::endl;
-            for (unsigned j = 0; j < n_states; ++j)
-            {
-                cell(i, j).beta = 0;
-                LOG("Forward_Backward", debug2)
-                    << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
-                    << " beta=" << cell(i, j).beta << std::endl;
-            }
+            LOG("Forward_Backward", debug1) << "forward: i=" << i << std::endl;
+            // rows before the last checkpoint are stored only if they are checkpoints themselves
+            Float_Type* alpha_crt = (i >= last_cp or i % seg_len == 0)? alpha_row(i) : &_tmp[i % 2][0];
+            const Float_Type* alpha_prev = (i - 1 >= last_cp or (i - 1) % seg_len == 0)? alpha_row(i - 1) : &_tmp[(i - 1) % 2][0];
+            _alpha_scale[i] = _alpha_scale[i - 1] + fill_alpha_row(team, em, st, i, alpha_prev, alpha_crt);
         }
+        _log_pr_data = compute_log_pr_data(alpha_row(n_events - 1), _alpha_scale[n_events - 1]);
         //
-        // backward: beta, i < n-1
+        // backward: beta, segment by segment
         //
-        for (unsigned ip1 = ev.size() - 1; ip1 > 0; --ip1)
+        _beta_scale[n_events - 1] = fill_last_beta_row(&_beta[((n_events - 1) % 2) * n_states]);
+        visitor(n_events - 1, alpha_row(n_events - 1), &_beta[((n_events - 1) % 2) * n_states],
+                static_cast< const Float_Type* >(nullptr));
+        unsigned seg_begin = last_cp;
+        for (unsigned ip1 = n_events - 1; ip1 > 0; --ip1)
         {
             unsigned i = ip1 - 1;
-            LOG("Forward_Backward", debug1) << "backward: i=" << i << std::endl;
-            for (unsigned j = 0; j < n_states; ++j)
+            if (i < seg_begin)
             {
-                s.clear();
-                for (const auto& p : st.neighbours(j).to_v)
+                // recompute alpha rows [i + 1 - seg_len, i] from checkpoint i + 1 - seg_len
+                seg_begin = i + 1 - seg_len;
+                LOG("Forward_Backward", debug1) << "recompute: i=" << seg_begin << ".." << i << std::endl;
+                std::copy(alpha_row(seg_begin), alpha_row(seg_begin) + n_states, _alpha.begin());
+                for (unsigned i2 = seg_begin + 1; i2 <= i; ++i2)
                 {
-                    const unsigned& j_next = p.first;
-                    const Float_Type& log_pr_transition = p.second;
-                    s.add(log_pr_transition + pm.log_pr_emission(j_next, ev[ip1]) + cell(ip1, j_next).beta);
+                    fill_alpha_row(team, em, st, i2,
+                                   &_alpha[(i2 - 1 - seg_begin) * n_states], &_alpha[(i2 - seg_begin) * n_states]);
                 }
-                cell(i, j).beta += s.val();
-                LOG("Forward_Backward", debug2)
-                    << "i=" << i << " j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
-                    << " beta=" << cell(i, j).beta << std::endl;
             }
+            LOG("Forward_Backward", debug1) << "backward: i=" << i << std::endl;
+            const Float_Type* beta_next = &_beta[(ip1 % 2) * n_states];
+            Float_Type* beta_crt = &_beta[(i % 2) * n_states];
+            _beta_scale[i] = _beta_scale[ip1] + fill_beta_row(team, em, st, ip1, beta_next, beta_crt);
+            visitor(i, &_alpha[(i - seg_begin) * n_states], beta_crt, beta_next);
         }
-        //
-        // pr_data
-        //
-        s.clear();
-        for (unsigned j = 0; j < n_states; ++j)
-        {
-            s.add(cell(ev.size() - 1, j).alpha);
-        }
-        _log_pr_data = s.val();
     }
 
+    // full tables; requires fill()
     friend std::ostream& operator << (std::ostream& os, const Forward_Backward& fwbw)
     {
+        assert(fwbw.filled());
         for (unsigned i = 0; i < fwbw.n_events(); ++i)
         {
             for (unsigned j = 0; j < fwbw.n_states; ++j)
             {
                 os << i << '\t' << j << '\t'
-                   << fwbw.cell(i, j).alpha << '\t'
-                   << fwbw.cell(i, j).beta << std::endl;
+                   << fwbw.log_alpha(i, j) << '\t'
+                   << fwbw.log_beta(i, j) << std::endl;
             }
         }
         return os;
     }
 
 private:
-    std::vector< Matrix_Entry > _m;
+    std::vector< Float_Type > _alpha;
+    std::vector< Float_Type > _beta;
+    // alpha checkpoint rows, in sweep()
+    std::vector< Float_Type > _alpha_cp;
     Float_Type _log_pr_data;
+    // scaled() mode: log scales of the alpha and beta rows, and posterior normalization factors
+    bool _scaled = false;
+    unsigned _n_events = 0;
+    bool _filled = false;
+    std::vector< double > _alpha_scale;
+    std::vector< double > _beta_scale;
+    std::vector< double > _post_scale;
+    // scratch space
+    std::array< std::vector< Float_Type >, 2 > _tmp;
+    std::vector< double > _r;
+    std::vector< Float_Type > _em;
+    std::vector< std::vector< double > > _g_sum;
+    // terms of the levels above max_local_level, by key of the lowest of them
+    std::vector< double > _u_sum;
+    std::vector< Float_Type > _part_max;
+    std::vector< double > _part_sum;
+    double _row_scale;
+    // scaled() mode: whether the last row underflowed, and the previous row in log space
+    bool _row_underflow;
+    std::vector< Float_Type > _log_row;
+    // scaled() mode without groups: transition probabilities, indexed like the transition tables
+    std::vector< Float_Type > _p_from;
+    std::vector< Float_Type > _p_to;
+
+    // number of events per checkpoint segment in sweep()
+    static unsigned segment_length(unsigned n_events)
+    {
+        if (n_events < 2
+            or max_mem() == 0
+            or size_t(n_events + 2) * n_states * sizeof(Float_Type) <= max_mem())
+        {
+            return std::max(n_events, 1u);
+        }
+        // checkpoints take n/s rows, a segment takes s rows
+        unsigned seg_len = std::ceil(std::sqrt(double(n_events)));
+        if ((size_t(n_events) / seg_len + seg_len + 2) * n_states * sizeof(Float_Type) > max_mem())
+        {
+            LOG("Forward_Backward", warning)
+                << "n_events=" << n_events << ": alpha rows exceed memory budget ["
+                << max_mem() << "]" << std::endl;
+        }
+        return std::min(seg_len, n_events);
+    }
+
+    void init_scratch(const State_Transitions_Type& st, const Thread_Team& team)
+    {
+        _part_max.resize(team.size());
+        _part_sum.resize(team.size());
+        _em.resize(n_states);
+        _r.resize(n_states);
+        _log_row.resize(n_states);
+        for (unsigned k = 0; k < 2; ++k)
+        {
+            _tmp[k].resize(n_states);
+        }
+        if (st.has_groups())
+        {
+            const State_Transition_Groups_Type& grp = st.groups();
+            _g_sum.resize(grp.n_levels() + 1);
+            for (unsigned l = 1; l <= grp.n_levels(); ++l)
+            {
+                _g_sum[l].resize(grp.n_keys(l));
+            }
+            _u_sum.resize(grp.n_keys(max_local_level + 1));
+        }
+        else if (_scaled)
+        {
+            const State_Transition_Table_Type& from = st.from_table();
+            const State_Transition_Table_Type& to = st.to_table();
+            _p_from.resize(from.log_p.size());
+            for (unsigned k = 0; k < from.log_p.size(); ++k)
+            {
+                _p_from[k] = std::exp(from.log_p[k]);
+            }
+            _p_to.resize(to.log_p.size());
+            for (unsigned k = 0; k < to.log_p.size(); ++k)
+            {
+                _p_to[k] = std::exp(to.log_p[k]);
+            }
+        }
+    }
+
+    // divide row by its sum s, which must be positive; return log(s)
+    static double normalize_row(Float_Type* row, double s)
+    {
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            row[j] /= s;
+        }
+        return std::log(s);
+    }
+    // convert a row of log probabilities to probabilities summing to 1; return the log of the scale
+    static double exp_normalize_row(Float_Type* row)
+    {
+        Float_Type m = *std::max_element(row, row + n_states);
+        if (m == -INFINITY)
+        {
+            std::fill(row, row + n_states, 0.0);
+            return -INFINITY;
+        }
+        double s = 0.0;
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            row[j] = std::exp(row[j] - m);
+            s += row[j];
+        }
+        return m + normalize_row(row, s);
+    }
+    // convert a row of probabilities to log space, into _log_row; return nullptr if the row is 0
+    const Float_Type* log_row(const Float_Type* row)
+    {
+        bool nonzero = false;
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            _log_row[j] = row[j] > 0.0? std::log(row[j]) : -INFINITY;
+            nonzero = nonzero or row[j] > 0.0;
+        }
+        return nonzero? &_log_row[0] : nullptr;
+    }
+
+    // alpha, i == 0; the row kernels return the log scale of the row they fill,
+    // relative to that of the previous row, in scaled() mode, and 0 otherwise
+    template < typename Emissions >
+    double fill_first_alpha_row(const Emissions& em, Float_Type* alpha_crt)
+    {
+        LOG("Forward_Backward", debug1) << "forward: i=0" << std::endl;
+        Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
+        em.row(0, alpha_crt);
+        if (_scaled)
+        {
+            Float_Type m = *std::max_element(alpha_crt, alpha_crt + n_states);
+            double s = 0.0;
+            for (unsigned j = 0; j < n_states; ++j)
+            {
+                alpha_crt[j] = std::exp(alpha_crt[j] - m);
+                s += alpha_crt[j];
+            }
+            return m - log_n_states + normalize_row(alpha_crt, s);
+        }
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            alpha_crt[j] -= log_n_states;
+            LOG("Forward_Backward", debug2)
+                << "j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
+                << " alpha=" << alpha_crt[j] << std::endl;
+        }
+        return 0.0;
+    }
+
+    // beta, i == n-1
+    double fill_last_beta_row(Float_Type* beta_crt)
+    {
+        Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            beta_crt[j] = _scaled? 1.0 / n_states : 0.0;
+        }
+        return _scaled? log_n_states : 0.0;
+    }
+
+    Float_Type compute_log_pr_data(const Float_Type* alpha_last, double alpha_last_scale) const
+    {
+        if (_scaled)
+        {
+            // the row sums to 1
+            return alpha_last_scale;
+        }
+        LogSumSet_Type s(false);
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            s.add(alpha_last[j]);
+        }
+        return s.val();
+    }
+
+    /**
+     * In the forward pass, states are split between team members by their (k-2)-suffix,
+     * in the backward pass, by their (k-2)-prefix: either way, the groups of levels 1 and 2
+     * are summed by each member from its own states; the groups of upper levels are few,
+     * and summed by a single member.
+     */
+    static const unsigned n_part_bits = 2 * (Kmer_Size - 2);
+    static const unsigned n_parts = 1u << n_part_bits;
+    // highest level whose groups only hold states of one part
+    static const unsigned max_local_level = Kmer_Size - n_part_bits / 2;
+
+    // apply fn to all i in [0, n) with (i mod n_parts) in part; n must be a multiple of n_parts
+    template < typename Fn >
+    static void for_each_in_suffix_part(unsigned n, std::pair< unsigned, unsigned > part, Fn&& fn)
+    {
+        for (unsigned h = 0; h < n; h += n_parts)
+        {
+            for (unsigned x = part.first; x < part.second; ++x)
+            {
+                fn(h | x);
+            }
+        }
+    }
+    // apply fn to all i in [0, n) with (i / (n / n_parts)) in part; n must be a multiple of n_parts
+    template < typename Fn >
+    static void for_each_in_prefix_part(unsigned n, std::pair< unsigned, unsigned > part, Fn&& fn)
+    {
+        unsigned w = n / n_parts;
+        for (unsigned i = part.first * w; i < part.second * w; ++i)
+        {
+            fn(i);
+        }
+    }
+
+    // maximum of the values reported by all members; includes a barrier
+    Float_Type team_max(Thread_Team& team, unsigned tid, Float_Type m)
+    {
+        _part_max[tid] = m;
+        team.barrier();
+        for (unsigned k = 0; k < team.size(); ++k)
+        {
+            m = std::max(m, _part_max[k]);
+        }
+        return m;
+    }
+    // sum of the values reported by all members; includes a barrier
+    double team_sum(Thread_Team& team, unsigned tid, double s)
+    {
+        _part_sum[tid] = s;
+        team.barrier();
+        s = 0.0;
+        for (unsigned k = 0; k < team.size(); ++k)
+        {
+            s += _part_sum[k];
+        }
+        return s;
+    }
+    // scaled() mode: given the sums s of the members' parts of a row computed with emissions
+    // shifted by em_shift, return the factor normalizing the row; member 0 saves its log scale;
+    // if the sum is not a normal Float_Type number, the row is flagged to be recomputed in log space
+    double team_row_norm(Thread_Team& team, unsigned tid, Float_Type em_shift, double s)
+    {
+        s = team_sum(team, tid, s);
+        bool underflow = not (s >= std::numeric_limits< Float_Type >::min() and std::isfinite(s));
+        if (tid == 0)
+        {
+            _row_underflow = underflow;
+            _row_scale = underflow? -INFINITY : em_shift + std::log(s);
+        }
+        return underflow? 0.0 : 1.0 / s;
+    }
+
+    // alpha, i > 0
+    template < typename Emissions >
+    double fill_alpha_row(Thread_Team& team,
+                          const Emissions& em,
+                          const State_Transitions_Type& st,
+                          unsigned i,
+                          const Float_Type* alpha_prev,
+                          Float_Type* alpha_crt)
+    {
+        _row_scale = 0.0;
+        _row_underflow = false;
+        team.run([&] (unsigned tid) {
+            if (st.has_groups())
+            {
+                fill_alpha_row_factored(team, tid, em, st.groups(), i, alpha_prev, alpha_crt);
+            }
+            else if (_scaled)
+            {
+                fill_alpha_row_generic_scaled(team, tid, em, st, i, alpha_prev, alpha_crt);
+            }
+            else
+            {
+                fill_alpha_row_generic(team, tid, em, st, i, alpha_prev, alpha_crt);
+            }
+        });
+        if (_row_underflow)
+        {
+            // emissions shifted by their maximum leave no mass on the states reachable
+            // from the previous row: redo the row in log space
+            LOG("Forward_Backward", debug) << "forward: i=" << i << ": underflow; using log space" << std::endl;
+            const Float_Type* log_alpha_prev = log_row(alpha_prev);
+            if (not log_alpha_prev)
+            {
+                std::fill(alpha_crt, alpha_crt + n_states, 0.0);
+                return -INFINITY;
+            }
+            _scaled = false;
+            team.run([&] (unsigned tid) {
+                if (st.has_groups())
+                {
+                    fill_alpha_row_factored(team, tid, em, st.groups(), i, log_alpha_prev, alpha_crt);
+                }
+                else
+                {
+                    fill_alpha_row_generic(team, tid, em, st, i, log_alpha_prev, alpha_crt);
+                }
+            });
+            _scaled = true;
+            _row_scale = exp_normalize_row(alpha_crt);
+        }
+        return _row_scale;
+    }
+
+    // beta, i < n-1; ip1 == i + 1
+    template < typename Emissions >
+    double fill_beta_row(Thread_Team& team,
+                         const Emissions& em,
+                         const State_Transitions_Type& st,
+                         unsigned ip1,
+                         const Float_Type* beta_next,
+                         Float_Type* beta_crt)
+    {
+        _row_scale = 0.0;
+        _row_underflow = false;
+        team.run([&] (unsigned tid) {
+            if (st.has_groups())
+            {
+                fill_beta_row_factored(team, tid, em, st.groups(), ip1, beta_next, beta_crt);
+            }
+            else if (_scaled)
+            {
+                fill_beta_row_generic_scaled(team, tid, em, st, ip1, beta_next, beta_crt);
+            }
+            else
+            {
+                fill_beta_row_generic(team, tid, em, st, ip1, beta_next, beta_crt);
+            }
+        });
+        if (_row_underflow)
+        {
+            LOG("Forward_Backward", debug) << "backward: i=" << ip1 - 1 << ": underflow; using log space" << std::endl;
+            const Float_Type* log_beta_next = log_row(beta_next);
+            if (not log_beta_next)
+            {
+                std::fill(beta_crt, beta_crt + n_states, 0.0);
+                return -INFINITY;
+            }
+            _scaled = false;
+            team.run([&] (unsigned tid) {
+                if (st.has_groups())
+                {
+                    fill_beta_row_factored(team, tid, em, st.groups(), ip1, log_beta_next, beta_crt);
+                }
+                else
+                {
+                    fill_beta_row_generic(team, tid, em, st, ip1, log_beta_next, beta_crt);
+                }
+            });
+            _scaled = true;
+            _row_scale = exp_normalize_row(beta_crt);
+        }
+        return _row_scale;
+    }
+
+    // sum-product using explicit neighbour lists
+    template < typename Emissions >
+    void fill_alpha_row_generic(Thread_Team& team, unsigned tid,
+                                const Emissions& em,
+                                const State_Transitions_Type& st,
+                                unsigned i,
+                                const Float_Type* alpha_prev,
+                                Float_Type* alpha_crt)
+    {
+        const State_Transition_Table_Type& from = st.from_table();
+        LogSumSet_Type s(false);
+        auto part = team.chunk(tid, from.offset);
+        em.row(i, &_em[0], part.first, part.second);
+        for (unsigned j = part.first; j < part.second; ++j)
+        {
+            s.clear();
+            for (unsigned k = from.begin(j); k < from.end(j); ++k)
+            {
+                const unsigned& j_prev = from.state[k];
+                const Float_Type& log_pr_transition = from.log_p[k];
+                s.add(log_pr_transition + alpha_prev[j_prev]);
+            }
+            alpha_crt[j] = _em[j] + s.val();
+            LOG("Forward_Backward", debug2)
+                << "j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
+                << " alpha=" << alpha_crt[j] << std::endl;
+        }
+    }
+
+    template < typename Emissions >
+    void fill_beta_row_generic(Thread_Team& team, unsigned tid,
+                               const Emissions& em,
+                               const State_Transitions_Type& st,
+                               unsigned ip1,
+                               const Float_Type* beta_next,
+                               Float_Type* beta_crt)
+    {
+        const State_Transition_Table_Type& to = st.to_table();
+        LogSumSet_Type s(false);
+        auto part = team.chunk(tid, to.offset);
+        // emissions of event i+1 are needed for all states
+        em.row(ip1, &_em[0], part.first, part.second);
+        team.barrier();
+        for (unsigned j = part.first; j < part.second; ++j)
+        {
+            s.clear();
+            for (unsigned k = to.begin(j); k < to.end(j); ++k)
+            {
+                const unsigned& j_next = to.state[k];
+                const Float_Type& log_pr_transition = to.log_p[k];
+                s.add(log_pr_transition + _em[j_next] + beta_next[j_next]);
+            }
+            beta_crt[j] = s.val();
+            LOG("Forward_Backward", debug2)
+                << "j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
+                << " beta=" << beta_crt[j] << std::endl;
+        }
+    }
+
+    // sum-product in probability space: alpha_crt(j) = em(j) * sum_{j_prev} p(j_prev, j) * alpha_prev(j_prev),
+    // with emissions shifted by their maximum
+    template < typename Emissions >
+    void fill_alpha_row_generic_scaled(Thread_Team& team, unsigned tid,
+                                       const Emissions& em,
+                                       const State_Transitions_Type& st,
+                                       unsigned i,
+                                       const Float_Type* alpha_prev,
+                                       Float_Type* alpha_crt)
+    {
+        const State_Transition_Table_Type& from = st.from_table();
+        auto part = team.chunk(tid, from.offset);
+        em.row(i, &_em[0], part.first, part.second);
+        Float_Type m = -INFINITY;
+        for (unsigned j = part.first; j < part.second; ++j)
+        {
+            m = std::max(m, _em[j]);
+        }
+        m = team_max(team, tid, m);
+        double s = 0.0;
+        for (unsigned j = part.first; j < part.second; ++j)
+        {
+            double v = 0.0;
+            for (unsigned k = from.begin(j); k < from.end(j); ++k)
+            {
+                v += _p_from[k] * alpha_prev[from.state[k]];
+            }
+            alpha_crt[j] = std::exp(_em[j] - m) * v;
+            s += alpha_crt[j];
+        }
+        Float_Type s_inv = team_row_norm(team, tid, m, s);
+        for (unsigned j = part.first; j < part.second; ++j)
+        {
+            alpha_crt[j] *= s_inv;
+        }
+    }
+
+    template < typename Emissions >
+    void fill_beta_row_generic_scaled(Thread_Team& team, unsigned tid,
+                                      const Emissions& em,
+                                      const State_Transitions_Type& st,
+                                      unsigned ip1,
+                                      const Float_Type* beta_next,
+                                      Float_Type* beta_crt)
+    {
+        const State_Transition_Table_Type& to = st.to_table();
+        auto part = team.chunk(tid, to.offset);
+        em.row(ip1, &_em[0], part.first, part.second);
+        Float_Type m = -INFINITY;
+        for (unsigned j = part.first; j < part.second; ++j)
+        {
+            m = std::max(m, _em[j]);
+        }
+        m = team_max(team, tid, m);
+        // emission times beta of event i+1 are needed for all states
+        for (unsigned j = part.first; j < part.second; ++j)
+        {
+            _r[j] = std::exp(_em[j] - m) * beta_next[j];
+        }
+        team.barrier();
+        double s = 0.0;
+        for (unsigned j = part.first; j < part.second; ++j)
+        {
+            double v = 0.0;
+            for (unsigned k = to.begin(j); k < to.end(j); ++k)
+            {
+                v += _p_to[k] * _r[to.state[k]];
+            }
+            beta_crt[j] = v;
+            s += v;
+        }
+        Float_Type s_inv = team_row_norm(team, tid, m, s);
+        for (unsigned j = part.first; j < part.second; ++j)
+        {
+            beta_crt[j] *= s_inv;
+        }
+    }
+
+    // sum of group key at level l: forward, from the groups at level l-1 by (k-l)-suffix
+    void sum_from_group(unsigned l, unsigned key)
+    {
+        const double* src = l == 1? &_r[0] : &_g_sum[l - 1][0];
+        _g_sum[l][key] = 0.0;
+        for (unsigned b = 0; b < 4; ++b)
+        {
+            _g_sum[l][key] += src[(b << (2 * (Kmer_Size - l))) | key];
+        }
+    }
+    // backward, from the groups at level l-1 by (k-l)-prefix
+    void sum_to_group(unsigned l, unsigned key)
+    {
+        const double* src = l == 1? &_r[0] : &_g_sum[l - 1][0];
+        _g_sum[l][key] = 0.0;
+        for (unsigned b = 0; b < 4; ++b)
+        {
+            _g_sum[l][key] += src[(key << 2) | b];
+        }
+    }
+
+    // sum the upper levels l0..n_levels once per level-l0 key, where coefficients only depend on that key
+    void sum_upper_from(const State_Transition_Groups_Type& grp, unsigned l0)
+    {
+        for (unsigned key = 0; key < grp.n_keys(l0); ++key)
+        {
+            unsigned j = key << (2 * l0);
+            _u_sum[key] = 0.0;
+            for (unsigned l = l0; l <= grp.n_levels(); ++l)
+            {
+                _u_sum[key] += grp.coef_from(j, l) * _g_sum[l][grp.from_key(j, l)];
+            }
+        }
+    }
+    void sum_upper_to(const State_Transition_Groups_Type& grp, unsigned l0)
+    {
+        for (unsigned key = 0; key < grp.n_keys(l0); ++key)
+        {
+            unsigned j = key;
+            _u_sum[key] = 0.0;
+            for (unsigned l = l0; l <= grp.n_levels(); ++l)
+            {
+                _u_sum[key] += grp.coef_to(j, l) * _g_sum[l][grp.to_key(j, l)];
+            }
+        }
+    }
+
+    // sum-product using the factored transitions:
+    // rows are shifted by their maximum, and the previous row is summed once per (level, key)
+    template < typename Emissions >
+    void fill_alpha_row_factored(Thread_Team& team, unsigned tid,
+                                 const Emissions& em,
+                                 const State_Transition_Groups_Type& grp,
+                                 unsigned i,
+                                 const Float_Type* alpha_prev,
+                                 Float_Type* alpha_crt)
+    {
+        unsigned n_levels = grp.n_levels();
+        unsigned n_local_levels = std::min(n_levels, unsigned(max_local_level));
+        auto part = team.chunk(tid, n_parts);
+        for (unsigned h = 0; h < n_states; h += n_parts)
+        {
+            em.row(i, &_em[0], h + part.first, h + part.second);
+        }
+        // log mode: shift the previous row by its maximum;
+        // scaled() mode: the previous row is used as is, and emissions are shifted instead
+        Float_Type m = -INFINITY;
+        const Float_Type* shifted = _scaled? &_em[0] : alpha_prev;
+        for_each_in_suffix_part(n_states, part, [&] (unsigned j) { m = std::max(m, shifted[j]); });
+        m = team_max(team, tid, m);
+        if (_scaled)
+        {
+            for_each_in_suffix_part(n_states, part, [&] (unsigned j) { _r[j] = alpha_prev[j]; });
+        }
+        else
+        {
+            for_each_in_suffix_part(n_states, part, [&] (unsigned j) { _r[j] = std::exp(alpha_prev[j] - m); });
+        }
+        for (unsigned l = 1; l <= n_local_levels; ++l)
+        {
+            for_each_in_suffix_part(grp.n_keys(l), part, [&] (unsigned key) { sum_from_group(l, key); });
+        }
+        if (n_levels > n_local_levels)
+        {
+            team.barrier();
+            if (tid == 0)
+            {
+                for (unsigned l = n_local_levels + 1; l <= n_levels; ++l)
+                {
+                    for (unsigned key = 0; key < grp.n_keys(l); ++key)
+                    {
+                        sum_from_group(l, key);
+                    }
+                }
+                sum_upper_from(grp, n_local_levels + 1);
+            }
+        }
+        team.barrier();
+        if (_scaled)
+        {
+            double s = 0.0;
+            for_each_in_suffix_part(n_states, part, [&] (unsigned j) {
+                double v = grp.coef_from(j, 0) * _r[j];
+                for (unsigned l = 1; l <= n_local_levels; ++l)
+                {
+                    v += grp.coef_from(j, l) * _g_sum[l][grp.from_key(j, l)];
+                }
+                if (n_levels > n_local_levels)
+                {
+                    v += _u_sum[grp.from_key(j, n_local_levels + 1)];
+                }
+                alpha_crt[j] = std::exp(_em[j] - m) * v;
+                s += alpha_crt[j];
+            });
+            Float_Type s_inv = team_row_norm(team, tid, m, s);
+            for_each_in_suffix_part(n_states, part, [&] (unsigned j) { alpha_crt[j] *= s_inv; });
+            return;
+        }
+        for_each_in_suffix_part(n_states, part, [&] (unsigned j) {
+            double v = grp.coef_from(j, 0) * _r[j];
+            for (unsigned l = 1; l <= n_local_levels; ++l)
+            {
+                v += grp.coef_from(j, l) * _g_sum[l][grp.from_key(j, l)];
+            }
+            if (n_levels > n_local_levels)
+            {
+                v += _u_sum[grp.from_key(j, n_local_levels + 1)];
+            }
+            alpha_crt[j] = _em[j] + m + (v > 0.0? std::log(v) : -INFINITY);
+            LOG("Forward_Backward", debug2)
+                << "j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
+                << " alpha=" << alpha_crt[j] << std::endl;
+        });
+    }
+
+    template < typename Emissions >
+    void fill_beta_row_factored(Thread_Team& team, unsigned tid,
+                                const Emissions& em,
+                                const State_Transition_Groups_Type& grp,
+                                unsigned ip1,
+                                const Float_Type* beta_next,
+                                Float_Type* beta_crt)
+    {
+        unsigned n_levels = grp.n_levels();
+        unsigned n_local_levels = std::min(n_levels, unsigned(max_local_level));
+        auto part = team.chunk(tid, n_parts);
+        // one emission per state for event i+1
+        unsigned w = n_states / n_parts;
+        em.row(ip1, &_em[0], part.first * w, part.second * w);
+        // scaled() mode: emissions are shifted by their maximum, then multiplied by beta_next
+        Float_Type m = -INFINITY;
+        for_each_in_prefix_part(n_states, part, [&] (unsigned j) {
+            if (not _scaled) _em[j] += beta_next[j];
+            m = std::max(m, _em[j]);
+        });
+        m = team_max(team, tid, m);
+        if (_scaled)
+        {
+            for_each_in_prefix_part(n_states, part, [&] (unsigned j) { _r[j] = std::exp(_em[j] - m) * beta_next[j]; });
+        }
+        else
+        {
+            for_each_in_prefix_part(n_states, part, [&] (unsigned j) { _r[j] = std::exp(_em[j] - m); });
+        }
+        for (unsigned l = 1; l <= n_local_levels; ++l)
+        {
+            for_each_in_prefix_part(grp.n_keys(l), part, [&] (unsigned key) { sum_to_group(l, key); });
+        }
+        if (n_levels > n_local_levels)
+        {
+            team.barrier();
+            if (tid == 0)
+            {
+                for (unsigned l = n_local_levels + 1; l <= n_levels; ++l)
+                {
+                    for (unsigned key = 0; key < grp.n_keys(l); ++key)
+                    {
+                        sum_to_group(l, key);
+                    }
+                }
+                sum_upper_to(grp, n_local_levels + 1);
+            }
+        }
+        team.barrier();
+        if (_scaled)
+        {
+            double s = 0.0;
+            for_each_in_prefix_part(n_states, part, [&] (unsigned j) {
+                double v = grp.coef_to(j, 0) * _r[j];
+                for (unsigned l = 1; l <= n_local_levels; ++l)
+                {
+                    v += grp.coef_to(j, l) * _g_sum[l][grp.to_key(j, l)];
+                }
+                if (n_levels > n_local_levels)
+                {
+                    v += _u_sum[grp.to_key(j, n_local_levels + 1)];
+                }
+                beta_crt[j] = v;
+                s += v;
+            });
+            Float_Type s_inv = team_row_norm(team, tid, m, s);
+            for_each_in_prefix_part(n_states, part, [&] (unsigned j) { beta_crt[j] *= s_inv; });
+            return;
+        }
+        for_each_in_prefix_part(n_states, part, [&] (unsigned j) {
+            double v = grp.coef_to(j, 0) * _r[j];
+            for (unsigned l = 1; l <= n_local_levels; ++l)
+            {
+                v += grp.coef_to(j, l) * _g_sum[l][grp.to_key(j, l)];
+            }
+            if (n_levels > n_local_levels)
+            {
+                v += _u_sum[grp.to_key(j, n_local_levels + 1)];
+            }
+            beta_crt[j] = m + (v > 0.0? std::log(v) : -INFINITY);
+            LOG("Forward_Backward", debug2)
+                << "j=" << j << " kmer_j=" << Kmer_Type::to_string(j)
+                << " beta=" << beta_crt[j] << std::endl;
+        });
+    }
 }; // class Forward_Backward
 
 #endif
@@ -1,6 +1,7 @@
 #ifndef __FORWARD_BACKWARD_CUSTOM_HPP
 #define __FORWARD_BACKWARD_CUSTOM_HPP
 
+#include <cassert>
 #include <cmath>
 #include <iostream>
 #include <vector>
@@ -19,7 +20,7 @@ public:
     typedef Pore_Model< Float_Type, Kmer_Size > Pore_Model_Type;
     typedef State_Transitions< Float_Type, Kmer_Size > State_Transitions_Type;
     typedef Event< Float_Type > Event_Type;
-    typedef Event_Sequence< Float_Type > Event_Sequence_Type;
+    typedef Event_Sequence_View< Float_Type > Event_Sequence_View_Type;
     typedef logsum::logsumset< Float_Type > LogSumSet_Type;
 
     struct Matrix_Entry
@@ -45,11 +46,14 @@ public:
 
     void fill(const Pore_Model_Type& pm,
               const State_Transitions_Type& st,
-              const Event_Sequence_Type& ev)
+              const Event_Sequence_View_Type& ev)
     {
+        assert(st.has_tables());
         clear();
         unsigned n_events = ev.size();
         _m.resize(n_states * n_events);
+        const auto& from = st.from_table();
+        const auto& to = st.to_table();
         Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
         LogSumSet_Type s1(false);
         LogSumSet_Type s2(false);
@@ -57,12 +61,13 @@ public:
         // forward: alpha, beta; i == 0
         //
         {
+            auto e = ev[0];
             for (unsigned j = 0; j < n_states; ++j)
             {
                 // alpha
                 cell(0, j).alpha = - log_n_states;
                 // beta
-                cell(0, j).beta = pm.log_pr_emission(j, ev[0]) + cell(0, j).alpha;
+                cell(0, j).beta = pm.log_pr_emission(j, e) + cell(0, j).alpha;
                 s1.add(cell(0, j).beta);
             }
             Float_Type denom = s1.val();
@@ -83,19 +88,20 @@ public:
         {
             LOG("Forward_Backward_Custom", debug1) << "forward: i=" << i << std::endl;
             s1.clear();
+            auto e = ev[i];
             for (unsigned j = 0; j < n_states; ++j) // TODO: parallelize
             {
                 // alpha
                 s2.clear();
-                for (const auto& p : st.neighbours(j).from_v)
+                for (unsigned k = from.begin(j); k < from.end(j); ++k)
                 {
-                    const unsigned& j_prev = p.first;
-                    const Float_Type& log_pr_transition = p.second;
+                    const unsigned& j_prev = from.state[k];
+                    const Float_Type& log_pr_transition = from.log_p[k];
                     s2.add(log_pr_transition + cell(i - 1, j_prev).beta);
                 }
                 cell(i, j).alpha = s2.val();
                 // beta
-                cell(i, j).beta = pm.log_pr_emission(j, ev[i]) + cell(i, j).alpha;
+                cell(i, j).beta = pm.log_pr_emission(j, e) + cell(i, j).alpha;
                 s1.add(cell(i, j).beta);
             }
             Float_Type denom = s1.val();
@@ -127,10 +133,11 @@ public:
             {
                 cell(i, j).gamma = cell(i, j).beta;
                 s2.clear();
-                for (const auto& p : st.neighbours(j).to_v)
+                for (unsigned k = to.begin(j); k < to.end(j); ++k)
                 {
-                    const unsigned& j_next = p.first;
-                    const Float_Type& log_pr_transition = p.second;
+                    if (to.is_padding(k)) continue;
+                    const unsigned& j_next = to.state[k];
+                    const Float_Type& log_pr_transition = to.log_p[k];
                     s2.add(log_pr_transition + cell(ip1, j_next).gamma - cell(ip1, j_next).alpha);
                 }
                 cell(i, j).gamma += s2.val();
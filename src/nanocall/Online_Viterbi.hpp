@@ -0,0 +1,288 @@
+#ifndef __ONLINE_VITERBI_HPP
+#define __ONLINE_VITERBI_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Viterbi.hpp"
+#include "logger.hpp"
+
+/**
+ * Viterbi decoder accepting events one at a time.
+ * Every check_interval() events, all states of the last event are traced back together;
+ * once their paths coalesce into a single state, the prefix up to that state is settled:
+ * its bases become available through take_bases(), and its traceback rows are freed.
+ * The settled path is the same as the one found by Viterbi::fill().
+ */
+template < typename Float_Type, unsigned Kmer_Size = 6 >
+class Online_Viterbi
+{
+public:
+    typedef Kmer< Kmer_Size > Kmer_Type;
+    typedef Pore_Model< Float_Type, Kmer_Size > Pore_Model_Type;
+    typedef State_Transitions< Float_Type, Kmer_Size > State_Transitions_Type;
+    typedef Event< Float_Type > Event_Type;
+    typedef Viterbi< Float_Type, Kmer_Size > Viterbi_Type;
+    typedef typename Viterbi_Type::Traceback_Code Traceback_Code;
+
+    static const unsigned n_states = Pore_Model_Type::n_states;
+
+    /**
+     * Number of events between coalescence checks.
+     */
+    static unsigned& check_interval() { static unsigned _check_interval = 64; return _check_interval; }
+    /**
+     * Maximum number of unsettled events; 0: no limit. When exceeded, the older half is
+     * settled along the path of the current best state, which might not be the final MLSS.
+     */
+    static unsigned& max_lag() { static unsigned _max_lag = 0; return _max_lag; }
+
+    /**
+     * Start decoding a new event sequence. Both arguments must outlive the decoding.
+     */
+    void reset(const Pore_Model_Type& pm, const State_Transitions_Type& st)
+    {
+        _pm_ptr = &pm;
+        _st_ptr = &st;
+        _n_events = 0;
+        _n_settled = 0;
+        _row_begin = 1;
+        _last_check = 0;
+        _finished = false;
+        _bases.clear();
+        while (not _rows.empty())
+        {
+            release_row();
+        }
+        _vit._team_size = Thread_Team::thread_team(Viterbi_Type::n_threads()).size();
+        _vit.init_scratch(st);
+        for (unsigned k = 0; k < 2; ++k)
+        {
+            _alpha[k].resize(n_states);
+        }
+        _mark.assign(n_states, 0);
+        _stamp = 0;
+    }
+
+    /**
+     * Add the next (drift-corrected) event.
+     */
+    void push(const Event_Type& e)
+    {
+        assert(_pm_ptr and not _finished);
+        Event_Emissions em(*_pm_ptr, e);
+        unsigned i = _n_events;
+        if (i == 0)
+        {
+            Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
+            em.row(0, &_alpha[0][0]);
+            for (unsigned j = 0; j < n_states; ++j)
+            {
+                _alpha[0][j] -= log_n_states;
+            }
+        }
+        else
+        {
+            Thread_Team& team = Thread_Team::thread_team(Viterbi_Type::n_threads());
+            assert(team.size() == _vit._team_size);
+            Row& row = acquire_row();
+            _vit.fill_row(team, em, *_st_ptr, i, _alpha[(i - 1) % 2], _alpha[i % 2],
+                          row.tb.data(), row.tb_escape.data());
+        }
+        ++_n_events;
+        if (_n_events - _last_check >= check_interval())
+        {
+            _last_check = _n_events;
+            settle_coalesced();
+        }
+        if (max_lag() > 0 and _n_events - _n_settled > max_lag())
+        {
+            settle_best(_n_events - 1 - max_lag() / 2);
+        }
+    }
+
+    /**
+     * Settle the remaining events along the best path; no events can be added after this.
+     */
+    void finish()
+    {
+        assert(not _finished);
+        _finished = true;
+        if (_n_events == 0) return;
+        const std::vector< Float_Type >& alpha_last = _alpha[(_n_events - 1) % 2];
+        unsigned j_max = std::max_element(alpha_last.begin(), alpha_last.end()) - alpha_last.begin();
+        _path_probability = alpha_last[j_max];
+        settle(_n_events - 1, j_max);
+        _bases += Kmer_Type::to_string(_last_state);
+    }
+
+    /**
+     * Bases settled since the previous call.
+     */
+    std::string take_bases()
+    {
+        std::string res;
+        std::swap(res, _bases);
+        return res;
+    }
+
+    unsigned n_events() const { return _n_events; }
+    unsigned n_settled() const { return _n_settled; }
+    // only available after finish()
+    Float_Type path_probability() const { return _path_probability; }
+
+private:
+    // traceback row of one event, with the per-thread escape lists
+    struct Row
+    {
+        std::vector< Traceback_Code > tb;
+        std::vector< std::vector< std::pair< unsigned, unsigned > > > tb_escape;
+    }; // struct Row
+
+    // emissions of a single event, whatever its index
+    struct Event_Emissions
+    {
+        Event_Emissions(const Pore_Model_Type& pm, const Event_Type& e) : pm_ref(pm), e_ref(e) {}
+        unsigned n_events() const { return 1; }
+        void row(unsigned, Float_Type* out, unsigned begin = 0, unsigned end = n_states) const
+        {
+            pm_ref.log_pr_emission_row(e_ref, out, begin, end);
+        }
+        const Pore_Model_Type& pm_ref;
+        const Event_Type& e_ref;
+    }; // struct Event_Emissions
+
+    const Pore_Model_Type* _pm_ptr = nullptr;
+    const State_Transitions_Type* _st_ptr = nullptr;
+    // engine holding the row kernels and their scratch space
+    Viterbi_Type _vit;
+    std::array< std::vector< Float_Type >, 2 > _alpha;
+    // traceback rows of events [_row_begin, _n_events)
+    std::deque< Row > _rows;
+    std::vector< Row > _free_rows;
+    unsigned _n_events;
+    // states of events [0, _n_settled) are settled; _last_state is the state of event _n_settled - 1
+    unsigned _n_settled;
+    unsigned _last_state;
+    unsigned _row_begin;
+    unsigned _last_check;
+    bool _finished;
+    Float_Type _path_probability;
+    std::string _bases;
+    // scratch space
+    std::vector< unsigned > _mark;
+    unsigned _stamp;
+    std::vector< unsigned > _crt_states;
+    std::vector< unsigned > _prev_states;
+
+    Row& acquire_row()
+    {
+        if (not _free_rows.empty())
+        {
+            _rows.emplace_back(std::move(_free_rows.back()));
+            _free_rows.pop_back();
+        }
+        else
+        {
+            _rows.emplace_back();
+        }
+        Row& row = _rows.back();
+        row.tb.resize(n_states);
+        row.tb_escape.resize(_vit._team_size);
+        return row;
+    }
+    void release_row()
+    {
+        _free_rows.emplace_back(std::move(_rows.front()));
+        _rows.pop_front();
+    }
+
+    unsigned prev_state(unsigned i, unsigned j) const
+    {
+        const Row& row = _rows[i - _row_begin];
+        return Viterbi_Type::decode(row.tb[j], j, row.tb_escape.data(), _vit._team_size);
+    }
+
+    // trace all states of the last event back; settle the first event where they coalesce
+    void settle_coalesced()
+    {
+        if (_n_events < 2) return;
+        _crt_states.resize(n_states);
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            _crt_states[j] = j;
+        }
+        for (unsigned i = _n_events - 1; i >= _row_begin and i > _n_settled; --i)
+        {
+            ++_stamp;
+            _prev_states.clear();
+            for (auto j : _crt_states)
+            {
+                unsigned j_prev = prev_state(i, j);
+                if (_mark[j_prev] != _stamp)
+                {
+                    _mark[j_prev] = _stamp;
+                    _prev_states.push_back(j_prev);
+                }
+            }
+            std::swap(_crt_states, _prev_states);
+            if (_crt_states.size() == 1)
+            {
+                LOG("Online_Viterbi", debug1)
+                    << "coalesced: i=" << i - 1 << " n_events=" << _n_events << std::endl;
+                settle(i - 1, _crt_states[0]);
+                return;
+            }
+        }
+    }
+
+    // settle events up to i along the path of the current best state
+    void settle_best(unsigned i)
+    {
+        const std::vector< Float_Type >& alpha_last = _alpha[(_n_events - 1) % 2];
+        unsigned j = std::max_element(alpha_last.begin(), alpha_last.end()) - alpha_last.begin();
+        for (unsigned i2 = _n_events - 1; i2 > i; --i2)
+        {
+            j = prev_state(i2, j);
+        }
+        LOG("Online_Viterbi", debug)
+            << "forced: i=" << i << " n_events=" << _n_events << std::endl;
+        settle(i, j);
+    }
+
+    // settle events up to i, given that event i is in state j
+    void settle(unsigned i, unsigned j)
+    {
+        if (i + 1 <= _n_settled) return;
+        _crt_states.resize(i + 1 - _n_settled);
+        _crt_states.back() = j;
+        for (unsigned i2 = i; i2 > _n_settled; --i2)
+        {
+            _crt_states[i2 - 1 - _n_settled] = prev_state(i2, _crt_states[i2 - _n_settled]);
+        }
+        for (auto s : _crt_states)
+        {
+            if (_n_settled > 0)
+            {
+                _bases += Kmer_Type::to_string(_last_state).substr(0, Kmer_Type::min_skip(_last_state, s));
+            }
+            _last_state = s;
+            ++_n_settled;
+        }
+        // rows of settled events are no longer needed
+        while (_row_begin < _n_settled and not _rows.empty())
+        {
+            release_row();
+            ++_row_begin;
+        }
+        _row_begin = std::max(_row_begin, _n_settled);
+    }
+}; // class Online_Viterbi
+
+#endif
@@ -2,12 +2,14 @@
 #define __PARAMETER_TRAINER
 
 #include <array>
+#include <cmath>
 #include <vector>
 #include <map>
 
 #include "global_assert.hpp"
 #include "Pore_Model.hpp"
 #include "State_Transitions.hpp"
+#include "Emission_Matrix.hpp"
 #include "Forward_Backward.hpp"
 #include "logsumset.hpp"
 #include "logger.hpp"
@@ -21,8 +23,11 @@ struct Parameter_Trainer
     typedef State_Transitions< Float_Type, Kmer_Size > State_Transitions_Type;
     typedef State_Transition_Parameters< Float_Type > State_Transition_Parameters_Type;
     typedef Event< Float_Type > Event_Type;
-    typedef Event_Sequence< Float_Type > Event_Sequence_Type;
+    typedef Event_Sequence_View< Float_Type > Event_Sequence_View_Type;
     typedef Forward_Backward< Float_Type, Kmer_Size > Forward_Backward_Type;
+    typedef Emission_Matrix< Float_Type, Kmer_Size > Emission_Matrix_Type;
+    typedef Pore_Model_Emissions< Float_Type, Kmer_Size > Pore_Model_Emissions_Type;
+    typedef typename Forward_Backward_Type::Sparse_Posterior_Type Sparse_Posterior_Type;
     typedef logsum::logsumset< Float_Type > LogSumSet_Type;
 
     static const unsigned n_states = Pore_Model_Type::n_states;
@@ -32,6 +37,7 @@ struct Parameter_Trainer
         // pick states i s.t. i has self-overlap 0,
         // and all its 1-step neighbours have self-overlap <=1
         st_train_kmers().clear();
+        is_st_train_kmer().assign(n_states, false);
         for (unsigned i = 0; i < n_states; ++i)
         {
             if (Kmer_Type::max_self_overlap(i) > 0)
@@ -51,6 +57,7 @@ struct Parameter_Trainer
             if (all_good)
             {
                 st_train_kmers().push_back(i);
+                is_st_train_kmer()[i] = true;
             }
         }
         LOG(info) << "using [" << st_train_kmers().size() << "] states for state trainsition training" << std::endl;
@@ -61,10 +68,127 @@ struct Parameter_Trainer
         static std::vector< unsigned > _st_train_kmers;
         return _st_train_kmers;
     }
+    static std::vector< bool >& is_st_train_kmer()
+    {
+        static std::vector< bool > _is_st_train_kmer;
+        return _is_st_train_kmer;
+    }
+
+    /**
+     * Fused E-step: instead of storing the full forward-backward tables of every event sequence,
+     * fold the posteriors into the sufficient statistics during the backward pass.
+     * Requires Forward_Backward scaled() mode; the tables are limited by Forward_Backward max_mem().
+     */
+    static bool& fused()
+    {
+#ifndef DUMP_TRAINING_DATA
+        static bool _fused = true;
+#else
+        static bool _fused = false;
+#endif
+        return _fused;
+    }
+
+    /**
+     * Sufficient statistics for pm_params training, as sums over events i of
+     * sums over states j weighted by p_{i,j} = Pr[ S_i = j ].
+     */
+    struct PM_Stats
+    {
+        // only the upper triangle of A is accumulated
+        std::array< std::array< double, 3 >, 3 > A;
+        std::array< double, 3 > B;
+        double D;       // = \sum_i x^2_i s_{i,0} (used for var)
+        double V_numer; // = \sum_i y_i \sum_j p_{i,j} \lambda_j / \eta^2_j (for scale_sd)
+        double V_denom; // = \sum_i \sum_j p_{i,j} \lambda_j / \eta_j (for scale_sd)
+        double U_pos;   // = \sum_i (1/y_i) \sum_j p_{i,j} \lambda_j (for var_sd)
+        unsigned total_n_events;
+
+        void clear()
+        {
+            A = {{ {{ 0.0, 0.0, 0.0 }},
+                   {{ 0.0, 0.0, 0.0 }},
+                   {{ 0.0, 0.0, 0.0 }} }};
+            B = {{ 0.0, 0.0, 0.0 }};
+            D = 0.0;
+            V_numer = 0.0;
+            V_denom = 0.0;
+            U_pos = 0.0;
+            total_n_events = 0;
+        }
+
+        /**
+         * Add one (uncorrected) event.
+         * @pm Unscaled pore model
+         * @post Sparse posterior p_{i,j} of the event; other states are taken to have p_{i,j} = 0
+         */
+        void add_event(const Event_Type& e, const Pore_Model_Type& pm, const Sparse_Posterior_Type& post)
+        {
+            Float_Type x_i = e.mean;
+            Float_Type y_i = e.stdv;
+            Float_Type t_i = e.start;
+            LOG(debug1)
+                << "outter_loop x_i=" << x_i
+                << " t_i=" << t_i << std::endl;
+            // \sum_j p_{i,j} \mu^*_j / \simga^2_j
+            std::array< float, 3 > s = {{ 0.0, 0.0, 0.0 }};
+            // \sum_j p_{i,j} \lambda_j / \eta^*_j
+            std::array< float, 3 > l = {{ 0.0, 0.0, 0.0 }};
+            for (const auto& p : post)
+            {
+                const unsigned& j = p.first;
+                const Float_Type& p_ij = p.second;
+                Float_Type term_s0 = p_ij / (pm.state(j).level_stdv * pm.state(j).level_stdv);
+                Float_Type term_s1 = term_s0 * pm.state(j).level_mean;
+                Float_Type term_s2 = term_s1 * pm.state(j).level_mean;
+                Float_Type term_l0 = p_ij * pm.state(j).sd_lambda;
+                Float_Type term_l1 = term_l0 / pm.state(j).sd_mean;
+                Float_Type term_l2 = term_l1 / pm.state(j).sd_mean;
+                LOG(debug2)
+                    << "inner_loop j=" << j << " p_ij=" << p_ij
+                    << " term_s0=" << term_s0 << " term_s1=" << term_s1 << " term_s2=" << term_s2
+                    << " term_l0=" << term_l0 << " term_l1=" << term_l1 << " term_l2=" << term_l2
+                    << std::endl;
+                s[0] += term_s0;
+                s[1] += term_s1;
+                s[2] += term_s2;
+                l[0] += term_l0;
+                l[1] += term_l1;
+                l[2] += term_l2;
+            } // for j
+            A[0][0] += s[0];
+            A[0][1] += s[1];
+            A[0][2] += s[0] * t_i;
+            A[1][1] += s[2];
+            A[1][2] += s[1] * t_i;
+            A[2][2] += s[0] * t_i * t_i;
+            B[0]    += s[0] * x_i;
+            B[1]    += s[1] * x_i;
+            B[2]    += s[0] * x_i * t_i;
+            D       += s[0] * x_i * x_i;
+            V_numer += l[2] * y_i;
+            V_denom += l[1];
+            U_pos   += l[0] / y_i;
+            ++total_n_events;
+        }
+    }; // struct PM_Stats
+
+    /**
+     * Sufficient statistics for st_params training of one strand, in fused() mode.
+     */
+    struct ST_Stats
+    {
+        double p_stay_num; // = \sum_i \sum_{j1} Pr[ S_i = j1, S_{i+1} = j1 ]
+        double p_skip_num; // = \sum_i \sum_{j1} Pr[ S_i = j1, dist(j1, S_{i+1}) > 1 ]
+        double denom;      // = \sum_i \sum_{j1} Pr[ S_i = j1 ]
+
+        void clear() { p_stay_num = 0.0; p_skip_num = 0.0; denom = 0.0; }
+    }; // struct ST_Stats
 
     /**
      * Struct used for training rounds.
-     * @event_seq_ptr_v Vector of pairs, first: an event sequence, second: strand from which it comes
+     * @event_seq_v Vector of pairs, first: a view of an event sequence, without drift correction,
+     * second: strand from which it comes
      * @model_ptr_v Pointers to unscaled pore models (per strand)
      * @default_transitions_ptr Default state transitions
      * @pm_params_ptr Pore model scaling parameters (common to both strands)
@@ -73,18 +197,26 @@ struct Parameter_Trainer
     struct Train_Data
     {
         // input
-        std::vector< std::pair< const Event_Sequence_Type*, unsigned > > event_seq_ptr_v;
+        std::vector< std::pair< Event_Sequence_View_Type, unsigned > > event_seq_v;
         std::array< const Pore_Model_Type*, 2 > model_ptr_v;
         const State_Transitions_Type* default_transitions_ptr;
         const Pore_Model_Parameters_Type* pm_params_ptr;
         std::array< const State_Transition_Parameters_Type*, 2 > st_params_ptr_v;
+        bool train_scaling = true;
+        bool train_transitions = true;
         // output
         std::array< Pore_Model_Type, 2 > scaled_model_v;
-        std::array< State_Transitions_Type, 2 > custom_transitions_v;
+        std::array< std::shared_ptr< const State_Transitions_Type >, 2 > custom_transitions_v;
         std::array< const State_Transitions_Type*, 2 > transitions_ptr_v;
-        std::vector< Event_Sequence_Type > corrected_event_seq_v;
+        // parameters transitions_ptr_v were computed with, which the E-step must also use
+        std::array< State_Transition_Parameters_Type, 2 > transitions_params_v;
+        std::vector< Emission_Matrix_Type > emission_matrix_v;
         std::vector< Forward_Backward_Type > fwbw_v;
         Float_Type fit;
+        // fused() mode: sufficient statistics, instead of emission matrices and fwbw tables
+        bool fused;
+        PM_Stats pm_stats;
+        std::array< ST_Stats, 2 > st_stats;
     };
 
     /**
@@ -96,7 +228,7 @@ struct Parameter_Trainer
         data.scaled_model_v[0].clear();
         data.scaled_model_v[1].clear();
         std::array< bool, 2 > init_scaled_models = {{ false, false }};
-        for (const auto& p : data.event_seq_ptr_v)
+        for (const auto& p : data.event_seq_v)
         {
             ASSERT(p.second < 2);
             if (init_scaled_models[p.second]) continue;
@@ -107,51 +239,57 @@ struct Parameter_Trainer
             init_scaled_models[p.second] = true;
         }
         // compute custom state transitions
-        data.custom_transitions_v[0].clear();
-        data.custom_transitions_v[1].clear();
+        data.custom_transitions_v[0].reset();
+        data.custom_transitions_v[1].reset();
         std::array< bool, 2 > init_transitions = {{ false, false }};
-        for (const auto& p : data.event_seq_ptr_v)
+        for (const auto& p : data.event_seq_v)
         {
             if (init_transitions[p.second]) continue;
             ASSERT(data.st_params_ptr_v[p.second]);
             if (not data.st_params_ptr_v[p.second]->is_default())
             {
-                data.custom_transitions_v[p.second].compute_transitions_fast(*data.st_params_ptr_v[p.second]);
-                data.transitions_ptr_v[p.second] = &data.custom_transitions_v[p.second];
+                data.custom_transitions_v[p.second] = State_Transitions_Type::get_fast(*data.st_params_ptr_v[p.second]);
+                data.transitions_ptr_v[p.second] = data.custom_transitions_v[p.second].get();
+                data.transitions_params_v[p.second] = State_Transitions_Type::fast_params(*data.st_params_ptr_v[p.second]);
             }
             else
             {
                 data.transitions_ptr_v[p.second] = data.default_transitions_ptr;
+                data.transitions_params_v[p.second] = *data.st_params_ptr_v[p.second];
             }
             init_transitions[p.second] = true;
         }
-        // compute drift-corrected event sequences
-        unsigned n_event_seqs = data.event_seq_ptr_v.size();
-        data.corrected_event_seq_v.clear();
-        data.corrected_event_seq_v.reserve(n_event_seqs);
+        unsigned n_event_seqs = data.event_seq_v.size();
+        data.emission_matrix_v.clear();
+        data.emission_matrix_v.reserve(n_event_seqs);
         data.fwbw_v.clear();
-        data.fwbw_v.reserve(n_event_seqs);
         data.fit = 0.0;
+        data.fused = fused() and Forward_Backward_Type::scaled();
+        if (data.fused)
+        {
+            fill_train_stats(data);
+            return;
+        }
+        data.fwbw_v.reserve(n_event_seqs);
         for (unsigned k = 0; k < n_event_seqs; ++k)
         {
-            unsigned st = data.event_seq_ptr_v[k].second;
+            unsigned st = data.event_seq_v[k].second;
             ASSERT(init_scaled_models[st]);
             ASSERT(init_transitions[st]);
-            // first, copy events
-            data.corrected_event_seq_v.emplace_back(*data.event_seq_ptr_v[k].first);
-            // then, apply drift correction
-            data.corrected_event_seq_v.back().apply_drift_correction(data.pm_params_ptr->drift);
+            // compute emissions once, for fwbw and st training, on drift-corrected events
+            data.emission_matrix_v.emplace_back();
+            data.emission_matrix_v.back().fill(data.scaled_model_v[st],
+                                               data.event_seq_v[k].first.with_drift(data.pm_params_ptr->drift));
             // finally, run fwbw
             data.fwbw_v.emplace_back();
-            data.fwbw_v.back().fill(
-                data.scaled_model_v[st], *data.transitions_ptr_v[st], data.corrected_event_seq_v.back());
+            data.fwbw_v.back().fill(data.emission_matrix_v.back(), *data.transitions_ptr_v[st]);
             data.fit += data.fwbw_v.back().log_pr_data();
         }
 #ifdef DUMP_TRAINING_DATA
         for (unsigned k = 0; k < n_event_seqs; ++k)
         {
-            unsigned st = data.event_seq_ptr_v[k].second;
-            unsigned n_events = data.event_seq_ptr_v[k].first->size();
+            unsigned st = data.event_seq_v[k].second;
+            unsigned n_events = data.event_seq_v[k].first.size();
             std::ostringstream k_sstr;
             k_sstr << k;
             std::ofstream ofs;
@@ -161,7 +299,7 @@ struct Parameter_Trainer
                 for (unsigned j = 0; j < n_states; ++j)
                 {
                     if (j > 0) ofs << '\t';
-                    ofs << data.scaled_model_v[st].log_pr_emission(j, data.corrected_event_seq_v[k][i]);
+                    ofs << data.emission_matrix_v[k].log_pr_emission(i, j);
                 }
                 ofs << std::endl;
             }
@@ -170,9 +308,11 @@ struct Parameter_Trainer
             for (unsigned j1 = 0; j1 < n_states; ++j1)
             {
                 std::map< unsigned, Float_Type > neighbour_m;
-                for (const auto& p : data.transitions_ptr_v[st]->neighbours(j1).to_v)
+                const auto& to = data.transitions_ptr_v[st]->to_table();
+                for (unsigned k = to.begin(j1); k < to.end(j1); ++k)
                 {
-                    neighbour_m[p.first] = p.second;
+                    if (to.is_padding(k)) continue;
+                    neighbour_m[to.state[k]] = to.log_p[k];
                 }
                 for (unsigned j2 = 0; j2 < n_states; ++j2)
                 {
@@ -195,7 +335,7 @@ struct Parameter_Trainer
                 for (unsigned j = 0; j < n_states; ++j)
                 {
                     if (j > 0) ofs << '\t';
-                    ofs << data.fwbw_v[k].cell(i, j).alpha;
+                    ofs << data.fwbw_v[k].log_alpha(i, j);
                 }
                 ofs << std::endl;
             }
@@ -206,7 +346,7 @@ struct Parameter_Trainer
                 for (unsigned j = 0; j < n_states; ++j)
                 {
                     if (j > 0) ofs << '\t';
-                    ofs << data.fwbw_v[k].cell(i, j).beta;
+                    ofs << data.fwbw_v[k].log_beta(i, j);
                 }
                 ofs << std::endl;
             }
@@ -215,6 +355,88 @@ struct Parameter_Trainer
 #endif
     }
 
+    /**
+     * Fused E-step: run fwbw on each event sequence in turn, accumulating the
+     * sufficient statistics from the rows visited in the backward pass.
+     * Emissions are computed on demand, so that memory stays within the fwbw max_mem() budget.
+     */
+    static void fill_train_stats(Train_Data& data)
+    {
+        unsigned n_event_seqs = data.event_seq_v.size();
+        data.pm_stats.clear();
+        data.st_stats[0].clear();
+        data.st_stats[1].clear();
+        Forward_Backward_Type fwbw;
+        std::vector< double > post(n_states);
+        // emission row of event i+1, then exp(emission) * beta_{i+1} / z, brought to the scale of beta_i
+        std::vector< Float_Type > em_next(n_states);
+        std::vector< double > em_beta_next(n_states);
+        Sparse_Posterior_Type sparse_post;
+        for (unsigned k = 0; k < n_event_seqs; ++k)
+        {
+            unsigned st = data.event_seq_v[k].second;
+            const Event_Sequence_View_Type& events = data.event_seq_v[k].first;
+            const Pore_Model_Type& pm = *data.model_ptr_v[st];
+            ST_Stats& st_stats = data.st_stats[st];
+            const State_Transition_Parameters_Type& st_params = data.transitions_params_v[st];
+            Float_Type p_stay = st_params.p_stay;
+            Float_Type p_step_4 = (1.0 - st_params.p_stay - st_params.p_skip) / 4.0;
+            Pore_Model_Emissions_Type em(data.scaled_model_v[st], events.with_drift(data.pm_params_ptr->drift));
+            fwbw.sweep(em, *data.transitions_ptr_v[st], [&] (unsigned i,
+                                                              const Float_Type* alpha_i,
+                                                              const Float_Type* beta_i,
+                                                              const Float_Type* beta_next) {
+                // Pr[ S_i = j ]
+                double z = 0.0;
+                for (unsigned j = 0; j < n_states; ++j)
+                {
+                    post[j] = double(alpha_i[j]) * beta_i[j];
+                    z += post[j];
+                }
+                if (not (z > 0.0)) return;
+                for (unsigned j = 0; j < n_states; ++j)
+                {
+                    post[j] /= z;
+                }
+                Forward_Backward_Type::make_sparse_posterior([&] (unsigned j) { return post[j]; }, sparse_post);
+                if (data.train_scaling)
+                {
+                    data.pm_stats.add_event(events[i], pm, sparse_post);
+                }
+                if (not data.train_transitions or not beta_next) return;
+                // Pr[ S_i = j1, S_{i+1} = j2 ] = alpha_i[j1] * p_trans * emission(j2) * beta_next[j2] / z,
+                // once the beta rows are brought to the same scale
+                double log_beta_step = fwbw.log_beta_scale(i + 1) - fwbw.log_beta_scale(i);
+                em.row(i + 1, &em_next[0]);
+                for (unsigned j2 = 0; j2 < n_states; ++j2)
+                {
+                    em_beta_next[j2] = std::exp(em_next[j2] + log_beta_step) * beta_next[j2] / z;
+                }
+                auto joint_prob = [&] (unsigned j1, unsigned j2, Float_Type p_trans) {
+                    return alpha_i[j1] * p_trans * em_beta_next[j2];
+                };
+                for (const auto& p : sparse_post)
+                {
+                    const unsigned& j1 = p.first;
+                    if (not is_st_train_kmer()[j1]) continue;
+                    double p_j1 = post[j1];
+                    st_stats.denom += p_j1;
+                    // Pr[ S_i = j1, S_{i+1} = j1 ]
+                    double p_j1_j1 = std::min(joint_prob(j1, j1, p_stay), p_j1);
+                    st_stats.p_stay_num += p_j1_j1;
+                    // Pr[ S_i = j1, dist(j1,S_{i+1}) > 1 ]
+                    double p_j1_d01 = p_j1_j1;
+                    for (auto j2 : Kmer_Type::neighbour_list(j1, 1))
+                    {
+                        p_j1_d01 += joint_prob(j1, j2, p_step_4);
+                    }
+                    st_stats.p_skip_num += p_j1 - std::min(p_j1_d01, p_j1);
+                }
+            });
+            data.fit += fwbw.log_pr_data();
+        }
+    }
+
     /**
      * Train pm_params on training data.
      * @data Training data, as filled by fill_train_data.
@@ -224,8 +446,6 @@ struct Parameter_Trainer
     static void train_pm_params(const Train_Data& data, Pore_Model_Parameters_Type& new_pm_params, bool& done)
     {
         done = false;
-        unsigned n_event_seqs = data.event_seq_ptr_v.size();
-        unsigned total_n_events = 0;
         ASSERT(data.pm_params_ptr);
         //
         // compute the scaling matrices in normal space (not logspace!)
@@ -237,72 +457,37 @@ struct Parameter_Trainer
         auto& d_hat = new_pm_params.var;
         auto& v_hat = new_pm_params.scale_sd;
         auto& u_hat = new_pm_params.var_sd;
-        std::array< std::array< double, 3 >, 3 > A = {{ {{ 0.0, 0.0, 0.0 }},
-                                                        {{ 0.0, 0.0, 0.0 }},
-                                                        {{ 0.0, 0.0, 0.0 }} }};
-        std::array< double, 3 > B = {{ 0.0, 0.0, 0.0 }};
-        double D       = 0.0; // = \sum_i x^2_i s_{i,0} (used for var)
-        double V_numer = 0.0; // = \sum_i y_i \sum_j p_{i,j} \lambda_j / \eta^2_j (for scale_sd)
-        double V_denom = 0.0; // = \sum_i \sum_j p_{i,j} \lambda_j / \eta_j (for scale_sd)
-        double U_pos   = 0.0; // = \sum_i (1/y_i) \sum_j p_{i,j} \lambda_j (for var_sd)
-        for (unsigned k = 0; k < n_event_seqs; ++k)
+        PM_Stats stats;
+        if (data.fused)
         {
-            unsigned st = data.event_seq_ptr_v.at(k).second;
-            ASSERT(st < 2);
-            const Event_Sequence_Type& events = *data.event_seq_ptr_v[k].first;
-            unsigned n_events = events.size();
-            total_n_events += n_events;
-            const Pore_Model_Type& pm = *data.model_ptr_v[st];
-            const Forward_Backward_Type& fwbw = data.fwbw_v.at(k);
-            for (unsigned i = 0; i < n_events; ++i)
+            stats = data.pm_stats;
+        }
+        else
+        {
+            stats.clear();
+            for (unsigned k = 0; k < data.event_seq_v.size(); ++k)
             {
-                Float_Type x_i = events[i].mean;
-                Float_Type y_i = events[i].stdv;
-                Float_Type t_i = events[i].start;
-                LOG(debug1)
-                    << "outter_loop k=" << k << " i=" << i
-                    << " x_i=" << x_i
-                    << " t_i=" << t_i << std::endl;
-                // \sum_j p_{i,j} \mu^*_j / \simga^2_j
-                std::array< float, 3 > s = {{ 0.0, 0.0, 0.0 }};
-                // \sum_j p_{i,j} \lambda_j / \eta^*_j
-                std::array< float, 3 > l = {{ 0.0, 0.0, 0.0 }};
-                for (unsigned j = 0; j < Pore_Model_Type::n_states; ++j)
+                unsigned st = data.event_seq_v.at(k).second;
+                ASSERT(st < 2);
+                const Event_Sequence_View_Type& events = data.event_seq_v[k].first;
+                const Pore_Model_Type& pm = *data.model_ptr_v[st];
+                const Forward_Backward_Type& fwbw = data.fwbw_v.at(k);
+                Sparse_Posterior_Type sparse_post;
+                for (unsigned i = 0; i < events.size(); ++i)
                 {
-                    Float_Type p_ij = std::exp(fwbw.log_posterior(i, j));
-                    Float_Type term_s0 = p_ij / (pm.state(j).level_stdv * pm.state(j).level_stdv);
-                    Float_Type term_s1 = term_s0 * pm.state(j).level_mean;
-                    Float_Type term_s2 = term_s1 * pm.state(j).level_mean;
-                    Float_Type term_l0 = p_ij * pm.state(j).sd_lambda;
-                    Float_Type term_l1 = term_l0 / pm.state(j).sd_mean;
-                    Float_Type term_l2 = term_l1 / pm.state(j).sd_mean;
-                    LOG(debug2)
-                        << "inner_loop k=" << k << " i=" << i << " j=" << j << " p_ij=" << p_ij
-                        << " term_s0=" << term_s0 << " term_s1=" << term_s1 << " term_s2=" << term_s2
-                        << " term_l0=" << term_l0 << " term_l1=" << term_l1 << " term_l2=" << term_l2
-                        << std::endl;
-                    s[0] += term_s0;
-                    s[1] += term_s1;
-                    s[2] += term_s2;
-                    l[0] += term_l0;
-                    l[1] += term_l1;
-                    l[2] += term_l2;
-                } // for j
-                A[0][0] += s[0];
-                A[0][1] += s[1];
-                A[0][2] += s[0] * t_i;
-                A[1][1] += s[2];
-                A[1][2] += s[1] * t_i;
-                A[2][2] += s[0] * t_i * t_i;
-                B[0]    += s[0] * x_i;
-                B[1]    += s[1] * x_i;
-                B[2]    += s[0] * x_i * t_i;
-                D       += s[0] * x_i * x_i;
-                V_numer += l[2] * y_i;
-                V_denom += l[1];
-                U_pos   += l[0] / y_i;
-            } // for i
-        } // for k
+                    LOG(debug1) << "outter_loop k=" << k << " i=" << i << std::endl;
+                    fwbw.sparse_posterior(i, sparse_post);
+                    stats.add_event(events[i], pm, sparse_post);
+                }
+            }
+        }
+        auto& A = stats.A;
+        auto& B = stats.B;
+        const double& D = stats.D;
+        const double& V_numer = stats.V_numer;
+        const double& V_denom = stats.V_denom;
+        const double& U_pos = stats.U_pos;
+        const unsigned& total_n_events = stats.total_n_events;
         A[1][0] = A[0][1];
         A[2][0] = A[0][2];
         A[2][1] = A[1][2];
@@ -421,87 +606,106 @@ struct Parameter_Trainer
     static void train_st_params(const Train_Data& data,
                                 std::array< State_Transition_Parameters_Type, 2 >& new_st_params)
     {
-        unsigned n_event_seqs = data.event_seq_ptr_v.size();
+        unsigned n_event_seqs = data.event_seq_v.size();
         for (unsigned st = 0; st < 2; ++st)
         {
             ASSERT(data.st_params_ptr_v[st]);
-            LogSumSet_Type s_p_stay_num(false);
-            LogSumSet_Type s_p_skip_num(false);
-            LogSumSet_Type s_denom(false);
-            Float_Type log_p_stay = std::log(data.st_params_ptr_v[st]->p_stay);
-            Float_Type log_p_step_4 = std::log(1.0 - data.st_params_ptr_v[st]->p_stay - data.st_params_ptr_v[st]->p_skip) - std::log(4.0);
-            for (unsigned k = 0; k < n_event_seqs; ++k)
+            if (data.fused)
             {
-                if (data.event_seq_ptr_v[k].second != st) continue;
-                const Pore_Model_Type& scaled_pm = data.scaled_model_v[st];
-                const Event_Sequence_Type& corrected_events = data.corrected_event_seq_v.at(k);
-                unsigned n_events = corrected_events.size();
-                const Forward_Backward_Type& fwbw = data.fwbw_v.at(k);
-                //
-                // P[S_i = j1, S_{i+1} = j2]
-                //
-                auto log_joint_prob = [&] (unsigned i, unsigned j1, unsigned j2, Float_Type log_p_trans) {
-                    Float_Type p = fwbw.cell(i, j1).alpha
-                        + log_p_trans
-                        + scaled_pm.log_pr_emission(j2, corrected_events[i + 1])
-                        + fwbw.cell(i + 1, j2).beta
-                        - fwbw.log_pr_data();
-                    LOG(debug2) << "step_prob k=" << k
-                                << " i=" << i
-                                << " j1=" << Kmer_Type::to_string(j1)
-                                << " j2=" << Kmer_Type::to_string(j2)
-                                << " log_p_trans=" << log_p_trans
-                                << " res=" << p << std::endl;
-                    return p;
-                };
-
-                for (unsigned i = 0; i < n_events - 1; ++i)
+                new_st_params[st].p_stay = data.st_stats[st].p_stay_num / data.st_stats[st].denom;
+                new_st_params[st].p_skip = data.st_stats[st].p_skip_num / data.st_stats[st].denom;
+            }
+            else
+            {
+                LogSumSet_Type s_p_stay_num(false);
+                LogSumSet_Type s_p_skip_num(false);
+                LogSumSet_Type s_denom(false);
+                const State_Transition_Parameters_Type& st_params = data.transitions_params_v[st];
+                Float_Type log_p_stay = std::log(st_params.p_stay);
+                Float_Type log_p_step_4 = std::log(1.0 - st_params.p_stay - st_params.p_skip) - std::log(4.0);
+                for (unsigned k = 0; k < n_event_seqs; ++k)
                 {
-                    for (auto j1 : st_train_kmers())
+                    if (data.event_seq_v[k].second != st) continue;
+                    const Emission_Matrix_Type& em = data.emission_matrix_v.at(k);
+                    unsigned n_events = em.n_events();
+                    const Forward_Backward_Type& fwbw = data.fwbw_v.at(k);
+                    //
+                    // P[S_i = j1, S_{i+1} = j2]
+                    //
+                    auto log_joint_prob = [&] (unsigned i, unsigned j1, unsigned j2, Float_Type log_p_trans) {
+                        Float_Type p = fwbw.log_alpha(i, j1)
+                            + log_p_trans
+                            + em.log_pr_emission(i + 1, j2)
+                            + fwbw.log_beta(i + 1, j2)
+                            - fwbw.log_pr_data();
+                        LOG(debug2) << "step_prob k=" << k
+                                    << " i=" << i
+                                    << " j1=" << Kmer_Type::to_string(j1)
+                                    << " j2=" << Kmer_Type::to_string(j2)
+                                    << " log_p_trans=" << log_p_trans
+                                    << " res=" << p << std::endl;
+                        return p;
+                    };
+
+                    Sparse_Posterior_Type sparse_post;
+                    for (unsigned i = 0; i < n_events - 1; ++i)
                     {
-                        // Pr[ S_i = j1 ]
-                        Float_Type log_p_j1 = fwbw.log_posterior(i, j1);
-                        s_denom.add(log_p_j1);
-                        // Pr[ S_i = j1, S_{i+1} = j1 ]
-                        Float_Type log_p_j1_j1 = log_joint_prob(i, j1, j1, log_p_stay);
-                        if (log_p_j1_j1 > log_p_j1)
+                        fwbw.sparse_posterior(i, sparse_post);
+                        for (const auto& p : sparse_post)
                         {
-                            if (log_p_j1_j1 > log_p_j1 + std::max(std::abs(log_p_j1), 1.0f) * 1.0e-3)
+                            const unsigned& j1 = p.first;
+                            if (not is_st_train_kmer()[j1]) continue;
+                            // Pr[ S_i = j1 ]
+                            Float_Type log_p_j1 = std::log(p.second);
+                            s_denom.add(log_p_j1);
+                            // Pr[ S_i = j1, S_{i+1} = j1 ]
+                            Float_Type log_p_j1_j1 = log_joint_prob(i, j1, j1, log_p_stay);
+                            if (log_p_j1_j1 > log_p_j1)
                             {
-                                LOG(warning) << "numerical error log_p_j1 [" << log_p_j1
-                                             << "] log_p_j1_j1 [" << log_p_j1_j1 << "]" << std::endl;
+                                if (log_p_j1_j1 > log_p_j1 + std::max(std::abs(log_p_j1), 1.0f) * 1.0e-3)
+                                {
+                                    LOG(warning) << "numerical error log_p_j1 [" << log_p_j1
+                                                 << "] log_p_j1_j1 [" << log_p_j1_j1 << "]" << std::endl;
+                                }
+                                log_p_j1_j1 = log_p_j1;
                             }
-                            log_p_j1_j1 = log_p_j1;
-                        }
-                        s_p_stay_num.add(log_p_j1_j1);
-                        // Pr[ S_i = j1, dist(j1,S_{i+1}) > 1 ]
-                        Float_Type log_p_j1_d01;
-                        {
-                            LogSumSet_Type s2(false);
-                            s2.add(log_p_j1_j1);
-                            for (auto j2 : Kmer_Type::neighbour_list(j1, 1))
+                            s_p_stay_num.add(log_p_j1_j1);
+                            // Pr[ S_i = j1, dist(j1,S_{i+1}) > 1 ]
+                            Float_Type log_p_j1_d01;
                             {
-                                // transition prob j1 to j2 is (p_step / 4)
-                                s2.add(log_joint_prob(i, j1, j2, log_p_step_4));
+                                LogSumSet_Type s2(false);
+                                s2.add(log_p_j1_j1);
+                                for (auto j2 : Kmer_Type::neighbour_list(j1, 1))
+                                {
+                                    // transition prob j1 to j2 is (p_step / 4)
+                                    s2.add(log_joint_prob(i, j1, j2, log_p_step_4));
+                                }
+                                log_p_j1_d01 = s2.val();
                             }
-                            log_p_j1_d01 = s2.val();
-                        }
-                        if (log_p_j1_d01 > log_p_j1)
-                        {
-                            if (log_p_j1_d01 > log_p_j1 + std::max(std::abs(log_p_j1), 1.0f) * 1.0e-3)
+                            if (log_p_j1_d01 > log_p_j1)
                             {
-                                LOG(warning) << "numerical error log_p_j1 [" << log_p_j1
-                                             << "] log_p_j1_d01 [" << log_p_j1_d01 << "]" << std::endl;
+                                if (log_p_j1_d01 > log_p_j1 + std::max(std::abs(log_p_j1), 1.0f) * 1.0e-3)
+                                {
+                                    LOG(warning) << "numerical error log_p_j1 [" << log_p_j1
+                                                 << "] log_p_j1_d01 [" << log_p_j1_d01 << "]" << std::endl;
+                                }
+                                log_p_j1_d01 = log_p_j1;
                             }
-                            log_p_j1_d01 = log_p_j1;
-                        }
-                        Float_Type p_j1_d2 = std::exp(log_p_j1) - std::exp(log_p_j1_d01);
-                        s_p_skip_num.add(std::log(p_j1_d2));
-                    } // for j1
-                } // for i
-            } // for k
-            new_st_params[st].p_stay = std::exp(s_p_stay_num.val() - s_denom.val());
-            new_st_params[st].p_skip = std::exp(s_p_skip_num.val() - s_denom.val());
+                            Float_Type p_j1_d2 = std::exp(log_p_j1) - std::exp(log_p_j1_d01);
+                            s_p_skip_num.add(std::log(p_j1_d2));
+                        } // for j1
+                    } // for i
+                } // for k
+                new_st_params[st].p_stay = std::exp(s_p_stay_num.val() - s_denom.val());
+                new_st_params[st].p_skip = std::exp(s_p_skip_num.val() - s_denom.val());
+            }
+            if (not std::isfinite(new_st_params[st].p_stay) or not std::isfinite(new_st_params[st].p_skip))
+            {
+                LOG(warning) << "state transition parameters " << new_st_params[st]
+                             << " for strand [" << st
+                             << "] are not finite; keeping " << *data.st_params_ptr_v[st] << std::endl;
+                new_st_params[st] = *data.st_params_ptr_v[st];
+            }
             if (new_st_params[st].p_stay < .05 or new_st_params[st].p_stay > .4
                 or new_st_params[st].p_skip < .05 or new_st_params[st].p_skip > .4)
             {
@@ -526,7 +730,7 @@ struct Parameter_Trainer
      * @done Bool; set to true if no more training rounds can be performed due to singularity.
      */
     static void train_one_round(
-        const std::vector< std::pair< const Event_Sequence_Type*, unsigned > >& event_seq_ptrs,
+        const std::vector< std::pair< Event_Sequence_View_Type, unsigned > >& event_seqs,
         const std::array< const Pore_Model_Type*, 2 >& model_ptrs,
         const State_Transitions_Type& default_transitions,
         const Pore_Model_Parameters_Type& crt_pm_params,
@@ -540,18 +744,35 @@ struct Parameter_Trainer
     {
         // initialize training data
         Train_Data data;
-        data.event_seq_ptr_v = event_seq_ptrs;
+        data.event_seq_v = event_seqs;
         data.model_ptr_v = model_ptrs;
         data.default_transitions_ptr = &default_transitions;
         data.pm_params_ptr = &crt_pm_params;
         data.st_params_ptr_v = {{ &crt_st_params[0], &crt_st_params[1] }};
+        data.train_scaling = train_scaling;
+        data.train_transitions = train_transitions;
         // fill the training data
         fill_train_data(data);
         fit = data.fit;
+        // a fit or params which are not finite cannot be improved on; keep the current params
+        if (not std::isfinite(fit))
+        {
+            LOG(warning) << "fit [" << fit << "] is not finite; keeping current parameters" << std::endl;
+            done = true;
+            new_pm_params = crt_pm_params;
+            new_st_params = crt_st_params;
+            return;
+        }
         if (train_scaling)
         {
             // train pm params
             train_pm_params(data, new_pm_params, done);
+            if (not done and not is_finite(new_pm_params))
+            {
+                LOG(warning) << "trained pm_params [" << new_pm_params << "] are not finite; keeping current parameters" << std::endl;
+                done = true;
+                new_pm_params = crt_pm_params;
+            }
             if (done)
             {
                 new_st_params = crt_st_params;
@@ -565,6 +786,12 @@ struct Parameter_Trainer
         }
     } // train_one_round
 
+    static bool is_finite(const Pore_Model_Parameters_Type& params)
+    {
+        return std::isfinite(params.scale) and std::isfinite(params.shift) and std::isfinite(params.drift)
+            and std::isfinite(params.var) and std::isfinite(params.scale_sd) and std::isfinite(params.var_sd);
+    }
+
 }; // class Parameter_Trainer
 
 #endif
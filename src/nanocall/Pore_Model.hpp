@@ -15,6 +15,12 @@
 #include <iostream>
 #include <map>
 #include <string>
+#include <vector>
+
+#if not defined(DISABLE_SIMD) and defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__))
+#define POREMODEL_X86_SIMD
+#include <immintrin.h>
+#endif
 
 #include "Kmer.hpp"
 #include "Event.hpp"
@@ -147,6 +153,157 @@ struct Pore_Model_State
     }
 }; // struct Pore_Model_State
 
+/**
+ * Structure-of-arrays copy of the pore model states, used for computing emission rows.
+ * With a = (x - level_mean) * inv_level_stdv and b = y - sd_mean, the emission of event (x, y) is:
+ *   log_norm - 3/2 log(y) - a^2 / 2 - ig_coef * b^2 / y
+ */
+template < typename Float_Type >
+struct Pore_Model_Arrays
+{
+    std::vector< Float_Type > level_mean;
+    std::vector< Float_Type > inv_level_stdv;
+    std::vector< Float_Type > sd_mean;
+    std::vector< Float_Type > ig_coef;  // sd_lambda / (2 sd_mean^2)
+    std::vector< Float_Type > log_norm; // log(sd_lambda) / 2 - log(level_stdv) - log(2 pi)
+
+    void resize(unsigned n)
+    {
+        level_mean.resize(n);
+        inv_level_stdv.resize(n);
+        sd_mean.resize(n);
+        ig_coef.resize(n);
+        log_norm.resize(n);
+    }
+    template < typename Pore_Model_State_Type >
+    void set(unsigned i, const Pore_Model_State_Type& s)
+    {
+        static const double log_2pi = std::log(2.0 * M_PI);
+        level_mean[i] = s.level_mean;
+        inv_level_stdv[i] = 1.0 / double(s.level_stdv);
+        sd_mean[i] = s.sd_mean;
+        ig_coef[i] = double(s.sd_lambda) / (2.0 * double(s.sd_mean) * double(s.sd_mean));
+        log_norm[i] = std::log(double(s.sd_lambda)) / 2.0 - std::log(double(s.level_stdv)) - log_2pi;
+    }
+    // emission of state i; inv_y = 1 / y, ev_norm = -3/2 log(y)
+    Float_Type log_pr_emission(unsigned i, Float_Type x, Float_Type y, Float_Type inv_y, Float_Type ev_norm) const
+    {
+        Float_Type a = (x - level_mean[i]) * inv_level_stdv[i];
+        Float_Type b = y - sd_mean[i];
+        return log_norm[i] + ev_norm - Float_Type(0.5) * a * a - ig_coef[i] * b * (b * inv_y);
+    }
+}; // struct Pore_Model_Arrays
+
+/**
+ * Emission row kernel: out[j] for j in [begin, end).
+ * The float specialization dispatches at runtime to AVX-512 or AVX2 code, if available.
+ */
+template < typename Float_Type >
+struct Emission_Row_Kernel
+{
+    static void run(const Pore_Model_Arrays< Float_Type >& arr, Float_Type x, Float_Type y, Float_Type log_y,
+                    Float_Type* out, unsigned begin, unsigned end)
+    {
+        Float_Type inv_y = Float_Type(1.0) / y;
+        Float_Type ev_norm = Float_Type(-1.5) * log_y;
+        for (unsigned j = begin; j < end; ++j)
+        {
+            out[j] = arr.log_pr_emission(j, x, y, inv_y, ev_norm);
+        }
+    }
+}; // struct Emission_Row_Kernel
+
+#ifdef POREMODEL_X86_SIMD
+template <>
+struct Emission_Row_Kernel< float >
+{
+    static void run(const Pore_Model_Arrays< float >& arr, float x, float y, float log_y,
+                    float* out, unsigned begin, unsigned end)
+    {
+        static const int level = simd_level();
+        if (level == 2)
+        {
+            run_avx512(arr, x, y, log_y, out, begin, end);
+        }
+        else if (level == 1)
+        {
+            run_avx2(arr, x, y, log_y, out, begin, end);
+        }
+        else
+        {
+            run_scalar(arr, x, y, log_y, out, begin, end);
+        }
+    }
+
+private:
+    // 2: AVX-512; 1: AVX2 & FMA; 0: neither
+    static int simd_level()
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return 2;
+        if (__builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma")) return 1;
+        return 0;
+    }
+
+    static void run_scalar(const Pore_Model_Arrays< float >& arr, float x, float y, float log_y,
+                           float* out, unsigned begin, unsigned end)
+    {
+        float inv_y = 1.0f / y;
+        float ev_norm = -1.5f * log_y;
+        for (unsigned j = begin; j < end; ++j)
+        {
+            out[j] = arr.log_pr_emission(j, x, y, inv_y, ev_norm);
+        }
+    }
+
+    __attribute__((target("avx2,fma")))
+    static void run_avx2(const Pore_Model_Arrays< float >& arr, float x, float y, float log_y,
+                         float* out, unsigned begin, unsigned end)
+    {
+        const __m256 v_x = _mm256_set1_ps(x);
+        const __m256 v_y = _mm256_set1_ps(y);
+        const __m256 v_inv_y = _mm256_set1_ps(1.0f / y);
+        const __m256 v_ev_norm = _mm256_set1_ps(-1.5f * log_y);
+        const __m256 v_half = _mm256_set1_ps(0.5f);
+        unsigned j = begin;
+        for (; j + 8 <= end; j += 8)
+        {
+            __m256 a = _mm256_mul_ps(_mm256_sub_ps(v_x, _mm256_loadu_ps(&arr.level_mean[j])),
+                                     _mm256_loadu_ps(&arr.inv_level_stdv[j]));
+            __m256 b = _mm256_sub_ps(v_y, _mm256_loadu_ps(&arr.sd_mean[j]));
+            __m256 r = _mm256_add_ps(_mm256_loadu_ps(&arr.log_norm[j]), v_ev_norm);
+            r = _mm256_fnmadd_ps(_mm256_mul_ps(v_half, a), a, r);
+            r = _mm256_fnmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(&arr.ig_coef[j]), b), _mm256_mul_ps(b, v_inv_y), r);
+            _mm256_storeu_ps(&out[j], r);
+        }
+        run_scalar(arr, x, y, log_y, out, j, end);
+    }
+
+    __attribute__((target("avx512f")))
+    static void run_avx512(const Pore_Model_Arrays< float >& arr, float x, float y, float log_y,
+                           float* out, unsigned begin, unsigned end)
+    {
+        const __m512 v_x = _mm512_set1_ps(x);
+        const __m512 v_y = _mm512_set1_ps(y);
+        const __m512 v_inv_y = _mm512_set1_ps(1.0f / y);
+        const __m512 v_ev_norm = _mm512_set1_ps(-1.5f * log_y);
+        const __m512 v_half = _mm512_set1_ps(0.5f);
+        unsigned j = begin;
+        for (; j + 16 <= end; j += 16)
+        {
+            __m512 a = _mm512_mul_ps(_mm512_sub_ps(v_x, _mm512_loadu_ps(&arr.level_mean[j])),
+                                     _mm512_loadu_ps(&arr.inv_level_stdv[j]));
+            __m512 b = _mm512_sub_ps(v_y, _mm512_loadu_ps(&arr.sd_mean[j]));
+            __m512 r = _mm512_add_ps(_mm512_loadu_ps(&arr.log_norm[j]), v_ev_norm);
+            r = _mm512_fnmadd_ps(_mm512_mul_ps(v_half, a), a, r);
+            r = _mm512_fnmadd_ps(_mm512_mul_ps(_mm512_loadu_ps(&arr.ig_coef[j]), b), _mm512_mul_ps(b, v_inv_y), r);
+            _mm512_storeu_ps(&out[j], r);
+        }
+        run_scalar(arr, x, y, log_y, out, j, end);
+    }
+}; // struct Emission_Row_Kernel< float >
+#endif
+
 template < typename Float_Type, unsigned Kmer_Size = 6 >
 class Pore_Model
 {
@@ -225,6 +382,7 @@ public:
     // load model from input stream
     friend std::istream& operator >> (std::istream& is, Pore_Model& pm)
     {
+        pm._state.resize(pm.n_states);
         for (unsigned i = 0; i < pm.n_states; ++i)
         {
             std::string s;
@@ -244,12 +402,19 @@ public:
     // log of probability of an emission from a state
     Float_Type log_pr_emission(unsigned i, const Event_Type& e) const
     {
-        Float_Type res = state(i).log_pr_emission(e);
-        return res;
+        return _arrays.log_pr_emission(i, e.mean, e.stdv, Float_Type(1.0) / e.stdv, Float_Type(-1.5) * e.log_stdv);
+    }
+
+    // log of probability of an emission from each state in [begin, end), stored in out[begin, end)
+    void log_pr_emission_row(const Event_Type& e, Float_Type* out,
+                             unsigned begin = 0, unsigned end = n_states) const
+    {
+        Emission_Row_Kernel< Float_Type >::run(_arrays, e.mean, e.stdv, e.log_stdv, out, begin, end);
     }
 
 private:
     std::vector< Pore_Model_State_Type > _state;
+    Pore_Model_Arrays< Float_Type > _arrays;
     Float_Type _mean;
     Float_Type _stdv;
     unsigned _strand;
@@ -260,6 +425,11 @@ private:
         std::tie(_mean, _stdv) = alg::mean_stdv_of< Float_Type >(
             _state,
             [] (const Pore_Model_State_Type& s) { return s.level_mean; });
+        _arrays.resize(n_states);
+        for (unsigned i = 0; i < n_states; ++i)
+        {
+            _arrays.set(i, _state[i]);
+        }
     }
 }; // class Pore_Model
 
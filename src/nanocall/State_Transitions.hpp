@@ -1,11 +1,17 @@
 #ifndef __STATE_TRANSITIONS_BASE_HPP
 #define __STATE_TRANSITIONS_BASE_HPP
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
-#include <vector>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
 
 #include "Kmer.hpp"
 #include "logsumset.hpp"
@@ -50,56 +56,327 @@ struct State_Transition_Parameters
     }
 }; // struct State_Transition_Parameters
 
+/**
+ * Flat (CSR) transition table: the entries of row i are at indices [begin(i), end(i))
+ * of the arrays state and log_p. If degree is non-zero, all rows have exactly that many entries,
+ * some of which might be padding, with log_p == -INFINITY.
+ */
 template < typename Float_Type >
-struct State_Neighbours
+struct State_Transition_Table
 {
-    State_Neighbours() : p_rest_from(-INFINITY), p_rest_to(-INFINITY) {}
-    std::vector< std::pair< unsigned, Float_Type > > from_v;
-    std::vector< std::pair< unsigned, Float_Type > > to_v;
-    Float_Type p_rest_from;
-    Float_Type p_rest_to;
-}; // struct State_Neighbours
+    std::vector< unsigned > offset;
+    std::vector< unsigned > state;
+    std::vector< Float_Type > log_p;
+    unsigned degree;
+
+    State_Transition_Table() : degree(0) {}
+    void clear() { offset.clear(); state.clear(); log_p.clear(); degree = 0; }
+
+    unsigned n_rows() const { return offset.empty()? 0 : offset.size() - 1; }
+    unsigned begin(unsigned i) const { return offset[i]; }
+    unsigned end(unsigned i) const { return offset[i + 1]; }
+    bool is_padding(unsigned k) const { return log_p[k] == -INFINITY; }
+
+    // build a table row by row: start(), then push_back() the entries of each row followed by end_row()
+    void start() { clear(); offset.push_back(0); }
+    void push_back(unsigned j, Float_Type lp)
+    {
+        state.push_back(j);
+        log_p.push_back(lp);
+    }
+    void end_row() { offset.push_back(state.size()); }
+
+    // extend all rows to the length of the longest one; the padding of row i points to i
+    void pad()
+    {
+        unsigned d = 0;
+        for (unsigned i = 0; i < n_rows(); ++i)
+        {
+            d = std::max(d, end(i) - begin(i));
+        }
+        State_Transition_Table res;
+        res.start();
+        for (unsigned i = 0; i < n_rows(); ++i)
+        {
+            for (unsigned k = begin(i); k < end(i); ++k)
+            {
+                res.push_back(state[k], log_p[k]);
+            }
+            for (unsigned k = end(i) - begin(i); k < d; ++k)
+            {
+                res.push_back(i, -INFINITY);
+            }
+            res.end_row();
+        }
+        res.degree = d;
+        std::swap(*this, res);
+    }
+}; // struct State_Transition_Table
+
+/**
+ * Factored form of the transitions of the overlap model of State_Transitions::get_trans_prob().
+ *
+ * The level-l predecessors of state j are the states i with suffix(i, k-l) == prefix(j, k-l):
+ * level 1 holds the steps into j, level 2 the skips of 1 base, and level k all states. For fixed j,
+ * two level groups are either nested or disjoint, so the predecessors of j split into atoms: j itself
+ * (atom 0), and for each level l, the level-l group minus j and the lower level groups it contains.
+ * All transitions into j from one atom have the same probability. A kernel can therefore
+ * aggregate the previous column once per (level, key), and combine n_levels+1 terms per state.
+ * The successors of a state split into atoms in the same way, which is used by backward passes.
+ *
+ * For sum-product kernels, the atom sums are expressed as linear combinations of the level
+ * group sums, folded into one coefficient per (state, level).
+ *
+ * Which level groups of a state are nested depends only on the borders of its kmer, and
+ * only a few such nesting patterns occur. States are classified by pattern once per process;
+ * atom probabilities and coefficients are stored per pattern, so computing them for new
+ * parameters takes O(k^3) per pattern, and no neighbour lists are needed. For l >= l0, the
+ * nesting of the level-l group of j only depends on from_key(j, l0), resp. to_key(j, l0), so
+ * a kernel can combine the terms of all levels above some l0 once per level-l0 key.
+ */
+template < typename Float_Type, unsigned Kmer_Size = 6 >
+class State_Transition_Groups
+{
+public:
+    typedef Kmer< Kmer_Size > Kmer_Type;
+    static const unsigned n_states = 1u << (2 * Kmer_Size);
+
+    State_Transition_Groups() : _n_levels(0) {}
+
+    unsigned n_levels() const { return _n_levels; }
+
+    // number of groups at level l
+    static unsigned n_keys(unsigned l) { return n_states >> (2 * l); }
+    // key of the level-l group holding the predecessors of j
+    static unsigned from_key(unsigned j, unsigned l) { return j >> (2 * l); }
+    // key of the level-l group holding the successors of i
+    static unsigned to_key(unsigned i, unsigned l) { return Kmer_Type::suffix(i, Kmer_Size - l); }
+    // true iff i is a level-l predecessor of j
+    static bool is_from(unsigned i, unsigned j, unsigned l)
+    {
+        return Kmer_Type::suffix(i, Kmer_Size - l) == Kmer_Type::prefix(j, Kmer_Size - l);
+    }
+
+    // log probability of a transition into j from atom l
+    Float_Type log_p_from(unsigned j, unsigned l) const
+    {
+        return _log_p_from[patterns().from_v[j] * (_n_levels + 1) + l];
+    }
+    // sum_i Pr[i -> j] * x_i == sum_l coef_from(j, l) * (l > 0? sum of x over level-l group of j : x_j)
+    double coef_from(unsigned j, unsigned l) const
+    {
+        return _coef[patterns().from_v[j] * (_n_levels + 1) + l];
+    }
+    // sum_j Pr[i -> j] * x_j == sum_l coef_to(i, l) * (l > 0? sum of x over level-l group of i : x_i)
+    double coef_to(unsigned i, unsigned l) const
+    {
+        return _coef[patterns().to_v[i] * (_n_levels + 1) + l];
+    }
+
+    /**
+     * Compute atom probabilities and coefficients for the transitions with
+     * Pr[i -> j] = (i == j? level_p[0] : 0) + sum_{l >= 1, i in level-l group of j} level_p[l],
+     * keeping the atoms of levels 1..n_levels; level_p must hold Kmer_Size+1 terms.
+     */
+    void compute(unsigned n_levels, const std::vector< double >& level_p)
+    {
+        assert(n_levels <= Kmer_Size);
+        assert(level_p.size() == Kmer_Size + 1);
+        const Patterns& pat = patterns();
+        _n_levels = n_levels;
+        unsigned n_patterns = pat.mask_v.size();
+        _log_p_from.resize(n_patterns * (_n_levels + 1));
+        _coef.resize(n_patterns * (_n_levels + 1));
+        std::vector< double > p_atom(_n_levels + 1);
+        for (unsigned q = 0; q < n_patterns; ++q)
+        {
+            auto nested = [&] (unsigned l1, unsigned l2) { return (pat.mask_v[q] >> mask_bit(l1, l2)) & 1; };
+            for (unsigned l = 0; l <= _n_levels; ++l)
+            {
+                // members of atom l are in the level-l group (l > 0: or j itself),
+                // and in the upper level groups containing it
+                p_atom[l] = level_p[l];
+                for (unsigned l2 = l + 1; l2 <= Kmer_Size; ++l2)
+                {
+                    if (nested(l, l2)) p_atom[l] += level_p[l2];
+                }
+                _log_p_from[q * (_n_levels + 1) + l] = std::log(static_cast< Float_Type >(p_atom[l]));
+            }
+            compute_coefs(p_atom, &_coef[q * (_n_levels + 1)], nested);
+        }
+    }
+
+private:
+    // per pattern; the predecessors and the successors of a state with the same pattern
+    // have the same atom probabilities and coefficients
+    std::vector< Float_Type > _log_p_from;
+    std::vector< double > _coef;
+    unsigned _n_levels;
+
+    // nesting patterns of all states; bit mask_bit(l1, l2) is set iff
+    // the level-l1 group (l1 == 0: the state itself) is inside the level-l2 group
+    struct Patterns
+    {
+        std::vector< std::uint64_t > mask_v;
+        // pattern index of the predecessors, resp. successors, of each state
+        std::vector< std::uint8_t > from_v;
+        std::vector< std::uint8_t > to_v;
+    }; // struct Patterns
+    static unsigned mask_bit(unsigned l1, unsigned l2) { return l1 * (Kmer_Size + 1) + l2; }
+    static const Patterns& patterns()
+    {
+        static const Patterns _patterns = compute_patterns();
+        return _patterns;
+    }
+    static Patterns compute_patterns()
+    {
+        static_assert((Kmer_Size + 1) * (Kmer_Size + 1) <= 64, "nesting pattern does not fit in a mask");
+        Patterns res;
+        std::map< std::uint64_t, unsigned > index_m;
+        auto index = [&] (std::uint64_t mask) {
+            auto it = index_m.find(mask);
+            if (it != index_m.end()) return it->second;
+            unsigned q = res.mask_v.size();
+            res.mask_v.push_back(mask);
+            index_m[mask] = q;
+            return q;
+        };
+        res.from_v.resize(n_states);
+        res.to_v.resize(n_states);
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            std::uint64_t from_mask = 0;
+            std::uint64_t to_mask = 0;
+            for (unsigned l2 = 1; l2 <= Kmer_Size; ++l2)
+            {
+                for (unsigned l1 = 0; l1 < l2; ++l1)
+                {
+                    // some member of the level-l1 group of predecessors of j
+                    unsigned i = (l1 == 0? j : from_key(j, l1));
+                    from_mask |= std::uint64_t(is_from(i, j, l2)) << mask_bit(l1, l2);
+                    // some member of the level-l1 group of successors of j
+                    unsigned j2 = (l1 == 0? j : to_key(j, l1) << (2 * l1));
+                    to_mask |= std::uint64_t(is_from(j, j2, l2)) << mask_bit(l1, l2);
+                }
+            }
+            res.from_v[j] = index(from_mask);
+            res.to_v[j] = index(to_mask);
+        }
+        assert(res.mask_v.size() <= 256);
+        return res;
+    }
+
+    // given the atom probabilities of one state and the nesting of its level groups,
+    // write the coefficients of (self, level 1 sum, ..., level n_levels sum)
+    template < typename Nested_Fn >
+    void compute_coefs(const std::vector< double >& p_atom, double* coef, Nested_Fn nested) const
+    {
+        // atom_v[l][l2] := coefficient of term l2 in the sum over atom l
+        std::vector< std::vector< double > > atom_v(_n_levels + 1, std::vector< double >(_n_levels + 1, 0.0));
+        atom_v[0][0] = 1.0;
+        for (unsigned l = 1; l <= _n_levels; ++l)
+        {
+            atom_v[l][l] = 1.0;
+            for (unsigned l1 = 0; l1 < l; ++l1)
+            {
+                if (not nested(l1, l)) continue;
+                for (unsigned l2 = 0; l2 <= _n_levels; ++l2)
+                {
+                    atom_v[l][l2] -= atom_v[l1][l2];
+                }
+            }
+        }
+        for (unsigned l2 = 0; l2 <= _n_levels; ++l2)
+        {
+            coef[l2] = 0.0;
+            for (unsigned l = 0; l <= _n_levels; ++l)
+            {
+                coef[l2] += p_atom[l] * atom_v[l][l2];
+            }
+        }
+    }
+}; // class State_Transition_Groups
 
 template < typename Float_Type, unsigned Kmer_Size = 6 >
 class State_Transitions
 {
 public:
     typedef Kmer< Kmer_Size > Kmer_Type;
-    typedef State_Neighbours< Float_Type > State_Neighbours_Type;
+    typedef State_Transition_Table< Float_Type > State_Transition_Table_Type;
     typedef State_Transition_Parameters< Float_Type > State_Transition_Parameters_Type;
+    typedef State_Transition_Groups< Float_Type, Kmer_Size > State_Transition_Groups_Type;
     static const unsigned n_states = 1u << (2 * Kmer_Size);
 
-    State_Transitions() = default;
-    void clear() { _neighbours.clear(); }
+    State_Transitions() : _has_groups(false) {}
+    void clear()
+    {
+        _from.clear();
+        _to.clear();
+        _p_rest_from.clear();
+        _p_rest_to.clear();
+        _has_groups = false;
+    }
+
+    // row j of from_table() holds the transitions into j, row i of to_table() those out of i
+    const State_Transition_Table_Type& from_table() const { return _from; }
+    const State_Transition_Table_Type& to_table() const { return _to; }
+    // log probability of the transitions into, resp. out of, i that are not in the tables
+    Float_Type p_rest_from(unsigned i) const { return _p_rest_from.at(i); }
+    Float_Type p_rest_to(unsigned i) const { return _p_rest_to.at(i); }
 
-    const State_Neighbours_Type& neighbours(unsigned i) const { return _neighbours.at(i); }
-    State_Neighbours_Type& neighbours(unsigned i) { return _neighbours.at(i); }
+    // explicit tables, not available after compute_transitions_implicit
+    bool has_tables() const { return _to.n_rows() > 0; }
+    // factored form, available if the table was computed by compute_transitions_fast or compute_transitions_implicit
+    bool has_groups() const { return _has_groups; }
+    const State_Transition_Groups_Type& groups() const { assert(_has_groups); return _groups; }
 
-    // update fields from_v, p_rest_from, p_rest_to based on to_v
+    // update the from table, p_rest_from, p_rest_to based on the to table
     void update_fields()
     {
-        for (unsigned i = 0; i < n_states; ++i)
+        // transpose the to table, skipping padding
+        std::vector< unsigned > from_size(n_states + 1, 0);
+        for (unsigned k = 0; k < _to.state.size(); ++k)
+        {
+            if (_to.is_padding(k)) continue;
+            ++from_size[_to.state[k] + 1];
+        }
+        _from.clear();
+        _from.offset.resize(n_states + 1);
+        _from.offset[0] = 0;
+        for (unsigned j = 0; j < n_states; ++j)
         {
-            neighbours(i).from_v.clear();
+            _from.offset[j + 1] = _from.offset[j] + from_size[j + 1];
         }
+        _from.state.resize(_from.offset[n_states]);
+        _from.log_p.resize(_from.offset[n_states]);
+        std::vector< unsigned > pos(_from.offset.begin(), _from.offset.end() - 1);
+        _p_rest_to.resize(n_states);
         for (unsigned i = 0; i < n_states; ++i)
         {
-            logsum::logsumset< Float_Type > s(false);
-            for (const auto& p : neighbours(i).to_v)
+            double s = 0.0;
+            for (unsigned k = _to.begin(i); k < _to.end(i); ++k)
             {
-                neighbours(p.first).from_v.push_back(std::make_pair(i, p.second));
-                s.add(p.second);
+                if (_to.is_padding(k)) continue;
+                unsigned l = pos[_to.state[k]]++;
+                _from.state[l] = i;
+                _from.log_p[l] = _to.log_p[k];
+                s += std::exp(_to.log_p[k]);
             }
-            neighbours(i).p_rest_to = std::log(1 - std::exp(s.val()));
+            _p_rest_to[i] = std::log(1 - s);
         }
-        for (unsigned i = 0; i < n_states; ++i)
+        _p_rest_from.resize(n_states);
+        for (unsigned j = 0; j < n_states; ++j)
         {
-            logsum::logsumset< Float_Type > s(false);
-            for (const auto& p : neighbours(i).from_v)
+            double s = 0.0;
+            for (unsigned k = _from.begin(j); k < _from.end(j); ++k)
             {
-                s.add(p.second);
+                s += std::exp(_from.log_p[k]);
             }
-            neighbours(i).p_rest_from = std::log(1 - std::exp(s.val()));
+            _p_rest_from[j] = std::log(1 - s);
+        }
+        if (_to.degree > 0)
+        {
+            _from.pad();
         }
     }
 
@@ -107,18 +384,21 @@ public:
     void drop_transitions(Float_Type p_cutoff)
     {
         Float_Type log_p_cutoff = std::log(p_cutoff);
+        State_Transition_Table_Type to;
+        to.start();
         for (unsigned i = 0; i < n_states; ++i)
         {
-            decltype(neighbours(i).to_v) to_v;
-            for (const auto& p : neighbours(i).to_v)
+            for (unsigned k = _to.begin(i); k < _to.end(i); ++k)
             {
-                if (p.second > log_p_cutoff)
+                if (_to.log_p[k] > log_p_cutoff)
                 {
-                    to_v.push_back(p);
+                    to.push_back(_to.state[k], _to.log_p[k]);
                 }
             }
-            neighbours(i).to_v = std::move(to_v);
+            to.end_row();
         }
+        std::swap(_to, to);
+        _has_groups = false;
         update_fields();
     }
 
@@ -143,15 +423,30 @@ public:
         return p;
     }
 
+    // terms of get_trans_prob() by level, as used by State_Transition_Groups::compute()
+    static std::vector< double > get_level_probs(Float_Type p_stay, Float_Type p_skip)
+    {
+        double p_step = 1.0 - p_stay - p_skip;
+        double p_skip_1 = p_skip / (p_skip + 1.0);
+        std::vector< double > res(Kmer_Size + 1);
+        res[0] = p_stay;
+        res[1] = p_step / 4;
+        for (unsigned l = 2; l < Kmer_Size; ++l)
+        {
+            res[l] = std::pow(p_skip_1, l - 1) / (1u << (2 * l));
+        }
+        res[Kmer_Size] = (std::pow(p_skip_1, 5) / (1.0 - p_skip_1)) / n_states;
+        return res;
+    }
+
     // recompute transition table
     void compute_transitions(Float_Type p_skip_default, Float_Type p_stay, Float_Type p_cutoff,
                              const std::map< unsigned, Float_Type >& p_skip_map = {})
     {
-        _neighbours.clear();
-        _neighbours.reserve(n_states);
+        clear();
+        _to.start();
         for (unsigned i = 0; i < n_states; ++i)
         {
-            _neighbours.emplace_back();
             Float_Type p_skip = p_skip_default;
             if (p_skip_map.count(i))
             {
@@ -170,28 +465,22 @@ public:
                 Float_Type p = get_trans_prob(i, j, p_stay, p_step, p_skip_1);
                 if (p > p_cutoff)
                 {
-                    neighbours(i).to_v.push_back(std::make_pair(j, std::log(p)));
+                    _to.push_back(j, std::log(p));
                 }
             }
+            _to.end_row();
         }
         update_fields();
     }
 
-    // compute transition table allowing a maximum of 1 skip
+    // compute transition table allowing a maximum of 1 skip; rows are padded to a fixed degree
     void compute_transitions_fast(Float_Type p_skip_default, Float_Type p_stay,
                                   const std::map< unsigned, Float_Type >& p_skip_map = {})
     {
-        struct Default_Float_Type
-        {
-            Default_Float_Type(Float_Type _val = 0.0) : val(_val) {}
-            Float_Type val;
-        }; // struct Default_Float
-
-        _neighbours.clear();
-        _neighbours.reserve(n_states);
+        clear();
+        _to.start();
         for (unsigned i = 0; i < n_states; ++i)
         {
-            _neighbours.emplace_back();
             Float_Type p_skip = p_skip_default;
             if (p_skip_map.count(i))
             {
@@ -213,31 +502,177 @@ public:
             for (const auto& j : to_s)
             {
                 Float_Type p = get_trans_prob(i, j, p_stay, p_step, p_skip_1);
-                neighbours(i).to_v.push_back(std::make_pair(j, std::log(p)));
+                _to.push_back(j, std::log(p));
             }
+            _to.end_row();
         }
+        _to.pad();
         update_fields();
+        // the factored form needs uniform parameters
+        if (p_skip_map.empty())
+        {
+            _groups.compute(2, get_level_probs(p_stay, p_skip_default));
+            _has_groups = true;
+        }
     }
     void compute_transitions_fast(const State_Transition_Parameters_Type& stp)
     {
         compute_transitions_fast(stp.p_skip, stp.p_stay);
     }
 
+    /**
+     * Compute only the factored form of the transitions, allowing skips of up to n_levels-1 bases;
+     * with n_levels == Kmer_Size, this is the full model of compute_transitions() without a cutoff.
+     * No tables are built, which takes O(k^3) per nesting pattern instead of O(n_states * degree).
+     */
+    void compute_transitions_implicit(Float_Type p_skip, Float_Type p_stay, unsigned n_levels)
+    {
+        clear();
+        _groups.compute(n_levels, get_level_probs(p_stay, p_skip));
+        _has_groups = true;
+    }
+    void compute_transitions_implicit(const State_Transition_Parameters_Type& stp, unsigned n_levels)
+    {
+        compute_transitions_implicit(stp.p_skip, stp.p_stay, n_levels);
+    }
+
+    /**
+     * Maximum number of bases skipped by one transition in compute_transitions_max_skip() and get_fast(),
+     * from 1 to Kmer_Size - 1; Kmer_Size - 1 allows any skip.
+     */
+    static unsigned& max_skip() { static unsigned _max_skip = 1; return _max_skip; }
+    /**
+     * Whether compute_transitions_max_skip() and get_fast() also build the explicit tables,
+     * as needed by beam search; only available with max_skip() == 1.
+     */
+    static bool& build_tables()
+    {
+#ifndef DUMP_TRAINING_DATA
+        static bool _build_tables = false;
+#else
+        static bool _build_tables = true;
+#endif
+        return _build_tables;
+    }
+
+    // compute_transitions_implicit() allowing skips of up to max_skip() bases;
+    // with build_tables() and max_skip() == 1, compute_transitions_fast(), which has the same factored form
+    void compute_transitions_max_skip(Float_Type p_skip, Float_Type p_stay)
+    {
+        assert(1 <= max_skip() and max_skip() < Kmer_Size);
+        if (build_tables() and max_skip() == 1)
+        {
+            compute_transitions_fast(p_skip, p_stay);
+        }
+        else
+        {
+            compute_transitions_implicit(p_skip, p_stay, max_skip() + 1);
+        }
+    }
+    void compute_transitions_max_skip(const State_Transition_Parameters_Type& stp)
+    {
+        compute_transitions_max_skip(stp.p_skip, stp.p_stay);
+    }
+
+    /**
+     * Maximum number of tables kept by get_fast(); 0: no caching.
+     */
+    static size_t& cache_size() { static size_t _cache_size = 32; return _cache_size; }
+    /**
+     * Resolution of the parameters used as cache keys by get_fast().
+     */
+    static Float_Type& cache_resolution() { static Float_Type _cache_resolution = 1.0e-3; return _cache_resolution; }
+
+    /**
+     * Parameters of the table returned by get_fast(stp): those of stp, rounded to multiples
+     * of cache_resolution() if caching is enabled.
+     */
+    static State_Transition_Parameters_Type fast_params(const State_Transition_Parameters_Type& stp)
+    {
+        State_Transition_Parameters_Type res(stp);
+        if (cache_size() > 0)
+        {
+            res.p_stay = std::lround(stp.p_stay / cache_resolution()) * cache_resolution();
+            res.p_skip = std::lround(stp.p_skip / cache_resolution()) * cache_resolution();
+        }
+        return res;
+    }
+
+    /**
+     * Shared table computed by compute_transitions_max_skip() with fast_params(stp). The cache_size() most recently used tables
+     * are kept for reuse. Thread-safe.
+     */
+    static std::shared_ptr< const State_Transitions > get_fast(const State_Transition_Parameters_Type& stp)
+    {
+        if (cache_size() == 0)
+        {
+            std::shared_ptr< State_Transitions > res(new State_Transitions());
+            res->compute_transitions_max_skip(stp);
+            return res;
+        }
+        Transitions_Cache& c = transitions_cache();
+        long p_stay_q = std::lround(stp.p_stay / cache_resolution());
+        long p_skip_q = std::lround(stp.p_skip / cache_resolution());
+        Transitions_Cache_Key key(p_stay_q, p_skip_q, max_skip());
+        {
+            std::lock_guard< std::mutex > lock(c.mutex);
+            auto it = c.table_m.find(key);
+            if (it != c.table_m.end())
+            {
+                // move key to the front of the LRU list
+                c.lru_l.splice(c.lru_l.begin(), c.lru_l, it->second.second);
+                ++c.n_hits;
+                return it->second.first;
+            }
+            ++c.n_misses;
+        }
+        // compute outside the lock; if several threads miss on the same key, the first one wins
+        std::shared_ptr< State_Transitions > res(new State_Transitions());
+        res->compute_transitions_max_skip(fast_params(stp));
+        std::lock_guard< std::mutex > lock(c.mutex);
+        auto it = c.table_m.find(key);
+        if (it != c.table_m.end())
+        {
+            return it->second.first;
+        }
+        c.lru_l.push_front(key);
+        c.table_m[key] = std::make_pair(res, c.lru_l.begin());
+        while (c.table_m.size() > cache_size())
+        {
+            c.table_m.erase(c.lru_l.back());
+            c.lru_l.pop_back();
+        }
+        LOG(debug) << "transitions_cache p_stay=" << p_stay_q * cache_resolution()
+                   << " p_skip=" << p_skip_q * cache_resolution()
+                   << " max_skip=" << max_skip()
+                   << " hits=" << c.n_hits << " misses=" << c.n_misses << std::endl;
+        return res;
+    }
+    // number of (hits, misses) of get_fast()
+    static std::pair< size_t, size_t > cache_stats()
+    {
+        Transitions_Cache& c = transitions_cache();
+        std::lock_guard< std::mutex > lock(c.mutex);
+        return std::make_pair(c.n_hits, c.n_misses);
+    }
+
     friend std::ostream& operator << (std::ostream& os, const State_Transitions& st)
     {
+        const State_Transition_Table_Type& to = st.to_table();
         for (unsigned i = 0; i < n_states; ++i)
         {
-            for (const auto& p : st.neighbours(i).to_v)
+            for (unsigned k = to.begin(i); k < to.end(i); ++k)
             {
-                os << Kmer_Type::to_string(i) << '\t' << Kmer_Type::to_string(p.first) << '\t' << p.second << std::endl;
+                if (to.is_padding(k)) continue;
+                os << Kmer_Type::to_string(i) << '\t' << Kmer_Type::to_string(to.state[k]) << '\t' << to.log_p[k] << std::endl;
             }
         }
         return os;
     }
     friend std::istream& operator >> (std::istream& is, State_Transitions& st)
     {
-        st._neighbours.clear();
-        st._neighbours.resize(n_states);
+        st.clear();
+        std::vector< std::vector< std::pair< unsigned, Float_Type > > > to_v(n_states);
         std::string k_i;
         std::string k_j;
         Float_Type p;
@@ -245,14 +680,47 @@ public:
         {
             unsigned i = Kmer_Type::to_int(k_i);
             unsigned j = Kmer_Type::to_int(k_j);
-            st.neighbours(i).to_v.push_back(std::make_pair(j, p));
+            to_v[i].push_back(std::make_pair(j, p));
+        }
+        st._to.start();
+        for (unsigned i = 0; i < n_states; ++i)
+        {
+            for (const auto& q : to_v[i])
+            {
+                st._to.push_back(q.first, q.second);
+            }
+            st._to.end_row();
         }
         st.update_fields();
         return is;
     }
 
 private:
-    std::vector< State_Neighbours_Type > _neighbours;
+    // key: quantized (p_stay, p_skip), max_skip()
+    typedef std::tuple< long, long, unsigned > Transitions_Cache_Key;
+    struct Transitions_Cache
+    {
+        std::mutex mutex;
+        // most recently used key first
+        std::list< Transitions_Cache_Key > lru_l;
+        std::map< Transitions_Cache_Key,
+                  std::pair< std::shared_ptr< const State_Transitions >,
+                             typename std::list< Transitions_Cache_Key >::iterator > > table_m;
+        size_t n_hits = 0;
+        size_t n_misses = 0;
+    }; // struct Transitions_Cache
+    static Transitions_Cache& transitions_cache()
+    {
+        static Transitions_Cache _transitions_cache;
+        return _transitions_cache;
+    }
+
+    State_Transition_Table_Type _from;
+    State_Transition_Table_Type _to;
+    std::vector< Float_Type > _p_rest_from;
+    std::vector< Float_Type > _p_rest_to;
+    State_Transition_Groups_Type _groups;
+    bool _has_groups;
 }; // class State_Transitions
 
 #endif
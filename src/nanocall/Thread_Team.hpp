@@ -0,0 +1,185 @@
+#ifndef __THREAD_TEAM_HPP
+#define __THREAD_TEAM_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * A persistent team of threads used to split the work on a single read.
+ * The calling thread is member 0; the other members are helper threads which spin briefly
+ * between jobs, then sleep. Within a job, members synchronize with a spinning barrier.
+ */
+class Thread_Team
+{
+public:
+    explicit Thread_Team(unsigned n_threads)
+        : _size(std::max(n_threads, 1u)),
+          _job_fn(nullptr), _job_ctx(nullptr),
+          _epoch(0), _n_done(0), _n_sleeping(0), _stop(false),
+          _bar_count(0), _bar_gen(0)
+    {
+        for (unsigned tid = 1; tid < _size; ++tid)
+        {
+            _helpers.emplace_back(&Thread_Team::helper_loop, this, tid);
+        }
+    }
+    Thread_Team(const Thread_Team&) = delete;
+    Thread_Team& operator = (const Thread_Team&) = delete;
+    ~Thread_Team()
+    {
+        {
+            std::lock_guard< std::mutex > lock(_mutex);
+            _stop = true;
+            ++_epoch;
+        }
+        _cv.notify_all();
+        for (auto& t : _helpers)
+        {
+            t.join();
+        }
+    }
+
+    unsigned size() const { return _size; }
+
+    /**
+     * Run fn(tid) on every member, tid in [0, size()); return when all members are done.
+     */
+    template < typename Fn >
+    void run(Fn&& fn)
+    {
+        if (_size == 1)
+        {
+            fn(0u);
+            return;
+        }
+        typedef typename std::remove_reference< Fn >::type Fn_Type;
+        _job_fn = [] (void* ctx, unsigned tid) { (*static_cast< Fn_Type* >(ctx))(tid); };
+        _job_ctx = static_cast< void* >(&fn);
+        _n_done = 0;
+        ++_epoch;
+        if (_n_sleeping > 0)
+        {
+            std::lock_guard< std::mutex > lock(_mutex);
+            _cv.notify_all();
+        }
+        fn(0u);
+        while (_n_done.load(std::memory_order_acquire) != _size - 1)
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    /**
+     * Barrier for all members, callable from within a job.
+     */
+    void barrier()
+    {
+        if (_size == 1) return;
+        unsigned gen = _bar_gen.load(std::memory_order_acquire);
+        if (_bar_count.fetch_add(1, std::memory_order_acq_rel) == _size - 1)
+        {
+            _bar_count.store(0, std::memory_order_relaxed);
+            _bar_gen.fetch_add(1, std::memory_order_release);
+        }
+        else
+        {
+            for (unsigned k = 0; _bar_gen.load(std::memory_order_acquire) == gen; ++k)
+            {
+                if (k >= spin_count) std::this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     * Split [0, n) into size() contiguous chunks; return the chunk of member tid.
+     */
+    std::pair< unsigned, unsigned > chunk(unsigned tid, unsigned n) const
+    {
+        return std::make_pair((n * tid) / _size, (n * (tid + 1)) / _size);
+    }
+    /**
+     * Split the rows of a CSR table with the given offsets into size() contiguous chunks
+     * of about equal work, counting one unit per row and one per entry; return the chunk
+     * of member tid.
+     */
+    std::pair< unsigned, unsigned > chunk(unsigned tid, const std::vector< unsigned >& offset) const
+    {
+        return std::make_pair(chunk_bound(tid, offset), chunk_bound(tid + 1, offset));
+    }
+
+    /**
+     * Team of the calling thread, with n_threads members; reused across calls.
+     */
+    static Thread_Team& thread_team(unsigned n_threads)
+    {
+        static thread_local std::unique_ptr< Thread_Team > _team_ptr;
+        if (not _team_ptr or _team_ptr->size() != std::max(n_threads, 1u))
+        {
+            _team_ptr.reset();
+            _team_ptr.reset(new Thread_Team(n_threads));
+        }
+        return *_team_ptr;
+    }
+
+private:
+    static const unsigned spin_count = 1u << 14;
+
+    // first row of chunk tid: the first row i with work(0..i) >= tid/size() of the total
+    unsigned chunk_bound(unsigned tid, const std::vector< unsigned >& offset) const
+    {
+        unsigned n = offset.size() - 1;
+        if (tid >= _size) return n;
+        auto work = [&] (unsigned i) { return size_t(offset[i]) + i; };
+        size_t target = (work(n) * tid + _size - 1) / _size;
+        unsigned lo = 0;
+        unsigned hi = n;
+        while (lo < hi)
+        {
+            unsigned mid = lo + (hi - lo) / 2;
+            if (work(mid) < target) lo = mid + 1; else hi = mid;
+        }
+        return lo;
+    }
+
+    void helper_loop(unsigned tid)
+    {
+        unsigned seen = 0;
+        while (true)
+        {
+            for (unsigned k = 0; _epoch.load() == seen; ++k)
+            {
+                if (k < spin_count) continue;
+                std::unique_lock< std::mutex > lock(_mutex);
+                ++_n_sleeping;
+                _cv.wait(lock, [&] () { return _epoch.load() != seen; });
+                --_n_sleeping;
+            }
+            seen = _epoch.load();
+            if (_stop) return;
+            _job_fn(_job_ctx, tid);
+            _n_done.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    const unsigned _size;
+    std::vector< std::thread > _helpers;
+    void (*_job_fn)(void*, unsigned);
+    void* _job_ctx;
+    std::atomic< unsigned > _epoch;
+    std::atomic< unsigned > _n_done;
+    std::atomic< unsigned > _n_sleeping;
+    bool _stop;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::atomic< unsigned > _bar_count;
+    std::atomic< unsigned > _bar_gen;
+}; // class Thread_Team
+
+#endif
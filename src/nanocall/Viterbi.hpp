@@ -1,13 +1,19 @@
 #ifndef __VITERBI_HPP
 #define __VITERBI_HPP
 
+#include <algorithm>
+#include <array>
+#include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <vector>
 #include <set>
 
 #include "Pore_Model.hpp"
+#include "Emission_Matrix.hpp"
 #include "State_Transitions.hpp"
+#include "Thread_Team.hpp"
 #include "logsumset.hpp"
 #include "logger.hpp"
 
@@ -17,131 +23,655 @@ class Viterbi
 public:
     typedef Kmer< Kmer_Size > Kmer_Type;
     typedef Pore_Model< Float_Type, Kmer_Size > Pore_Model_Type;
+    typedef Pore_Model_Emissions< Float_Type, Kmer_Size > Pore_Model_Emissions_Type;
     typedef State_Transitions< Float_Type, Kmer_Size > State_Transitions_Type;
+    typedef typename State_Transitions_Type::State_Transition_Groups_Type State_Transition_Groups_Type;
+    typedef typename State_Transitions_Type::State_Transition_Table_Type State_Transition_Table_Type;
     typedef Event< Float_Type > Event_Type;
-    typedef Event_Sequence< Float_Type > Event_Sequence_Type;
+    typedef Event_Sequence_View< Float_Type > Event_Sequence_View_Type;
     typedef logsum::logsumset< Float_Type > LogSumSet_Type;
 
-    struct Matrix_Entry
-    {
-        Float_Type alpha; // := Pr[ MLSS producing e_1 ... e_i, with S_i == j ]
-        unsigned beta;    // := previous state in the MLSS
-    }; // struct Matrix_Entry
+    /**
+     * Traceback code of one cell: the previous state in the MLSS, relative to the current one.
+     * Bits 0-2 hold the skip distance d, bits 3-6 hold the d leading bases of the previous state,
+     * which is then (lead << 2(k-d)) | prefix(crt, k-d). Distances over 2 are escaped: the previous
+     * state is kept in sparse per-event, per-thread lists. With factored transitions of more than
+     * max_local_level levels, the best predecessor from the upper levels only depends on the
+     * level-(max_local_level+1) key of the current state; these predecessors are kept, by key,
+     * at the front of the list of the first thread, and referenced by upper_code.
+     */
+    typedef std::uint8_t Traceback_Code;
+    static const unsigned max_code_skip = 2;
+    static const Traceback_Code upper_code = 6;
+    static const Traceback_Code escape_code = 7;
+    static_assert(Kmer_Size < 7, "skip distance does not fit in a traceback code");
 
     static const unsigned n_states = Pore_Model_Type::n_states;
 
-    void clear() { _m.clear(); _state_seq.clear(); _base_seq.clear(); }
+    void clear()
+    {
+        _tb.clear();
+        _tb_escape.clear();
+        _alpha_cp.clear();
+        _beam_tb.clear();
+        _beam_tb_offset.clear();
+        _tb_begin = 0;
+        _tb_end = 0;
+        _team_size = 1;
+        _state_seq.clear();
+        _base_seq.clear();
+    }
     unsigned n_events() const { return _state_seq.size(); }
     const std::vector< unsigned >& state_seq() const { return _state_seq; }
     const std::string& base_seq() const { return _base_seq; }
     Float_Type path_probability() const { return _path_probability; }
 
-    // i: event index
-    // j: state/kmer index
-    const Matrix_Entry& cell(unsigned i, unsigned j) const { return _m[i * n_states + j]; }
-    Matrix_Entry& cell(unsigned i, unsigned j) { return _m[i * n_states + j]; }
+    // previous state in the MLSS ending at event i in state j;
+    // only available for the events in [tb_begin(), tb_end());
+    // in beam mode, n_states if j was pruned at event i
+    unsigned prev_state(unsigned i, unsigned j) const
+    {
+        assert(tb_begin() <= i and i < tb_end());
+        if (not _beam_tb_offset.empty())
+        {
+            auto first = _beam_tb.begin() + _beam_tb_offset[i];
+            auto last = _beam_tb.begin() + _beam_tb_offset[i + 1];
+            auto it = std::lower_bound(first, last, std::make_pair(j, 0u));
+            if (it == last or it->first != j) return n_states;
+            return it->second;
+        }
+        return decode(_tb[(i - _tb_begin) * n_states + j], j, &_tb_escape[(i - _tb_begin) * _team_size], _team_size);
+    }
+    // previous state of j from its traceback code, and the per-thread escape lists of its event
+    static unsigned decode(Traceback_Code c, unsigned j,
+                           const std::vector< std::pair< unsigned, unsigned > >* tb_escape_rows, unsigned team_size)
+    {
+        unsigned d = c & 0x7;
+        if (d == 0)
+        {
+            return j;
+        }
+        else if (d <= max_code_skip)
+        {
+            return ((c >> 3) << (2 * (Kmer_Size - d))) | (j >> (2 * d));
+        }
+        else if (c == upper_code)
+        {
+            const auto& p = tb_escape_rows[0][State_Transition_Groups_Type::from_key(j, max_local_level + 1)];
+            assert(p.first == n_states + State_Transition_Groups_Type::from_key(j, max_local_level + 1));
+            return p.second;
+        }
+        else
+        {
+            for (unsigned tid = 0; tid < team_size; ++tid)
+            {
+                for (const auto& p : tb_escape_rows[tid])
+                {
+                    if (p.first == j) return p.second;
+                }
+            }
+            assert(false);
+            return n_states;
+        }
+    }
+    unsigned tb_begin() const { return _tb_begin; }
+    unsigned tb_end() const { return _tb_end; }
 
     static unsigned& n_threads() { static unsigned _n_threads = 1; return _n_threads; }
+    /**
+     * Per-thread memory budget for the traceback, in bytes; 0: unlimited.
+     * If the traceback of a full event sequence exceeds it, only every
+     * sqrt(n)-th alpha row is kept, and segments are recomputed during traceback.
+     */
+    static size_t& max_mem() { static size_t _max_mem = 0; return _max_mem; }
+    /**
+     * Beam pruning: after each event, only the states within beam_width() of the best
+     * log score, and at most beam_size() of them, are extended; 0: no limit.
+     * In beam mode, the traceback is kept sparse for all events; max_mem() and n_threads()
+     * are not used. Beam mode needs explicit transition tables; with implicit transitions,
+     * full rows are computed instead.
+     */
+    static Float_Type& beam_width() { static Float_Type _beam_width = 0; return _beam_width; }
+    static unsigned& beam_size() { static unsigned _beam_size = 0; return _beam_size; }
+    static bool beam_enabled() { return beam_width() > 0 or beam_size() > 0; }
 
     void fill(const Pore_Model_Type& pm,
               const State_Transitions_Type& st,
-              const Event_Sequence_Type& ev)
+              const Event_Sequence_View_Type& ev)
+    {
+        fill(Pore_Model_Emissions_Type(pm, ev), st);
+    }
+    /**
+     * Same, with emissions from a source such as an Emission_Matrix.
+     */
+    template < typename Emissions >
+    void fill(const Emissions& em,
+              const State_Transitions_Type& st)
     {
         clear();
-        unsigned n_events = ev.size();
-        _m.resize(n_states * n_events);
+        if (beam_enabled() and st.has_tables())
+        {
+            fill_beam(em, st);
+            return;
+        }
+        unsigned n_events = em.n_events();
         _state_seq.resize(n_events);
+        Thread_Team& team = Thread_Team::thread_team(n_threads());
+        _team_size = team.size();
+        init_scratch(st);
+        // traceback rows (c, c + seg_len] are recomputed from the alpha row c, for c a multiple of seg_len;
+        // rows of the last segment are kept from the first pass
+        unsigned seg_len = segment_length(n_events);
+        unsigned last_cp = ((n_events - 1) / seg_len) * seg_len;
+        _tb.resize(std::min(seg_len, n_events - 1) * n_states);
+        _tb_escape.resize(std::min(seg_len, n_events - 1) * _team_size);
+        _alpha_cp.resize((last_cp / seg_len) * n_states);
+        LOG("Viterbi", debug)
+            << "n_events=" << n_events << " seg_len=" << seg_len
+            << " n_checkpoints=" << last_cp / seg_len << std::endl;
         Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
         //
-        // alpha, beta; i == 0
+        // alpha; i == 0
         //
         {
             LOG("Viterbi", debug1) << "forward: i=0" << std::endl;
+            em.row(0, &_alpha[0][0]);
             for (unsigned j = 0; j < n_states; ++j)
             {
-                // alpha
-                cell(0, j).alpha = pm.log_pr_emission(j, ev[0]) - log_n_states;
-                // beta
-                cell(0, j).beta = n_states;
+                _alpha[0][j] -= log_n_states;
                 LOG("Viterbi", debug2)
                     << "i=0 j=" << Kmer_Type::to_string(j)
-                    << " alpha=" << cell(0, j).alpha
-                    << " beta=" << cell(0, j).beta << std::endl;
+                    << " alpha=" << _alpha[0][j] << std::endl;
             }
         }
         //
-        // alpha, beta; i > 0
+        // alpha, traceback; i > 0
         //
+        _tb_begin = last_cp + 1;
+        _tb_end = n_events;
         for (unsigned i = 1; i < n_events; ++i)
         {
-            LOG("Viterbi", debug1) << "forward: i=" << i << std::endl;
-            for (unsigned j = 0; j < n_states; ++j) // TODO: parallelize
+            if ((i - 1) < last_cp and (i - 1) % seg_len == 0)
             {
-                cell(i, j).alpha = -INFINITY;
-                cell(i, j).beta = n_states;
-                for (const auto& p : st.neighbours(j).from_v)
-                {
-                    const unsigned& j_prev = p.first;
-                    const Float_Type& log_pr_transition = p.second;
-                    Float_Type v = log_pr_transition + cell(i - 1, j_prev).alpha;
-                    if (v > cell(i, j).alpha)
-                    {
-                        cell(i, j).alpha = v;
-                        cell(i, j).beta = j_prev;
-                    }
-                }
-                cell(i, j).alpha += pm.log_pr_emission(j, ev[i]);
-                LOG("Viterbi", debug2)
-                    << "i=" << i << " j=" << Kmer_Type::to_string(j)
-                    << " alpha=" << cell(i, j).alpha
-                    << " beta=" << cell(i, j).beta << std::endl;
+                std::copy(_alpha[(i - 1) % 2].begin(), _alpha[(i - 1) % 2].end(),
+                          _alpha_cp.begin() + ((i - 1) / seg_len) * n_states);
+            }
+            if (i >= _tb_begin)
+            {
+                fill_row(team, em, st, i, _alpha[(i - 1) % 2], _alpha[i % 2],
+                         &_tb[(i - _tb_begin) * n_states], &_tb_escape[(i - _tb_begin) * _team_size]);
+            }
+            else
+            {
+                fill_row(team, em, st, i, _alpha[(i - 1) % 2], _alpha[i % 2],
+                         _tb_scratch.data(), _tb_escape_scratch.data());
             }
         }
-        fill_state_seq();
+        fill_state_seq(team, em, st, seg_len);
         fill_base_seq();
     }
 
     friend std::ostream& operator << (std::ostream& os, const Viterbi& vit)
     {
-        for (unsigned i = 0; i < vit.n_events(); ++i)
+        for (unsigned i = std::max(vit.tb_begin(), 1u); i < vit.tb_end(); ++i)
         {
             for (unsigned j = 0; j < vit.n_states; ++j)
             {
                 os << i << '\t' << j << '\t'
-                   << vit.cell(i, j).alpha << '\t'
-                   << vit.cell(i, j).beta << std::endl;
+                   << vit.prev_state(i, j) << std::endl;
             }
         }
         return os;
     }
 
 private:
-    std::vector< Matrix_Entry > _m;
+    // the online decoder drives the row kernels directly
+    template < typename, unsigned > friend class Online_Viterbi;
+
+    // alpha(i, j) := Pr[ MLSS producing e_1 ... e_i, with S_i == j ]; rows i-1 and i only
+    std::array< std::vector< Float_Type >, 2 > _alpha;
+    // alpha checkpoint rows
+    std::vector< Float_Type > _alpha_cp;
+    // traceback of events [_tb_begin, _tb_end)
+    std::vector< Traceback_Code > _tb;
+    std::vector< std::vector< std::pair< unsigned, unsigned > > > _tb_escape;
+    unsigned _tb_begin;
+    unsigned _tb_end;
+    unsigned _team_size;
     std::vector< unsigned > _state_seq;
     std::string _base_seq;
     Float_Type _path_probability;
+    // scratch space
+    std::vector< Traceback_Code > _tb_scratch;
+    std::vector< Float_Type > _em;
+    std::vector< std::vector< std::pair< unsigned, unsigned > > > _tb_escape_scratch;
+    std::vector< std::vector< Float_Type > > _g_max;
+    std::vector< std::vector< unsigned > > _g_arg;
+    // best term of the levels above max_local_level, by key of the lowest of them: score, state
+    std::vector< Float_Type > _u_max;
+    std::vector< unsigned > _u_arg;
+    // beam mode: traceback pairs (j, j_prev) of event i, sorted by j, are in
+    // [_beam_tb_offset[i], _beam_tb_offset[i + 1])
+    std::vector< std::pair< unsigned, unsigned > > _beam_tb;
+    std::vector< unsigned > _beam_tb_offset;
+    std::vector< unsigned > _beam_states;
+    std::vector< unsigned > _beam_next;
+    std::vector< unsigned > _beam_touched;
+    std::vector< unsigned > _beam_arg;
+
+    // number of events per checkpoint segment
+    static unsigned segment_length(unsigned n_events)
+    {
+        if (n_events < 2
+            or max_mem() == 0
+            or size_t(n_events) * n_states * sizeof(Traceback_Code) <= max_mem())
+        {
+            return std::max(n_events, 1u);
+        }
+        // checkpoints take n/s rows of alpha, a segment takes s rows of traceback
+        unsigned seg_len = std::ceil(std::sqrt(double(n_events) * sizeof(Float_Type) / sizeof(Traceback_Code)));
+        if ((size_t(n_events) / seg_len * sizeof(Float_Type) + seg_len * sizeof(Traceback_Code)) * n_states > max_mem())
+        {
+            LOG("Viterbi", warning)
+                << "n_events=" << n_events << ": traceback exceeds memory budget ["
+                << max_mem() << "]" << std::endl;
+        }
+        return std::min(seg_len, n_events);
+    }
 
-    void fill_state_seq()
+    void init_scratch(const State_Transitions_Type& st)
     {
+        for (unsigned k = 0; k < 2; ++k)
+        {
+            _alpha[k].resize(n_states);
+        }
+        _tb_scratch.resize(n_states);
+        _em.resize(n_states);
+        _tb_escape_scratch.resize(_team_size);
+        if (st.has_groups())
+        {
+            const State_Transition_Groups_Type& grp = st.groups();
+            _g_max.resize(grp.n_levels() + 1);
+            _g_arg.resize(grp.n_levels() + 1);
+            for (unsigned l = 1; l <= grp.n_levels(); ++l)
+            {
+                _g_max[l].resize(grp.n_keys(l));
+                _g_arg[l].resize(grp.n_keys(l));
+            }
+            _u_max.resize(grp.n_keys(max_local_level + 1));
+            _u_arg.resize(grp.n_keys(max_local_level + 1));
+        }
+    }
+
+    // traceback code for previous state j_prev, at skip distance d
+    static Traceback_Code encode(unsigned j, unsigned j_prev, unsigned d,
+                                 std::vector< std::pair< unsigned, unsigned > >& tb_escape_row)
+    {
+        if (d <= max_code_skip)
+        {
+            return d | ((j_prev >> (2 * (Kmer_Size - d))) << 3);
+        }
+        else
+        {
+            tb_escape_row.push_back(std::make_pair(j, j_prev));
+            return escape_code;
+        }
+    }
+
+    /**
+     * States are split between team members by their (k-2)-suffix: groups of levels 1 and 2 only
+     * contain states with the same suffix, so each member folds them from its own states;
+     * the groups of upper levels are few, and folded by a single member.
+     */
+    static const unsigned n_part_bits = 2 * (Kmer_Size - 2);
+    static const unsigned n_parts = 1u << n_part_bits;
+    // highest level whose groups only hold states of one part
+    static const unsigned max_local_level = Kmer_Size - n_part_bits / 2;
+
+    // apply fn to all i in [0, n) with (i mod n_parts) in part; n must be a multiple of n_parts
+    template < typename Fn >
+    static void for_each_in_part(unsigned n, std::pair< unsigned, unsigned > part, Fn&& fn)
+    {
+        for (unsigned h = 0; h < n; h += n_parts)
+        {
+            for (unsigned x = part.first; x < part.second; ++x)
+            {
+                fn(h | x);
+            }
+        }
+    }
+
+    // compute one alpha row, and its traceback
+    template < typename Emissions >
+    void fill_row(Thread_Team& team,
+                  const Emissions& em,
+                  const State_Transitions_Type& st,
+                  unsigned i,
+                  const std::vector< Float_Type >& alpha_prev,
+                  std::vector< Float_Type >& alpha_crt,
+                  Traceback_Code* tb_row,
+                  std::vector< std::pair< unsigned, unsigned > >* tb_escape_rows)
+    {
+        team.run([&] (unsigned tid) {
+            tb_escape_rows[tid].clear();
+            if (st.has_groups())
+            {
+                fill_row_factored(team, tid, em, st.groups(), i, alpha_prev, alpha_crt, tb_row, tb_escape_rows[tid]);
+            }
+            else
+            {
+                fill_row_generic(team, tid, em, st, i, alpha_prev, alpha_crt, tb_row, tb_escape_rows[tid]);
+            }
+        });
+    }
+
+    // max-product using explicit neighbour lists
+    template < typename Emissions >
+    void fill_row_generic(Thread_Team& team, unsigned tid,
+                          const Emissions& em,
+                          const State_Transitions_Type& st,
+                          unsigned i,
+                          const std::vector< Float_Type >& alpha_prev,
+                          std::vector< Float_Type >& alpha_crt,
+                          Traceback_Code* tb_row,
+                          std::vector< std::pair< unsigned, unsigned > >& tb_escape_row)
+    {
+        const State_Transition_Table_Type& from = st.from_table();
+        auto part = team.chunk(tid, from.offset);
+        em.row(i, &_em[0], part.first, part.second);
+        for (unsigned j = part.first; j < part.second; ++j)
+        {
+            alpha_crt[j] = -INFINITY;
+            unsigned j_best = j;
+            for (unsigned k = from.begin(j); k < from.end(j); ++k)
+            {
+                const unsigned& j_prev = from.state[k];
+                const Float_Type& log_pr_transition = from.log_p[k];
+                Float_Type v = log_pr_transition + alpha_prev[j_prev];
+                if (v > alpha_crt[j])
+                {
+                    alpha_crt[j] = v;
+                    j_best = j_prev;
+                }
+            }
+            tb_row[j] = encode(j, j_best, Kmer_Type::min_skip(j_best, j), tb_escape_row);
+            alpha_crt[j] += _em[j];
+            LOG("Viterbi", debug2)
+                << "j=" << Kmer_Type::to_string(j)
+                << " alpha=" << alpha_crt[j]
+                << " prev=" << j_best << std::endl;
+        }
+    }
+
+    // max and argmax of group key at level l, from the groups at level l-1
+    void fold_group(unsigned l, unsigned key, const std::vector< Float_Type >& alpha_prev)
+    {
+        _g_max[l][key] = -INFINITY;
+        _g_arg[l][key] = n_states;
+        for (unsigned b = 0; b < 4; ++b)
+        {
+            unsigned key_prev = (b << (2 * (Kmer_Size - l))) | key;
+            Float_Type v = l == 1? alpha_prev[key_prev] : _g_max[l - 1][key_prev];
+            if (v > _g_max[l][key])
+            {
+                _g_max[l][key] = v;
+                _g_arg[l][key] = l == 1? key_prev : _g_arg[l - 1][key_prev];
+            }
+        }
+    }
+
+    // best of the upper levels l0..n_levels, once per level-l0 key, where log_p_from only depends on that key;
+    // the best states are added to tb_escape_row as (n_states + key, state)
+    void fold_upper(const State_Transition_Groups_Type& grp, unsigned l0,
+                    std::vector< std::pair< unsigned, unsigned > >& tb_escape_row)
+    {
+        for (unsigned key = 0; key < grp.n_keys(l0); ++key)
+        {
+            unsigned j = key << (2 * l0);
+            _u_max[key] = -INFINITY;
+            _u_arg[key] = n_states;
+            for (unsigned l = l0; l <= grp.n_levels(); ++l)
+            {
+                unsigned key_l = grp.from_key(j, l);
+                Float_Type v = grp.log_p_from(j, l) + _g_max[l][key_l];
+                if (v > _u_max[key])
+                {
+                    _u_max[key] = v;
+                    _u_arg[key] = _g_arg[l][key_l];
+                }
+            }
+            tb_escape_row.push_back(std::make_pair(n_states + key, _u_arg[key]));
+        }
+    }
+
+    // max-product using the factored transitions:
+    // the previous row is folded once per (level, key), then each state combines the terms of
+    // the local levels, and a single term for all upper levels
+    template < typename Emissions >
+    void fill_row_factored(Thread_Team& team, unsigned tid,
+                           const Emissions& em,
+                           const State_Transition_Groups_Type& grp,
+                           unsigned i,
+                           const std::vector< Float_Type >& alpha_prev,
+                           std::vector< Float_Type >& alpha_crt,
+                           Traceback_Code* tb_row,
+                           std::vector< std::pair< unsigned, unsigned > >& tb_escape_row)
+    {
+        unsigned n_levels = grp.n_levels();
+        unsigned n_local_levels = std::min(n_levels, unsigned(max_local_level));
+        auto part = team.chunk(tid, n_parts);
+        // level l: groups of level l-1 by (k-l)-suffix, where level 0 is the previous row
+        for (unsigned l = 1; l <= n_local_levels; ++l)
+        {
+            for_each_in_part(grp.n_keys(l), part, [&] (unsigned key) { fold_group(l, key, alpha_prev); });
+        }
+        if (n_levels > n_local_levels)
+        {
+            // upper levels are small, and fold groups of several members
+            team.barrier();
+            if (tid == 0)
+            {
+                for (unsigned l = n_local_levels + 1; l <= n_levels; ++l)
+                {
+                    for (unsigned key = 0; key < grp.n_keys(l); ++key)
+                    {
+                        fold_group(l, key, alpha_prev);
+                    }
+                }
+                fold_upper(grp, n_local_levels + 1, tb_escape_row);
+            }
+        }
+        for (unsigned h = 0; h < n_states; h += n_parts)
+        {
+            em.row(i, &_em[0], h + part.first, h + part.second);
+        }
+        team.barrier();
+        for_each_in_part(n_states, part, [&] (unsigned j) {
+            alpha_crt[j] = grp.log_p_from(j, 0) + alpha_prev[j];
+            unsigned j_best = j;
+            unsigned l_best = 0;
+            bool upper_best = false;
+            for (unsigned l = 1; l <= n_local_levels; ++l)
+            {
+                unsigned key = grp.from_key(j, l);
+                Float_Type v = grp.log_p_from(j, l) + _g_max[l][key];
+                if (v > alpha_crt[j])
+                {
+                    alpha_crt[j] = v;
+                    j_best = _g_arg[l][key];
+                    l_best = l;
+                }
+            }
+            if (n_levels > n_local_levels)
+            {
+                unsigned key = grp.from_key(j, n_local_levels + 1);
+                if (_u_max[key] > alpha_crt[j])
+                {
+                    alpha_crt[j] = _u_max[key];
+                    j_best = _u_arg[key];
+                    upper_best = true;
+                }
+            }
+            tb_row[j] = upper_best? upper_code : encode(j, j_best, l_best, tb_escape_row);
+            alpha_crt[j] += _em[j];
+            LOG("Viterbi", debug2)
+                << "j=" << Kmer_Type::to_string(j)
+                << " alpha=" << alpha_crt[j]
+                << " prev=" << j_best << std::endl;
+        });
+    }
+
+    template < typename Emissions >
+    void fill_state_seq(Thread_Team& team,
+                        const Emissions& em,
+                        const State_Transitions_Type& st,
+                        unsigned seg_len)
+    {
+        const std::vector< Float_Type >& alpha_last = _alpha[(n_events() - 1) % 2];
         Float_Type max_v = -INFINITY;
         unsigned max_j = n_states;
         for (unsigned j = 0; j < n_states; ++j)
         {
-            if (cell(n_events() - 1, j).alpha > max_v)
+            if (alpha_last[j] > max_v)
             {
                 max_j = j;
-                max_v = cell(n_events() - 1, j).alpha;
+                max_v = alpha_last[j];
             }
         }
         _path_probability = max_v;
         for (unsigned i = n_events() - 1; i > 0; --i)
         {
+            if (i < _tb_begin)
+            {
+                // recompute traceback of events (i - seg_len, i] from checkpoint i - seg_len
+                unsigned cp = i - seg_len;
+                LOG("Viterbi", debug1) << "recompute: i=" << cp + 1 << ".." << i << std::endl;
+                std::copy(_alpha_cp.begin() + (cp / seg_len) * n_states,
+                          _alpha_cp.begin() + (cp / seg_len + 1) * n_states,
+                          _alpha[cp % 2].begin());
+                _tb_begin = cp + 1;
+                _tb_end = i + 1;
+                for (unsigned i2 = _tb_begin; i2 < _tb_end; ++i2)
+                {
+                    fill_row(team, em, st, i2, _alpha[(i2 - 1) % 2], _alpha[i2 % 2],
+                             &_tb[(i2 - _tb_begin) * n_states], &_tb_escape[(i2 - _tb_begin) * _team_size]);
+                }
+            }
             _state_seq.at(i) = max_j;
-            max_j = cell(i, max_j).beta;
+            max_j = prev_state(i, max_j);
         }
         _state_seq.at(0) = max_j;
     }
 
+    // keep the states of beam_states within the beam of alpha; return the best one
+    unsigned prune_beam(const std::vector< Float_Type >& alpha, std::vector< unsigned >& beam_states) const
+    {
+        auto better = [&] (unsigned j1, unsigned j2) { return alpha[j1] > alpha[j2]; };
+        unsigned j_max = *std::min_element(beam_states.begin(), beam_states.end(), better);
+        if (beam_width() > 0)
+        {
+            Float_Type cutoff = alpha[j_max] - beam_width();
+            beam_states.erase(std::remove_if(beam_states.begin(), beam_states.end(),
+                                             [&] (unsigned j) { return alpha[j] < cutoff; }),
+                              beam_states.end());
+        }
+        if (beam_size() > 0 and beam_states.size() > beam_size())
+        {
+            std::nth_element(beam_states.begin(), beam_states.begin() + beam_size() - 1, beam_states.end(), better);
+            beam_states.resize(beam_size());
+        }
+        return j_max;
+    }
+
+    // max-product over the states in the beam, extended along the explicit neighbour lists
+    template < typename Emissions >
+    void fill_beam(const Emissions& em, const State_Transitions_Type& st)
+    {
+        const State_Transition_Table_Type& to = st.to_table();
+        unsigned n_events = em.n_events();
+        _state_seq.resize(n_events);
+        init_scratch(st);
+        _beam_arg.assign(n_states, static_cast< unsigned >(n_states));
+        _beam_tb_offset.assign(2, 0);
+        _tb_begin = 1;
+        _tb_end = n_events;
+        Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
+        //
+        // alpha; i == 0
+        //
+        em.row(0, &_alpha[0][0]);
+        _beam_states.resize(n_states);
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            _alpha[0][j] -= log_n_states;
+            _beam_states[j] = j;
+        }
+        unsigned j_max = prune_beam(_alpha[0], _beam_states);
+        //
+        // alpha, traceback; i > 0
+        //
+        for (unsigned i = 1; i < n_events; ++i)
+        {
+            const std::vector< Float_Type >& alpha_prev = _alpha[(i - 1) % 2];
+            std::vector< Float_Type >& alpha_crt = _alpha[i % 2];
+            _beam_next.clear();
+            for (auto j_prev : _beam_states)
+            {
+                for (unsigned k = to.begin(j_prev); k < to.end(j_prev); ++k)
+                {
+                    if (to.is_padding(k)) continue;
+                    unsigned j = to.state[k];
+                    Float_Type v = alpha_prev[j_prev] + to.log_p[k];
+                    if (_beam_arg[j] == n_states)
+                    {
+                        _beam_next.push_back(j);
+                    }
+                    else if (not (v > alpha_crt[j]))
+                    {
+                        continue;
+                    }
+                    alpha_crt[j] = v;
+                    _beam_arg[j] = j_prev;
+                }
+            }
+            // a full emission row is cheaper than scattered single emissions
+            em.row(i, &_em[0]);
+            for (auto j : _beam_next)
+            {
+                alpha_crt[j] += _em[j];
+            }
+            // record the traceback of the surviving states, then reset all touched ones
+            _beam_touched.assign(_beam_next.begin(), _beam_next.end());
+            j_max = prune_beam(alpha_crt, _beam_next);
+            std::sort(_beam_next.begin(), _beam_next.end());
+            for (auto j : _beam_next)
+            {
+                _beam_tb.push_back(std::make_pair(j, _beam_arg[j]));
+            }
+            _beam_tb_offset.push_back(_beam_tb.size());
+            for (auto j : _beam_touched)
+            {
+                _beam_arg[j] = n_states;
+            }
+            std::swap(_beam_states, _beam_next);
+            LOG("Viterbi", debug1)
+                << "beam: i=" << i << " n_states=" << _beam_states.size()
+                << " alpha_max=" << alpha_crt[j_max] << std::endl;
+        }
+        //
+        // traceback
+        //
+        _path_probability = _alpha[(n_events - 1) % 2][j_max];
+        for (unsigned i = n_events - 1; i > 0; --i)
+        {
+            _state_seq[i] = j_max;
+            j_max = prev_state(i, j_max);
+            assert(j_max < n_states);
+        }
+        _state_seq[0] = j_max;
+        fill_base_seq();
+    }
+
     void fill_base_seq()
     {
         for (unsigned i = 0; i < _state_seq.size() - 1; ++i)
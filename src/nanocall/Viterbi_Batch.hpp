@@ -0,0 +1,361 @@
+#ifndef __VITERBI_BATCH_HPP
+#define __VITERBI_BATCH_HPP
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "Pore_Model.hpp"
+#include "Emission_Matrix.hpp"
+#include "State_Transitions.hpp"
+#include "Viterbi.hpp"
+#include "logger.hpp"
+
+/**
+ * Viterbi decoding of several reads in lockstep, one vector lane per read.
+ * All reads share the same (factored) state transitions; each read has its own emissions.
+ * Rows are stored state-major and lane-minor, so that the max-product runs on vectors of
+ * Lanes values, and each transition term is loaded once for the whole batch.
+ * Reads are decoded in groups of up to Lanes, longest first; lanes of reads that have ended
+ * keep computing, but their rows are no longer used. The traceback holds one byte per
+ * state for each read in the group, so a group is closed when padding its reads to the
+ * longest one would take over 5/4 of their tracebacks decoded separately, or over
+ * Viterbi::max_mem() if set.
+ * Transitions with skips over max_code_skip, beam mode, multi-threaded Viterbi, and
+ * groups of one read are decoded one read at a time.
+ */
+template < typename Float_Type, unsigned Kmer_Size = 6, unsigned Lanes = 8 >
+class Viterbi_Batch
+{
+public:
+    typedef Kmer< Kmer_Size > Kmer_Type;
+    typedef Pore_Model< Float_Type, Kmer_Size > Pore_Model_Type;
+    typedef Pore_Model_Emissions< Float_Type, Kmer_Size > Pore_Model_Emissions_Type;
+    typedef State_Transitions< Float_Type, Kmer_Size > State_Transitions_Type;
+    typedef typename State_Transitions_Type::State_Transition_Groups_Type State_Transition_Groups_Type;
+    typedef Event_Sequence_View< Float_Type > Event_Sequence_View_Type;
+    typedef Viterbi< Float_Type, Kmer_Size > Viterbi_Type;
+    typedef typename Viterbi_Type::Traceback_Code Traceback_Code;
+
+    static const unsigned n_states = Pore_Model_Type::n_states;
+    static const unsigned n_lanes = Lanes;
+    static_assert((Lanes & (Lanes - 1)) == 0, "number of lanes must be a power of 2");
+
+    void clear()
+    {
+        _state_seq_v.clear();
+        _base_seq_v.clear();
+        _path_probability_v.clear();
+    }
+    unsigned n_reads() const { return _state_seq_v.size(); }
+    const std::vector< unsigned >& state_seq(unsigned r) const { return _state_seq_v.at(r); }
+    const std::string& base_seq(unsigned r) const { return _base_seq_v.at(r); }
+    Float_Type path_probability(unsigned r) const { return _path_probability_v.at(r); }
+
+    /**
+     * Decode reads r in [0, pm_ptr_v.size()), with model *pm_ptr_v[r] and events ev_v[r].
+     */
+    void fill(const std::vector< const Pore_Model_Type* >& pm_ptr_v,
+              const std::vector< Event_Sequence_View_Type >& ev_v,
+              const State_Transitions_Type& st)
+    {
+        assert(pm_ptr_v.size() == ev_v.size());
+        std::vector< Pore_Model_Emissions_Type > em_v;
+        em_v.reserve(pm_ptr_v.size());
+        for (unsigned r = 0; r < pm_ptr_v.size(); ++r)
+        {
+            em_v.emplace_back(*pm_ptr_v[r], ev_v[r]);
+        }
+        fill(em_v, st);
+    }
+    /**
+     * Same, with emissions from sources such as Emission_Matrix objects.
+     */
+    template < typename Emissions >
+    void fill(const std::vector< Emissions >& em_v, const State_Transitions_Type& st)
+    {
+        clear();
+        unsigned n = em_v.size();
+        _state_seq_v.resize(n);
+        _base_seq_v.resize(n);
+        _path_probability_v.resize(n);
+        bool lockstep = st.has_groups() and st.groups().n_levels() <= Viterbi_Type::max_code_skip
+            and not Viterbi_Type::beam_enabled() and Viterbi_Type::n_threads() <= 1;
+        if (lockstep)
+        {
+            init_scratch(st.groups());
+        }
+        // group reads of similar lengths
+        std::vector< unsigned > order(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&] (unsigned r1, unsigned r2) {
+            return em_v[r1].n_events() > em_v[r2].n_events();
+        });
+        auto tb_size = [&] (unsigned r) {
+            return size_t(std::max(em_v[r].n_events(), 1u) - 1) * n_states * sizeof(Traceback_Code);
+        };
+        unsigned k = 0;
+        while (k < n)
+        {
+            std::vector< unsigned > batch(1, order[k]);
+            size_t tb_size_sum = tb_size(order[k]);
+            while (lockstep and batch.size() < n_lanes and k + batch.size() < n)
+            {
+                unsigned r = order[k + batch.size()];
+                size_t tb_size_batch = tb_size(batch[0]) * (batch.size() + 1);
+                if (tb_size_batch * 4 > (tb_size_sum + tb_size(r)) * 5
+                    or (Viterbi_Type::max_mem() > 0 and tb_size_batch > Viterbi_Type::max_mem()))
+                {
+                    break;
+                }
+                batch.push_back(r);
+                tb_size_sum += tb_size(r);
+            }
+            k += batch.size();
+            if (batch.size() > 1)
+            {
+                fill_batch(em_v, st.groups(), batch);
+                continue;
+            }
+            unsigned r = batch[0];
+            Viterbi_Type vit;
+            vit.fill(em_v[r], st);
+            _state_seq_v[r] = vit.state_seq();
+            _base_seq_v[r] = vit.base_seq();
+            _path_probability_v[r] = vit.path_probability();
+        }
+    }
+
+private:
+    /**
+     * One value per lane, as GCC/Clang vector types; comparisons produce Lane_Int masks of
+     * the same width. Rows are kept as plain arrays of n_states * Lanes values, and moved
+     * to and from vectors with memcpy (unaligned loads and stores).
+     */
+    typedef typename std::conditional< sizeof(Float_Type) == 4, std::int32_t, std::int64_t >::type Lane_Int_Type;
+    typedef Float_Type Lane_Float __attribute__((vector_size(sizeof(Float_Type) * Lanes)));
+    typedef Lane_Int_Type Lane_Int __attribute__((vector_size(sizeof(Lane_Int_Type) * Lanes)));
+
+    std::vector< std::vector< unsigned > > _state_seq_v;
+    std::vector< std::string > _base_seq_v;
+    std::vector< Float_Type > _path_probability_v;
+    // alpha rows, state-major, lane-minor
+    std::array< std::vector< Float_Type >, 2 > _alpha;
+    // traceback codes, event-major, state-major, lane-minor, with one lane per read of the batch
+    std::vector< Traceback_Code > _tb;
+    // per-lane alpha row of the last event
+    std::array< std::vector< Float_Type >, Lanes > _alpha_last;
+    // scratch space
+    std::vector< Float_Type > _em;
+    std::vector< Float_Type > _em_lane;
+    std::vector< std::vector< Float_Type > > _g_max;
+    std::vector< std::vector< Lane_Int_Type > > _g_arg;
+
+    void init_scratch(const State_Transition_Groups_Type& grp)
+    {
+        for (unsigned k = 0; k < 2; ++k)
+        {
+            _alpha[k].resize(n_states * n_lanes);
+        }
+        _em.resize(n_states * n_lanes);
+        _em_lane.resize(n_states);
+        _g_max.resize(grp.n_levels() + 1);
+        _g_arg.resize(grp.n_levels() + 1);
+        for (unsigned l = 1; l <= grp.n_levels(); ++l)
+        {
+            _g_max[l].resize(grp.n_keys(l) * n_lanes);
+            _g_arg[l].resize(grp.n_keys(l) * n_lanes);
+        }
+    }
+
+    // emissions of event i of each active lane, transposed into _em
+    template < typename Emissions >
+    void fill_em(const std::vector< Emissions >& em_v, const std::vector< unsigned >& batch, unsigned i)
+    {
+        for (unsigned lane = 0; lane < batch.size(); ++lane)
+        {
+            if (i >= em_v[batch[lane]].n_events()) continue;
+            em_v[batch[lane]].row(i, &_em_lane[0]);
+            for (unsigned j = 0; j < n_states; ++j)
+            {
+                _em[j * n_lanes + lane] = _em_lane[j];
+            }
+        }
+    }
+
+    template < typename Emissions >
+    void fill_batch(const std::vector< Emissions >& em_v,
+                    const State_Transition_Groups_Type& grp,
+                    const std::vector< unsigned >& batch)
+    {
+        unsigned n_events = em_v[batch[0]].n_events();
+        LOG("Viterbi_Batch", debug)
+            << "n_reads=" << batch.size() << " n_events=" << n_events << std::endl;
+        std::array< unsigned, Lanes > len;
+        for (unsigned lane = 0; lane < n_lanes; ++lane)
+        {
+            len[lane] = lane < batch.size()? em_v[batch[lane]].n_events() : 0;
+        }
+        unsigned n_tb_lanes = batch.size();
+        _tb.resize(size_t(std::max(n_events, 1u) - 1) * n_states * n_tb_lanes);
+        // alpha; i == 0
+        Float_Type log_n_states = std::log(static_cast< Float_Type >(n_states));
+        std::fill(_em.begin(), _em.end(), 0.0);
+        fill_em(em_v, batch, 0);
+        for (unsigned x = 0; x < n_states * n_lanes; ++x)
+        {
+            _alpha[0][x] = _em[x] - log_n_states;
+        }
+        save_last_rows(len, 0, &_alpha[0][0]);
+        // alpha, traceback; i > 0
+        for (unsigned i = 1; i < n_events; ++i)
+        {
+            fill_em(em_v, batch, i);
+            fill_row(grp, &_alpha[(i - 1) % 2][0], &_alpha[i % 2][0],
+                     &_tb[size_t(i - 1) * n_states * n_tb_lanes], n_tb_lanes);
+            save_last_rows(len, i, &_alpha[i % 2][0]);
+        }
+        // traceback, per lane
+        for (unsigned lane = 0; lane < batch.size(); ++lane)
+        {
+            unsigned r = batch[lane];
+            if (len[lane] == 0) continue;
+            const std::vector< Float_Type >& alpha_last = _alpha_last[lane];
+            unsigned j_max = std::max_element(alpha_last.begin(), alpha_last.end()) - alpha_last.begin();
+            _path_probability_v[r] = alpha_last[j_max];
+            std::vector< unsigned >& state_seq = _state_seq_v[r];
+            state_seq.resize(len[lane]);
+            for (unsigned i = len[lane] - 1; i > 0; --i)
+            {
+                state_seq[i] = j_max;
+                j_max = Viterbi_Type::decode(_tb[(size_t(i - 1) * n_states + j_max) * n_tb_lanes + lane],
+                                             j_max, nullptr, 0);
+            }
+            state_seq[0] = j_max;
+            fill_base_seq(state_seq, _base_seq_v[r]);
+        }
+    }
+
+    // save the alpha row of the lanes whose read ends at event i
+    void save_last_rows(const std::array< unsigned, Lanes >& len, unsigned i, const Float_Type* alpha_crt)
+    {
+        for (unsigned lane = 0; lane < n_lanes; ++lane)
+        {
+            if (i + 1 != len[lane]) continue;
+            _alpha_last[lane].resize(n_states);
+            for (unsigned j = 0; j < n_states; ++j)
+            {
+                _alpha_last[lane][j] = alpha_crt[j * n_lanes + lane];
+            }
+        }
+    }
+
+    // max-product over the factored transitions, for all lanes at once;
+    // traceback codes are stored for the first n_tb_lanes lanes only
+    void fill_row(const State_Transition_Groups_Type& grp,
+                  const Float_Type* alpha_prev, Float_Type* alpha_crt,
+                  Traceback_Code* tb_row, unsigned n_tb_lanes)
+    {
+#ifdef POREMODEL_X86_SIMD
+        // the default x86-64 target has 128-bit vectors only
+        static const bool has_avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+        if (has_avx2)
+        {
+            fill_row_avx2(grp, alpha_prev, alpha_crt, tb_row, n_tb_lanes);
+            return;
+        }
+#endif
+        fill_row_lanes(grp, alpha_prev, alpha_crt, tb_row, n_tb_lanes);
+    }
+
+#ifdef POREMODEL_X86_SIMD
+    __attribute__((target("avx2")))
+    void fill_row_avx2(const State_Transition_Groups_Type& grp,
+                       const Float_Type* alpha_prev, Float_Type* alpha_crt,
+                       Traceback_Code* tb_row, unsigned n_tb_lanes)
+    {
+        fill_row_lanes(grp, alpha_prev, alpha_crt, tb_row, n_tb_lanes);
+    }
+#endif
+
+    __attribute__((always_inline))
+    void fill_row_lanes(const State_Transition_Groups_Type& grp,
+                        const Float_Type* alpha_prev, Float_Type* alpha_crt,
+                        Traceback_Code* tb_row, unsigned n_tb_lanes)
+    {
+        const Lane_Float zero = {};
+        const Lane_Int zero_int = {};
+        unsigned n_levels = grp.n_levels();
+        // fold level l from level l-1, where level 0 is the previous row
+        for (unsigned l = 1; l <= n_levels; ++l)
+        {
+            const Float_Type* g_max_prev = l == 1? alpha_prev : &_g_max[l - 1][0];
+            for (unsigned key = 0; key < grp.n_keys(l); ++key)
+            {
+                Lane_Float m = zero - INFINITY;
+                Lane_Int a = zero_int;
+                for (unsigned b = 0; b < 4; ++b)
+                {
+                    unsigned key_prev = (b << (2 * (Kmer_Size - l))) | key;
+                    Lane_Float v;
+                    Lane_Int a_prev = zero_int + Lane_Int_Type(key_prev);
+                    std::memcpy(&v, g_max_prev + key_prev * n_lanes, sizeof(v));
+                    if (l > 1) std::memcpy(&a_prev, &_g_arg[l - 1][key_prev * n_lanes], sizeof(a_prev));
+                    Lane_Int better = v > m;
+                    m = (Lane_Float)((better & (Lane_Int)v) | (~better & (Lane_Int)m));
+                    a = (better & a_prev) | (~better & a);
+                }
+                std::memcpy(&_g_max[l][key * n_lanes], &m, sizeof(m));
+                std::memcpy(&_g_arg[l][key * n_lanes], &a, sizeof(a));
+            }
+        }
+        // combine
+        for (unsigned j = 0; j < n_states; ++j)
+        {
+            Lane_Float best;
+            Lane_Float em;
+            std::memcpy(&best, alpha_prev + j * n_lanes, sizeof(best));
+            std::memcpy(&em, &_em[j * n_lanes], sizeof(em));
+            best += grp.log_p_from(j, 0);
+            Lane_Int code = zero_int;
+            for (unsigned l = 1; l <= n_levels; ++l)
+            {
+                unsigned key = grp.from_key(j, l);
+                Lane_Float v;
+                Lane_Int a;
+                std::memcpy(&v, &_g_max[l][key * n_lanes], sizeof(v));
+                std::memcpy(&a, &_g_arg[l][key * n_lanes], sizeof(a));
+                v += grp.log_p_from(j, l);
+                Lane_Int better = v > best;
+                best = (Lane_Float)((better & (Lane_Int)v) | (~better & (Lane_Int)best));
+                Lane_Int c = ((a >> (2 * (Kmer_Size - l))) << 3) | Lane_Int_Type(l);
+                code = (better & c) | (~better & code);
+            }
+            best += em;
+            std::memcpy(alpha_crt + j * n_lanes, &best, sizeof(best));
+            for (unsigned lane = 0; lane < n_tb_lanes; ++lane)
+            {
+                tb_row[j * n_tb_lanes + lane] = code[lane];
+            }
+        }
+    }
+
+    static void fill_base_seq(const std::vector< unsigned >& state_seq, std::string& base_seq)
+    {
+        base_seq.clear();
+        for (unsigned i = 0; i + 1 < state_seq.size(); ++i)
+        {
+            base_seq += Kmer_Type::to_string(state_seq[i]).substr(0, Kmer_Type::min_skip(state_seq[i], state_seq[i + 1]));
+        }
+        base_seq += Kmer_Type::to_string(state_seq.back());
+    }
+}; // class Viterbi_Batch
+
+#endif
@@ -0,0 +1,203 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <tclap/CmdLine.h>
+
+#include "Pore_Model.hpp"
+#include "State_Transitions.hpp"
+#include "Event.hpp"
+#include "Viterbi.hpp"
+#include "Viterbi_Batch.hpp"
+#include "logger.hpp"
+#include "zstr.hpp"
+
+using namespace std;
+
+#ifndef FLOAT_TYPE
+#define FLOAT_TYPE float
+#endif
+typedef State_Transitions< FLOAT_TYPE > State_Transitions_Type;
+typedef State_Transition_Parameters< FLOAT_TYPE > State_Transition_Parameters_Type;
+typedef Pore_Model< FLOAT_TYPE > Pore_Model_Type;
+typedef Event< FLOAT_TYPE > Event_Type;
+typedef Event_Sequence< FLOAT_TYPE > Event_Sequence_Type;
+typedef Event_Sequence_View< FLOAT_TYPE > Event_Sequence_View_Type;
+typedef Viterbi< FLOAT_TYPE > Viterbi_Type;
+typedef Viterbi_Batch< FLOAT_TYPE > Viterbi_Batch_Type;
+
+namespace opts
+{
+    using namespace TCLAP;
+    string description =
+        "Compare beam-pruned Viterbi against full Viterbi: for each beam setting, "
+        "print running time and accuracy relative to the full decoding. "
+        "With --batch, compare batched Viterbi against per-read Viterbi instead";
+    CmdLine cmd_parser(description);
+    MultiArg< string > log_level("d", "log-level", "Log level.", false, "string", cmd_parser);
+    ValueArg< string > pm_file_name("p", "pore-model", "Scaled pore model file name.", true, "", "file", cmd_parser);
+    ValueArg< string > st_file_name("s", "state-transitions", "State transitions file name (default: compute from --pr-stay, --pr-skip).", false, "", "file", cmd_parser);
+    ValueArg< string > ev_file_name("e", "events", "Events file name.", true, "", "file", cmd_parser);
+    ValueArg< float > pr_stay("", "pr-stay", "Transition probability of staying in the same state.", false, .09, "float", cmd_parser);
+    ValueArg< float > pr_skip("", "pr-skip", "Transition probability of skipping at least 1 state.", false, .28, "float", cmd_parser);
+    MultiArg< float > beam_width("", "beam-width", "Beam width to benchmark (default: 5, 10, 20, 40).", false, "float", cmd_parser);
+    MultiArg< unsigned > beam_size("", "beam-size", "Beam size to benchmark (default: 64, 256, 1024).", false, "int", cmd_parser);
+    ValueArg< unsigned > batch_size("", "batch", "Decode this many reads (windows of the events) in a batch, and check each against per-read Viterbi.", false, 0, "int", cmd_parser);
+    ValueArg< unsigned > num_rounds("", "rounds", "Number of timing rounds per setting.", false, 3, "int", cmd_parser);
+} // namespace opts
+
+// edit distance between s1 and s2
+unsigned edit_distance(const string& s1, const string& s2)
+{
+    vector< unsigned > d(s2.size() + 1);
+    for (unsigned j = 0; j <= s2.size(); ++j)
+    {
+        d[j] = j;
+    }
+    for (unsigned i = 1; i <= s1.size(); ++i)
+    {
+        unsigned diag = d[0];
+        d[0] = i;
+        for (unsigned j = 1; j <= s2.size(); ++j)
+        {
+            unsigned up = d[j];
+            d[j] = min(min(d[j], d[j - 1]) + 1, diag + (s1[i - 1] != s2[j - 1]));
+            diag = up;
+        }
+    }
+    return d[s2.size()];
+}
+
+// run Viterbi with the current settings; return the best time in milliseconds
+double time_viterbi(const Pore_Model_Type& pm, const State_Transitions_Type& st, const Event_Sequence_Type& ev,
+                    Viterbi_Type& vit)
+{
+    double best_ms = 0;
+    for (unsigned r = 0; r < max(opts::num_rounds.get(), 1u); ++r)
+    {
+        auto start = chrono::steady_clock::now();
+        vit.fill(pm, st, ev);
+        auto end = chrono::steady_clock::now();
+        double ms = chrono::duration< double, milli >(end - start).count();
+        if (r == 0 or ms < best_ms) best_ms = ms;
+    }
+    return best_ms;
+}
+
+// decode windows of ev as a batch, and one at a time; print running times, and the
+// fraction of reads whose state sequences agree; return false if any disagree
+bool bench_batch(const Pore_Model_Type& pm, const State_Transitions_Type& st, const Event_Sequence_Type& ev)
+{
+    // reads start at increasing offsets and end at decreasing ones, so that their lengths vary
+    unsigned n = opts::batch_size;
+    vector< const Pore_Model_Type* > pm_ptr_v(n, &pm);
+    vector< Event_Sequence_View_Type > ev_v;
+    for (unsigned r = 0; r < n; ++r)
+    {
+        size_t start = r * (ev.size() / 2) / n;
+        size_t end = ev.size() - r * (ev.size() / 4) / n;
+        ev_v.emplace_back(ev, start, end - start);
+    }
+    Viterbi_Type::beam_width() = 0;
+    Viterbi_Type::beam_size() = 0;
+    double single_ms = 0;
+    double batch_ms = 0;
+    vector< Viterbi_Type > vit_v(n);
+    Viterbi_Batch_Type vit_batch;
+    for (unsigned k = 0; k < max(opts::num_rounds.get(), 1u); ++k)
+    {
+        auto start = chrono::steady_clock::now();
+        for (unsigned r = 0; r < n; ++r)
+        {
+            vit_v[r].fill(pm, st, ev_v[r]);
+        }
+        auto mid = chrono::steady_clock::now();
+        vit_batch.fill(pm_ptr_v, ev_v, st);
+        auto end = chrono::steady_clock::now();
+        double ms_1 = chrono::duration< double, milli >(mid - start).count();
+        double ms_2 = chrono::duration< double, milli >(end - mid).count();
+        if (k == 0 or ms_1 < single_ms) single_ms = ms_1;
+        if (k == 0 or ms_2 < batch_ms) batch_ms = ms_2;
+    }
+    unsigned n_same = 0;
+    for (unsigned r = 0; r < n; ++r)
+    {
+        n_same += vit_batch.state_seq(r) == vit_v[r].state_seq();
+    }
+    cout << "n_reads\tlockstep\tsingle_ms\tbatch_ms\tspeedup\tstate_seq_agreement" << endl;
+    cout << n << '\t' << st.has_groups() << '\t' << single_ms << '\t' << batch_ms << '\t'
+         << single_ms / batch_ms << '\t' << double(n_same) / n << endl;
+    return n_same == n;
+}
+
+int real_main()
+{
+    Pore_Model_Type pm;
+    State_Transitions_Type st;
+    Event_Sequence_Type ev;
+    zstr::ifstream(opts::pm_file_name) >> pm;
+    if (not opts::st_file_name.get().empty())
+    {
+        zstr::ifstream(opts::st_file_name) >> st;
+    }
+    else
+    {
+        st.compute_transitions_fast(opts::pr_skip, opts::pr_stay);
+    }
+    {
+        zstr::ifstream ifs(opts::ev_file_name);
+        Event_Type e;
+        while (ifs >> e)
+        {
+            ev.push_back(e);
+        }
+    }
+    if (opts::batch_size > 0)
+    {
+        return bench_batch(pm, st, ev)? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    vector< pair< float, unsigned > > settings;
+    vector< float > beam_width_v = opts::beam_width.getValue();
+    vector< unsigned > beam_size_v = opts::beam_size.getValue();
+    if (beam_width_v.empty() and beam_size_v.empty())
+    {
+        beam_width_v = { 5, 10, 20, 40 };
+        beam_size_v = { 64, 256, 1024 };
+    }
+    for (auto w : beam_width_v) settings.push_back(make_pair(w, 0u));
+    for (auto k : beam_size_v) settings.push_back(make_pair(0.0f, k));
+
+    Viterbi_Type::beam_width() = 0;
+    Viterbi_Type::beam_size() = 0;
+    Viterbi_Type full;
+    double full_ms = time_viterbi(pm, st, ev, full);
+    cout << "beam_width\tbeam_size\tms\tspeedup\tpath_probability\tdelta\tstate_agreement\tedit_distance\tbase_identity" << endl;
+    cout << 0 << '\t' << 0 << '\t' << full_ms << '\t' << 1.0 << '\t'
+         << full.path_probability() << '\t' << 0.0 << '\t' << 1.0 << '\t' << 0 << '\t' << 1.0 << endl;
+    for (const auto& p : settings)
+    {
+        Viterbi_Type::beam_width() = p.first;
+        Viterbi_Type::beam_size() = p.second;
+        Viterbi_Type vit;
+        double ms = time_viterbi(pm, st, ev, vit);
+        unsigned n_same = 0;
+        for (unsigned i = 0; i < ev.size(); ++i)
+        {
+            n_same += vit.state_seq()[i] == full.state_seq()[i];
+        }
+        unsigned ed = edit_distance(vit.base_seq(), full.base_seq());
+        cout << p.first << '\t' << p.second << '\t' << ms << '\t' << full_ms / ms << '\t'
+             << vit.path_probability() << '\t' << vit.path_probability() - full.path_probability() << '\t'
+             << double(n_same) / ev.size() << '\t' << ed << '\t'
+             << 1.0 - double(ed) / max< size_t >(full.base_seq().size(), 1) << endl;
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char * argv[])
+{
+    opts::cmd_parser.parse(argc, argv);
+    logger::Logger::set_levels_from_options(opts::log_level);
+    return real_main();
+}
@@ -2,9 +2,11 @@
 #define __FS_SUPPORT_HPP
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
 
 // This should work in windows.
@@ -35,4 +37,31 @@ std::vector< std::string > list_directory(const std::string& file_name)
     return res;
 }
 
+// List directory entries other than "." and "..", flagging subdirectories.
+// Entry types come from readdir() where possible, saving a system call per entry.
+// Symbolic links are not followed.
+std::vector< std::pair< std::string, bool > > list_directory_entries(const std::string& file_name)
+{
+    std::vector< std::pair< std::string, bool > > res;
+    DIR* dir;
+    struct dirent *ent;
+
+    dir = opendir(file_name.c_str());
+    if (not dir) return res;
+    while ((ent = readdir(dir)) != nullptr)
+    {
+        std::string name(ent->d_name);
+        if (name == "." or name == "..") continue;
+        bool is_dir = (ent->d_type == DT_DIR);
+        if (ent->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            is_dir = (lstat((file_name + "/" + name).c_str(), &st) == 0 and S_ISDIR(st.st_mode));
+        }
+        res.emplace_back(std::move(name), is_dir);
+    }
+    closedir(dir);
+    return res;
+}
+
 #endif
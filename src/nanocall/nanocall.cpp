@@ -1,6 +1,15 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <tclap/CmdLine.h>
 #include <seqan/align.h>
 
@@ -12,15 +21,17 @@
 #include "Builtin_Model.hpp"
 #include "State_Transitions.hpp"
 #include "Event.hpp"
+#include "Event_Cache.hpp"
 #include "Fast5_Summary.hpp"
 #include "Viterbi.hpp"
+#include "Viterbi_Batch.hpp"
 #include "Forward_Backward.hpp"
 #include "Parameter_Trainer.hpp"
+#include "Bounded_Queue.hpp"
 #include "logger.hpp"
 #include "alg.hpp"
 #include "zstr.hpp"
 #include "fast5.hpp"
-#include "pfor.hpp"
 #include "fs_support.hpp"
 
 using namespace std;
@@ -44,22 +55,78 @@ typedef Pore_Model_Dict<FLOAT_TYPE> Pore_Model_Dict_Type;
 typedef Pore_Model_Parameters<FLOAT_TYPE> Pore_Model_Parameters_Type;
 typedef Event<FLOAT_TYPE> Event_Type;
 typedef Event_Sequence<FLOAT_TYPE> Event_Sequence_Type;
+typedef Event_Sequence_View<FLOAT_TYPE> Event_Sequence_View_Type;
+typedef Event_Cache<FLOAT_TYPE> Event_Cache_Type;
 typedef Fast5_Summary<FLOAT_TYPE> Fast5_Summary_Type;
 typedef Parameter_Trainer<FLOAT_TYPE> Parameter_Trainer_Type;
 typedef Viterbi<FLOAT_TYPE> Viterbi_Type;
+typedef Viterbi_Batch<FLOAT_TYPE> Viterbi_Batch_Type;
+typedef Forward_Backward<FLOAT_TYPE> Forward_Backward_Type;
 
 namespace opts {
 using namespace TCLAP;
 string description = "Call bases in Oxford Nanopore reads.";
 CmdLine cmd_parser(description, ' ', package_version);
 //
-ValueArg<unsigned> chunk_size(
-    "", "chunk-size", "Thread chunk size.", false, 1, "int", cmd_parser);
+ValueArg<unsigned> chunk_size("",
+                              "chunk-size",
+                              "Thread chunk size (ignored; kept for "
+                              "compatibility).",
+                              false,
+                              1,
+                              "int",
+                              cmd_parser);
+ValueArg<unsigned> queue_size("",
+                              "queue-size",
+                              "Number of reads buffered between pipeline "
+                              "stages, per thread.",
+                              false,
+                              4,
+                              "int",
+                              cmd_parser);
+ValueArg<unsigned> queue_mem("",
+                             "queue-mem",
+                             "Memory budget for events of reads waiting to be "
+                             "processed, in MB (0: no limit).",
+                             false,
+                             1024,
+                             "int",
+                             cmd_parser);
 MultiArg<string>
     log_level("", "log", "Log level.", false, "string", cmd_parser);
 ValueArg<string> stats_fn("", "stats", "Stats.", false, "", "file", cmd_parser);
-ValueArg<unsigned> max_read_len(
-    "", "max-len", "Maximum read length.", false, 50000, "int", cmd_parser);
+ValueArg<unsigned> max_read_len("",
+                                "max-len",
+                                "Maximum read length (0: no limit).",
+                                false,
+                                50000,
+                                "int",
+                                cmd_parser);
+ValueArg<unsigned> max_mem("",
+                           "max-mem",
+                           "Memory budget for dynamic programming tables, in "
+                           "MB per thread (0: no limit). Longer reads are "
+                           "processed in checkpointed segments.",
+                           false,
+                           0,
+                           "int",
+                           cmd_parser);
+ValueArg<float> beam_width("",
+                           "beam-width",
+                           "Viterbi beam width: keep states within this log "
+                           "score of the best one (0: no beam).",
+                           false,
+                           0.0,
+                           "float",
+                           cmd_parser);
+ValueArg<unsigned> beam_size("",
+                             "beam-size",
+                             "Viterbi beam size: keep at most this many states "
+                             "per event (0: no beam).",
+                             false,
+                             0,
+                             "int",
+                             cmd_parser);
 ValueArg<unsigned> min_read_len(
     "", "min-len", "Minimum read length.", false, 10, "int", cmd_parser);
 ValueArg<unsigned> fasta_line_width("",
@@ -125,6 +192,11 @@ SwitchArg two_d_hmm("",
 SwitchArg only_train("", "only-train", "Stop after training.", cmd_parser);
 SwitchArg train("", "train", "Enable training.", cmd_parser);
 SwitchArg no_train("", "no-train", "Disable all training.", cmd_parser);
+SwitchArg log_space("",
+                    "log-space",
+                    "Run forward-backward in log space instead of scaled "
+                    "probability space.",
+                    cmd_parser);
 //
 ValueArg<float> pr_skip("",
                         "pr-skip",
@@ -140,6 +212,15 @@ ValueArg<float> pr_stay("",
                         .1,
                         "float",
                         cmd_parser);
+ValueArg<unsigned> max_skip("",
+                            "max-skip",
+                            "Maximum number of bases skipped per event in the "
+                            "transition model (1-5; 5: any skip). Above 1, "
+                            "beam search is not available.",
+                            false,
+                            1,
+                            "int",
+                            cmd_parser);
 ValueArg<string> trans_fn("s",
                           "trans",
                           "Custom initial state transitions.",
@@ -156,15 +237,63 @@ ValueArg<string>
     output_fn("o", "output", "Output.", false, "", "file", cmd_parser);
 ValueArg<unsigned> num_threads(
     "t", "threads", "Number of parallel threads.", false, 1, "int", cmd_parser);
+ValueArg<unsigned> num_read_threads("",
+                                    "read-threads",
+                                    "Number of threads working on each read "
+                                    "(total: threads x read-threads).",
+                                    false,
+                                    1,
+                                    "int",
+                                    cmd_parser);
+ValueArg<string> stage_dir("",
+                           "stage-dir",
+                           "Copy each fast5 file to this directory, with one "
+                           "sequential read, before opening it (e.g. "
+                           "/dev/shm).",
+                           false,
+                           "",
+                           "dir",
+                           cmd_parser);
+ValueArg<string> event_cache("",
+                             "event-cache",
+                             "Cache read summaries and filtered events in "
+                             "this file. If it exists and was built with the "
+                             "same filtering options, reads found in it are "
+                             "not loaded from fast5 files.",
+                             false,
+                             "",
+                             "file",
+                             cmd_parser);
+ValueArg<unsigned> num_scan_threads("",
+                                    "scan-threads",
+                                    "Number of threads listing input "
+                                    "directories.",
+                                    false,
+                                    4,
+                                    "int",
+                                    cmd_parser);
+ValueArg<unsigned> num_io_threads("",
+                                  "io-threads",
+                                  "Number of threads reading and summarizing "
+                                  "fast5 files (without a thread-safe HDF5 "
+                                  "library, only one reads at a time).",
+                                  false,
+                                  1,
+                                  "int",
+                                  cmd_parser);
 UnlabeledMultiArg<string> input_fn("inputs",
-                                   "Inputs. Accepts: directories, fast5 files, "
-                                   "or files of fast5 file names (use \"-\" to "
-                                   "read fofn from stdin).",
+                                   "Inputs. Accepts: directories, fast5 files "
+                                   "(by their .fast5 extension), or files of "
+                                   "fast5 file names (use \"-\" to read fofn "
+                                   "from stdin).",
                                    true,
                                    "path",
                                    cmd_parser);
 } // namespace opts
 
+// read summaries and events from previous runs, or being saved for later runs
+Event_Cache_Type event_cache;
+
 void init_models(Pore_Model_Dict_Type& models)
 {
     auto parse_model_name = [](const string& s) {
@@ -238,39 +367,179 @@ void init_transitions(State_Transitions_Type& transitions)
                   << "]" << endl;
     }
     else {
-        transitions.compute_transitions_fast(opts::pr_skip, opts::pr_stay);
+        transitions.compute_transitions_max_skip(opts::pr_skip, opts::pr_stay);
         LOG(info) << "init_state_transitions pr_skip=[" << opts::pr_skip
-                  << "], pr_stay=[" << opts::pr_stay << "]" << endl;
+                  << "], pr_stay=[" << opts::pr_stay << "], max_skip=["
+                  << opts::max_skip << "]" << endl;
     }
 } // init_transitions
 
-// Parse command line arguments. For each of them:
-// - if it is a directory, find all fast5 files in it, ignore non-fast5 files.
-// - if it is a file, check that it is indeed a fast5 file.
-void init_files(list<string>& files)
+// Pipeline items: files, reads, and their output, tagged with their input index
+typedef pair<size_t, string> File_Item_Type;
+typedef pair<size_t, Fast5_Summary_Type> Read_Item_Type;
+typedef tuple<size_t, Fast5_Summary_Type, string> Output_Item_Type;
+
+// Bounds how far reads may run ahead of the writer: a read is loaded only once
+// its index is within size of the next index to be written, so that reads
+// finished out of order cannot pile up behind a slow one. Files are popped in
+// index order, so the read the writer waits for is never held back.
+class Output_Window
 {
-    for (const auto& f : opts::input_fn) {
-        if (is_directory(f)) {
-            auto l = list_directory(f);
-            for (const auto& g : l) {
-                string f2 = f + (f[f.size() - 1] != '/' ? "/" : "") + g;
-                if (is_directory(f2)) {
-                    LOG(info) << "ignoring subdirectory [" << f2 << "]" << endl;
+public:
+    explicit Output_Window(size_t size) : _size(max(size, size_t(1))) {}
+    void wait(size_t idx)
+    {
+        unique_lock<mutex> lock(_mutex);
+        _cv.wait(lock, [&]() { return idx < _next_idx + _size; });
+    }
+    void advance(size_t next_idx)
+    {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _next_idx = next_idx;
+        }
+        _cv.notify_all();
+    }
+
+private:
+    const size_t _size;
+    size_t _next_idx = 0;
+    mutex _mutex;
+    condition_variable _cv;
+}; // class Output_Window
+
+bool has_fast5_extension(const string& fn)
+{
+    return fn.size() >= 6 and fn.compare(fn.size() - 6, 6, ".fast5") == 0;
+} // has_fast5_extension
+
+// Scan directory dir and its subdirectories, calling add_file on every fast5
+// file, judging by its extension. Files are added in the order of a
+// depth-first walk over sorted directory entries, so that input indexes do not
+// depend on timing; meanwhile, num_scan_threads threads list the directories
+// ahead of the walk, with at most 2*num_scan_threads listings requested and not
+// yet walked. Returns when the scan is complete.
+void scan_directory(const string& dir,
+                    const function<void(const string&)>& add_file)
+{
+    typedef vector<pair<string, bool>> Listing_Type;
+    mutex list_q_mutex;
+    condition_variable list_q_cv;
+    deque<pair<string, promise<Listing_Type>>> list_q;
+    bool done = false;
+    auto request_listing = [&](const string& d) {
+        promise<Listing_Type> p;
+        auto res = p.get_future();
+        {
+            lock_guard<mutex> lock(list_q_mutex);
+            list_q.emplace_back(d, move(p));
+        }
+        list_q_cv.notify_one();
+        return res;
+    };
+    auto worker = [&]() {
+        unique_lock<mutex> lock(list_q_mutex);
+        while (true) {
+            list_q_cv.wait(lock, [&]() { return not list_q.empty() or done; });
+            if (list_q.empty()) {
+                break;
+            }
+            auto job = move(list_q.front());
+            list_q.pop_front();
+            lock.unlock();
+            auto l = list_directory_entries(job.first);
+            sort(l.begin(), l.end());
+            job.second.set_value(move(l));
+            lock.lock();
+        }
+    };
+    unsigned num_scan_threads = max(opts::num_scan_threads.get(), 1u);
+    vector<thread> scan_threads;
+    for (unsigned k = 0; k < num_scan_threads; ++k) {
+        scan_threads.emplace_back(worker);
+    }
+    // subdirectory listings requested and not yet walked; used by the walk only
+    size_t num_pending = 0;
+    size_t max_pending = 2 * size_t(num_scan_threads);
+    function<void(const string&, future<Listing_Type>)> walk =
+        [&](const string& d, future<Listing_Type> listing) {
+            auto l = listing.get();
+            string prefix = d + (d[d.size() - 1] != '/' ? "/" : "");
+            // request subdirectory listings in order, while fewer than
+            // max_outstanding are pending
+            vector<string> subdirs;
+            for (const auto& e : l) {
+                if (e.second) {
+                    subdirs.push_back(prefix + e.first);
                 }
-                else if (fast5::File::is_valid_file(f2)) {
-                    files.push_back(f2);
-                    LOG(info) << "adding input file [" << f2 << "]" << endl;
+            }
+            deque<future<Listing_Type>> subdir_listings;
+            size_t num_requested = 0;
+            auto request_ahead = [&](size_t max_outstanding) {
+                while (num_requested < subdirs.size()
+                       and num_pending < max_outstanding) {
+                    subdir_listings.push_back(
+                        request_listing(subdirs[num_requested++]));
+                    ++num_pending;
+                }
+            };
+            request_ahead(max_pending);
+            for (const auto& e : l) {
+                string f = prefix + e.first;
+                if (e.second) {
+                    // the listing needed now is requested regardless of the cap
+                    if (subdir_listings.empty()) {
+                        request_ahead(num_pending + 1);
+                    }
+                    auto subdir_listing = move(subdir_listings.front());
+                    subdir_listings.pop_front();
+                    --num_pending;
+                    // as one listing is taken, request the next sibling
+                    request_ahead(max_pending);
+                    walk(f, move(subdir_listing));
+                }
+                else if (has_fast5_extension(f)) {
+                    add_file(f);
                 }
                 else {
-                    LOG(info) << "ignoring file [" << f2 << "]" << endl;
+                    LOG(info) << "ignoring file [" << f << "]" << endl;
                 }
             }
+        };
+    walk(dir, request_listing(dir));
+    {
+        lock_guard<mutex> lock(list_q_mutex);
+        done = true;
+    }
+    list_q_cv.notify_all();
+    for (auto& t : scan_threads) {
+        t.join();
+    }
+} // scan_directory
+
+// Parse command line arguments. For each of them:
+// - if it is a directory, find all fast5 files in it and its subdirectories;
+// - if it has a fast5 extension, add it;
+// - otherwise, interpret it as a fofn, and add the files listed in it.
+// Files are pushed to file_q as they are found, tagged with their index.
+// Files are not opened here: invalid ones are detected when the I/O stage
+// summarizes them, and skipped by the writer.
+// Returns the number of files.
+size_t init_files(Bounded_Queue<File_Item_Type>& file_q)
+{
+    size_t num_files = 0;
+    auto add_file = [&](const string& f) {
+        file_q.push(make_pair(num_files++, f));
+        LOG(info) << "adding input file [" << f << "]" << endl;
+    };
+    for (const auto& f : opts::input_fn) {
+        if (is_directory(f)) {
+            scan_directory(f, add_file);
         }
         else // not a directory
         {
-            if (f != "-" and fast5::File::is_valid_file(f)) {
-                files.push_back(f);
-                LOG(info) << "adding input file [" << f << "]" << endl;
+            if (has_fast5_extension(f)) {
+                add_file(f);
             }
             else // not fast5, interpret as fofn
             {
@@ -286,346 +555,338 @@ void init_files(list<string>& files)
                 }
                 string g;
                 while (getline(*is_p, g)) {
-                    if (fast5::File::is_valid_file(g)) {
-                        files.push_back(g);
-                        LOG(info) << "adding input file [" << g << "]" << endl;
-                    }
+                    add_file(g);
                 }
             }
         }
     }
-    if (files.empty()) {
-        LOG(error) << "no fast5 files to process" << endl;
-        exit(EXIT_FAILURE);
-    }
+    return num_files;
 } // init_files
 
-void init_reads(const Pore_Model_Dict_Type& models,
-                const list<string>& files,
-                deque<Fast5_Summary_Type>& reads)
+// I/O stage: summarize reads and load their events, ahead of the workers,
+// from the event cache if possible. Files which cannot be opened are passed on
+// as invalid summaries, so that input indexes stay contiguous. Reads keep their
+// events until processed; the queue sizes and the output window bound how
+// many are held.
+void load_reads(const Pore_Model_Dict_Type& models,
+                Bounded_Queue<File_Item_Type>& file_q,
+                Bounded_Queue<Read_Item_Type>& read_q,
+                Output_Window& output_window)
 {
-    for (const auto& f : files) {
-        Fast5_Summary_Type s(f, models, opts::double_strand_scaling);
+    File_Item_Type item;
+    while (file_q.pop(item)) {
+        output_window.wait(item.first);
+        Fast5_Summary_Type s;
+        auto rec_p = event_cache.find(item.second);
+        if (rec_p) {
+            s.summarize(*rec_p, models, opts::double_strand_scaling);
+        }
+        else {
+            s.summarize(item.second, models, opts::double_strand_scaling);
+        }
+        if (not s.valid) {
+            LOG(info) << "ignoring file [" << item.second << "]" << endl;
+        }
         LOG(info) << "summary: " << s << endl;
-        reads.emplace_back(move(s));
+        // summaries cut short by an HDF5 error are not cached, so that the
+        // file is read again on the next run
+        if (s.valid and not s.io_error and not rec_p and event_cache.is_open()) {
+            event_cache.add(s.cache_record());
+        }
+        size_t mem_size = s.events_mem_size();
+        read_q.push(make_pair(item.first, move(s)), mem_size);
     }
-} // init_reads
+    read_q.close();
+} // load_reads
 
-void train_reads(const Pore_Model_Dict_Type& models,
-                 const State_Transitions_Type& default_transitions,
-                 deque<Fast5_Summary_Type>& reads)
+void train_read(const Pore_Model_Dict_Type& models,
+                const State_Transitions_Type& default_transitions,
+                Fast5_Summary_Type& read_summary)
 {
-    auto time_start_ms = get_cpu_time_ms();
-    Parameter_Trainer_Type::init();
-    unsigned crt_idx = 0;
-    pfor::pfor<unsigned>(
-        opts::num_threads, opts::chunk_size,
-        // get_item
-        [&](unsigned& i) {
-            if (crt_idx >= reads.size()) return false;
-            i = crt_idx++;
-            return true;
-        },
-        // process item
-        [&](unsigned& i) {
-            Fast5_Summary_Type& read_summary = reads[i];
-            if (read_summary.num_ed_events == 0) return;
-            global_assert::global_msg() = read_summary.read_id;
-            read_summary.load_events();
-            //
-            // create per-strand list of models to try
-            //
-            array<list<string>, num_strands> model_list;
-            for (unsigned st = 0; st < num_strands; ++st) {
-                // if not enough events, ignore strand
-                if (read_summary.events(st).size() < opts::min_read_len)
-                    continue;
-                // create list of models to try
-                if (not read_summary.preferred_model[st][st].empty()) {
-                    // if we have a preferred model, use that
-                    model_list[st].push_back(
-                        read_summary.preferred_model[st][st]);
-                }
-                else {
-                    // no preferred model, try all that apply to this strand
-                    for (const auto& p : models) {
-                        if (p.second.strand() == st or p.second.strand() == num_strands) {
-                            model_list[st].push_back(p.first);
-                        }
-                    }
+    //
+    // create per-strand list of models to try
+    //
+    array<list<string>, num_strands> model_list;
+    for (unsigned st = 0; st < num_strands; ++st) {
+        // if not enough events, ignore strand
+        if (read_summary.events(st).size() < opts::min_read_len)
+            continue;
+        // create list of models to try
+        if (not read_summary.preferred_model[st][st].empty()) {
+            // if we have a preferred model, use that
+            model_list[st].push_back(
+                read_summary.preferred_model[st][st]);
+        }
+        else {
+            // no preferred model, try all that apply to this strand
+            for (const auto& p : models) {
+                if (p.second.strand() == st or p.second.strand() == num_strands) {
+                    model_list[st].push_back(p.first);
                 }
-                ASSERT(not model_list.empty());
             }
-            //
-            // create per-strand list of event sequences on which to train
-            //
-            array<vector<Event_Sequence_Type>, num_strands> train_event_seqs;
-            for (unsigned st = 0; st < num_strands; ++st) {
-                // if not enough events, ignore strand
-                if (read_summary.events(st).size() < opts::min_read_len)
-                    continue;
-                // create 2 event sequences on which to train
-                unsigned num_train_events =
-                    min((size_t) opts::scaling_num_events.get(),
-                        read_summary.events(st).size());
-                train_event_seqs[st].emplace_back(
-                    read_summary.events(st).begin(),
-                    read_summary.events(st).begin() + num_train_events / num_strands);
-                train_event_seqs[st].emplace_back(
-                    read_summary.events(st).end() - num_train_events / num_strands,
-                    read_summary.events(st).end());
+        }
+        ASSERT(not model_list.empty());
+    }
+    //
+    // create per-strand list of event sequences on which to train
+    //
+    array<vector<Event_Sequence_View_Type>, num_strands> train_event_seqs;
+    for (unsigned st = 0; st < num_strands; ++st) {
+        // if not enough events, ignore strand
+        if (read_summary.events(st).size() < opts::min_read_len)
+            continue;
+        // create 2 event sequences on which to train
+        unsigned num_train_events =
+            min((size_t) opts::scaling_num_events.get(),
+                read_summary.events(st).size());
+        train_event_seqs[st].emplace_back(
+            read_summary.events(st), 0, num_train_events / num_strands);
+        train_event_seqs[st].emplace_back(
+            read_summary.events(st),
+            read_summary.events(st).size() - num_train_events / num_strands,
+            num_train_events / num_strands);
+    }
+    //
+    // branch on whether pore models should be scaled together
+    //
+    if (read_summary.scale_strands_together) {
+        // prepare vector of event sequences
+        vector<pair<Event_Sequence_View_Type, unsigned>>
+            train_event_seq_views;
+        for (unsigned st = 0; st < num_strands; ++st) {
+            for (const auto& events : train_event_seqs[st]) {
+                train_event_seq_views.push_back(make_pair(events, st));
             }
-            //
-            // branch on whether pore models should be scaled together
-            //
-            if (read_summary.scale_strands_together) {
-                // prepare vector of event sequences
-                vector<pair<const Event_Sequence_Type*, unsigned>>
-                    train_event_seq_ptrs;
-                for (unsigned st = 0; st < num_strands; ++st) {
-                    for (const auto& events : train_event_seqs[st]) {
-                        train_event_seq_ptrs.push_back(make_pair(&events, st));
+        }
+        // track model fit
+        // key = pore model name; value = fit
+        map<array<string, num_strands>, FLOAT_TYPE> model_fit;
+        for (const auto& m_name_0 : model_list[0]) {
+            for (const auto& m_name_1 : model_list[1]) {
+                array<string, num_strands> m_name_key = {{m_name_0, m_name_1}};
+                string m_name = m_name_0 + "+" + m_name_1;
+                unsigned round = 0;
+                auto& crt_pm_params =
+                    read_summary.pm_params_m.at(m_name_key);
+                auto& crt_st_params =
+                    read_summary.st_params_m.at(m_name_key);
+                auto& crt_fit = model_fit[m_name_key];
+                crt_fit = -INFINITY;
+                while (true) {
+                    Pore_Model_Parameters_Type old_pm_params(
+                        crt_pm_params);
+                    std::array<State_Transition_Parameters_Type, num_strands>
+                        old_st_params(crt_st_params);
+                    auto old_fit = crt_fit;
+                    bool done;
+
+                    Parameter_Trainer_Type::train_one_round(
+                        train_event_seq_views,
+                        {{&models.at(m_name_0), &models.at(m_name_1)}},
+                        default_transitions, old_pm_params,
+                        old_st_params, crt_pm_params, crt_st_params,
+                        crt_fit, done, not opts::no_train_scaling,
+                        not opts::no_train_transitions);
+
+                    LOG(debug)
+                        << "scaling_round read ["
+                        << read_summary.read_id << "] strand [" << num_strands
+                        << "] model [" << m_name << "] old_pm_params ["
+                        << old_pm_params << "] old_st_params ["
+                        << old_st_params[0] << "," << old_st_params[1]
+                        << "] old_fit [" << old_fit
+                        << "] crt_pm_params [" << crt_pm_params
+                        << "] crt_st_params [" << crt_st_params[0]
+                        << "," << crt_st_params[1] << "] crt_fit ["
+                        << crt_fit << "] round [" << round << "]"
+                        << endl;
+
+                    if (done) {
+                        // singularity detected; stop
+                        break;
                     }
-                }
-                // track model fit
-                // key = pore model name; value = fit
-                map<array<string, num_strands>, FLOAT_TYPE> model_fit;
-                for (const auto& m_name_0 : model_list[0]) {
-                    for (const auto& m_name_1 : model_list[1]) {
-                        array<string, num_strands> m_name_key = {{m_name_0, m_name_1}};
-                        string m_name = m_name_0 + "+" + m_name_1;
-                        unsigned round = 0;
-                        auto& crt_pm_params =
-                            read_summary.pm_params_m.at(m_name_key);
-                        auto& crt_st_params =
-                            read_summary.st_params_m.at(m_name_key);
-                        auto& crt_fit = model_fit[m_name_key];
-                        crt_fit = -INFINITY;
-                        while (true) {
-                            Pore_Model_Parameters_Type old_pm_params(
-                                crt_pm_params);
-                            std::array<State_Transition_Parameters_Type, num_strands>
-                                old_st_params(crt_st_params);
-                            auto old_fit = crt_fit;
-                            bool done;
-
-                            Parameter_Trainer_Type::train_one_round(
-                                train_event_seq_ptrs,
-                                {{&models.at(m_name_0), &models.at(m_name_1)}},
-                                default_transitions, old_pm_params,
-                                old_st_params, crt_pm_params, crt_st_params,
-                                crt_fit, done, not opts::no_train_scaling,
-                                not opts::no_train_transitions);
-
-                            LOG(debug)
-                                << "scaling_round read ["
-                                << read_summary.read_id << "] strand [" << num_strands
-                                << "] model [" << m_name << "] old_pm_params ["
-                                << old_pm_params << "] old_st_params ["
-                                << old_st_params[0] << "," << old_st_params[1]
-                                << "] old_fit [" << old_fit
-                                << "] crt_pm_params [" << crt_pm_params
-                                << "] crt_st_params [" << crt_st_params[0]
-                                << "," << crt_st_params[1] << "] crt_fit ["
-                                << crt_fit << "] round [" << round << "]"
-                                << endl;
-
-                            if (done) {
-                                // singularity detected; stop
-                                break;
-                            }
-
-                            if (crt_fit < old_fit) {
-                                LOG(info)
-                                    << "scaling_regression read ["
-                                    << read_summary.read_id << "] strand [" << num_strands
-                                    << "] model [" << m_name << "] old_params ["
-                                    << old_pm_params << "] old_st_params ["
-                                    << old_st_params[0] << ","
-                                    << old_st_params[1] << "] old_fit ["
-                                    << old_fit << "] crt_pm_params ["
-                                    << crt_pm_params << "] crt_st_params ["
-                                    << crt_st_params[0] << ","
-                                    << crt_st_params[1] << "] crt_fit ["
-                                    << crt_fit << "] round [" << round << "]"
-                                    << endl;
-                                crt_pm_params = old_pm_params;
-                                crt_st_params = old_st_params;
-                                crt_fit = old_fit;
-                                break;
-                            }
-
-                            ++round;
-                            // stop condition
-                            if (round >= 2u * opts::scaling_max_rounds or
-                                (round > 1 and
-                                 crt_fit <
-                                     old_fit + opts::scaling_min_progress)) {
-                                break;
-                            }
-
-                        }; // while true
-                        LOG(info) << "scaling_result read ["
-                                  << read_summary.read_id << "] strand [" << num_strands
-                                  << "] model [" << m_name << "] pm_params ["
-                                  << crt_pm_params << "] st_params ["
-                                  << crt_st_params[0] << "," << crt_st_params[1]
-                                  << "] fit [" << crt_fit << "] rounds ["
-                                  << round << "]" << endl;
-                    } // for m_name[1]
-                }     // for m_name[0]
-                if (opts::scaling_select_threshold.get() < INFINITY) {
-                    auto it_max = alg::max_of(
-                        model_fit,
-                        [](const decltype(model_fit)::value_type& p) {
-                            return p.second;
-                        });
-                    // check maximum is unique
-                    if (alg::all_of(model_fit, [&](const decltype(
-                                                   model_fit)::value_type& p) {
-                            return &p == &*it_max or
-                                   p.second +
-                                           opts::scaling_select_threshold
-                                               .get() <
-                                       it_max->second;
-                        })) {
-                        const auto& m_name_0 = it_max->first[0];
-                        const auto& m_name_1 = it_max->first[1];
-                        auto m_name = m_name_0 + '+' + m_name_1;
-                        read_summary.preferred_model[2][0] = m_name_0;
-                        read_summary.preferred_model[2][1] = m_name_1;
+
+                    if (crt_fit < old_fit) {
                         LOG(info)
-                            << "selected_model read [" << read_summary.read_id
-                            << "] strand [2] model [" << m_name << "]" << endl;
+                            << "scaling_regression read ["
+                            << read_summary.read_id << "] strand [" << num_strands
+                            << "] model [" << m_name << "] old_params ["
+                            << old_pm_params << "] old_st_params ["
+                            << old_st_params[0] << ","
+                            << old_st_params[1] << "] old_fit ["
+                            << old_fit << "] crt_pm_params ["
+                            << crt_pm_params << "] crt_st_params ["
+                            << crt_st_params[0] << ","
+                            << crt_st_params[1] << "] crt_fit ["
+                            << crt_fit << "] round [" << round << "]"
+                            << endl;
+                        crt_pm_params = old_pm_params;
+                        crt_st_params = old_st_params;
+                        crt_fit = old_fit;
+                        break;
                     }
-                }
+
+                    ++round;
+                    // stop condition
+                    if (round >= 2u * opts::scaling_max_rounds or
+                        (round > 1 and
+                         crt_fit <
+                             old_fit + opts::scaling_min_progress)) {
+                        break;
+                    }
+
+                }; // while true
+                LOG(info) << "scaling_result read ["
+                          << read_summary.read_id << "] strand [" << num_strands
+                          << "] model [" << m_name << "] pm_params ["
+                          << crt_pm_params << "] st_params ["
+                          << crt_st_params[0] << "," << crt_st_params[1]
+                          << "] fit [" << crt_fit << "] rounds ["
+                          << round << "]" << endl;
+            } // for m_name[1]
+        }     // for m_name[0]
+        if (opts::scaling_select_threshold.get() < INFINITY) {
+            auto it_max = alg::max_of(
+                model_fit,
+                [](const decltype(model_fit)::value_type& p) {
+                    return p.second;
+                });
+            // check maximum is unique
+            if (alg::all_of(model_fit, [&](const decltype(
+                                           model_fit)::value_type& p) {
+                    return &p == &*it_max or
+                           p.second +
+                                   opts::scaling_select_threshold
+                                       .get() <
+                               it_max->second;
+                })) {
+                const auto& m_name_0 = it_max->first[0];
+                const auto& m_name_1 = it_max->first[1];
+                auto m_name = m_name_0 + '+' + m_name_1;
+                read_summary.preferred_model[2][0] = m_name_0;
+                read_summary.preferred_model[2][1] = m_name_1;
+                LOG(info)
+                    << "selected_model read [" << read_summary.read_id
+                    << "] strand [2] model [" << m_name << "]" << endl;
             }
-            else // not scale_strands_together
-            {
-                for (unsigned st = 0; st < num_strands; ++st) {
-                    // if not enough events, ignore strand
-                    if (read_summary.events(st).size() < opts::min_read_len)
-                        continue;
-                    // prepare vector of event sequences
-                    vector<pair<const Event_Sequence_Type*, unsigned>>
-                        train_event_seq_ptrs;
-                    for (const auto& events : train_event_seqs[st]) {
-                        train_event_seq_ptrs.push_back(make_pair(&events, st));
+        }
+    }
+    else // not scale_strands_together
+    {
+        for (unsigned st = 0; st < num_strands; ++st) {
+            // if not enough events, ignore strand
+            if (read_summary.events(st).size() < opts::min_read_len)
+                continue;
+            // prepare vector of event sequences
+            vector<pair<Event_Sequence_View_Type, unsigned>>
+                train_event_seq_views;
+            for (const auto& events : train_event_seqs[st]) {
+                train_event_seq_views.push_back(make_pair(events, st));
+            }
+            map<string, FLOAT_TYPE> model_fit;
+            for (const auto& m_name : model_list[st]) {
+                array<string, num_strands> m_name_key;
+                m_name_key[st] = m_name;
+                unsigned round = 0;
+                auto& crt_pm_params =
+                    read_summary.pm_params_m.at(m_name_key);
+                auto& crt_st_params =
+                    read_summary.st_params_m.at(m_name_key);
+                auto& crt_fit = model_fit[m_name];
+                crt_fit = -INFINITY;
+                while (true) {
+                    Pore_Model_Parameters_Type old_pm_params(
+                        crt_pm_params);
+                    array<State_Transition_Parameters_Type, num_strands>
+                        old_st_params(crt_st_params);
+                    auto old_fit = crt_fit;
+                    bool done;
+
+                    Parameter_Trainer_Type::train_one_round(
+                        train_event_seq_views,
+                        {{&models.at(m_name), &models.at(m_name)}},
+                        default_transitions, old_pm_params,
+                        old_st_params, crt_pm_params, crt_st_params,
+                        crt_fit, done, not opts::no_train_scaling,
+                        not opts::no_train_transitions);
+
+                    LOG(debug)
+                        << "scaling_round read ["
+                        << read_summary.read_id << "] strand [" << st
+                        << "] model [" << m_name << "] old_pm_params ["
+                        << old_pm_params << "] old_st_params ["
+                        << old_st_params[st] << "] old_fit [" << old_fit
+                        << "] crt_pm_params [" << crt_pm_params
+                        << "] crt_st_params [" << crt_st_params[st]
+                        << "] crt_fit [" << crt_fit << "] round ["
+                        << round << "]" << endl;
+
+                    if (done) {
+                        // singularity detected; stop
+                        break;
                     }
-                    map<string, FLOAT_TYPE> model_fit;
-                    for (const auto& m_name : model_list[st]) {
-                        array<string, num_strands> m_name_key;
-                        m_name_key[st] = m_name;
-                        unsigned round = 0;
-                        auto& crt_pm_params =
-                            read_summary.pm_params_m.at(m_name_key);
-                        auto& crt_st_params =
-                            read_summary.st_params_m.at(m_name_key);
-                        auto& crt_fit = model_fit[m_name];
-                        crt_fit = -INFINITY;
-                        while (true) {
-                            Pore_Model_Parameters_Type old_pm_params(
-                                crt_pm_params);
-                            array<State_Transition_Parameters_Type, num_strands>
-                                old_st_params(crt_st_params);
-                            auto old_fit = crt_fit;
-                            bool done;
-
-                            Parameter_Trainer_Type::train_one_round(
-                                train_event_seq_ptrs,
-                                {{&models.at(m_name), &models.at(m_name)}},
-                                default_transitions, old_pm_params,
-                                old_st_params, crt_pm_params, crt_st_params,
-                                crt_fit, done, not opts::no_train_scaling,
-                                not opts::no_train_transitions);
-
-                            LOG(debug)
-                                << "scaling_round read ["
-                                << read_summary.read_id << "] strand [" << st
-                                << "] model [" << m_name << "] old_pm_params ["
-                                << old_pm_params << "] old_st_params ["
-                                << old_st_params[st] << "] old_fit [" << old_fit
-                                << "] crt_pm_params [" << crt_pm_params
-                                << "] crt_st_params [" << crt_st_params[st]
-                                << "] crt_fit [" << crt_fit << "] round ["
-                                << round << "]" << endl;
-
-                            if (done) {
-                                // singularity detected; stop
-                                break;
-                            }
-
-                            if (crt_fit < old_fit) {
-                                LOG(info)
-                                    << "scaling_regression read ["
-                                    << read_summary.read_id << "] strand ["
-                                    << st << "] model [" << m_name
-                                    << "] old_pm_params [" << old_pm_params
-                                    << "] old_st_params [" << old_st_params[st]
-                                    << "] old_fit [" << old_fit
-                                    << "] crt_pm_params [" << crt_pm_params
-                                    << "] crt_st_params [" << crt_st_params[st]
-                                    << "] crt_fit [" << crt_fit << "] round ["
-                                    << round << "]" << endl;
-                                crt_pm_params = old_pm_params;
-                                crt_st_params = old_st_params;
-                                crt_fit = old_fit;
-                                break;
-                            }
-
-                            ++round;
-                            // stop condition
-                            if (round >= opts::scaling_max_rounds or
-                                (round > 1 and
-                                 crt_fit <
-                                     old_fit + opts::scaling_min_progress)) {
-                                break;
-                            }
-
-                        }; // while true
-                        LOG(info) << "scaling_result read ["
-                                  << read_summary.read_id << "] strand [" << st
-                                  << "] model [" << m_name << "] pm_params ["
-                                  << crt_pm_params << "] st_params ["
-                                  << crt_st_params[st] << "] fit [" << crt_fit
-                                  << "] rounds [" << round << "]" << endl;
-                    } // for m_name
-                    if (opts::scaling_select_threshold.get() < INFINITY) {
-                        auto it_max = alg::max_of(
-                            model_fit,
-                            [](const decltype(model_fit)::value_type& p) {
-                                return p.second;
-                            });
-                        if (alg::all_of(model_fit, [&](const decltype(
-                                                       model_fit)::value_type&
-                                                           p) {
-                                return &p == &*it_max or
-                                       p.second +
-                                               opts::scaling_select_threshold
-                                                   .get() <
-                                           it_max->second;
-                            })) {
-                            read_summary.preferred_model[st][st] =
-                                it_max->first;
-                            LOG(info) << "selected_model read ["
-                                      << read_summary.read_id << "] strand ["
-                                      << st << "] model [" << it_max->first
-                                      << "]" << endl;
-                        }
+
+                    if (crt_fit < old_fit) {
+                        LOG(info)
+                            << "scaling_regression read ["
+                            << read_summary.read_id << "] strand ["
+                            << st << "] model [" << m_name
+                            << "] old_pm_params [" << old_pm_params
+                            << "] old_st_params [" << old_st_params[st]
+                            << "] old_fit [" << old_fit
+                            << "] crt_pm_params [" << crt_pm_params
+                            << "] crt_st_params [" << crt_st_params[st]
+                            << "] crt_fit [" << crt_fit << "] round ["
+                            << round << "]" << endl;
+                        crt_pm_params = old_pm_params;
+                        crt_st_params = old_st_params;
+                        crt_fit = old_fit;
+                        break;
                     }
-                } // for st
-            }     // if not scale_strands_together
-            read_summary.drop_events();
-        }, // process_item
-        // progress_report
-        [&](unsigned items, unsigned seconds) {
-            clog << "Processed " << setw(6) << right << items << " reads in "
-                 << setw(6) << right << seconds << " seconds\r";
-        }); // pfor
-    auto time_end_ms = get_cpu_time_ms();
-    LOG(info) << "training user_cpu_secs="
-              << (time_end_ms - time_start_ms) / 1000 << endl;
-} // train_reads
+
+                    ++round;
+                    // stop condition
+                    if (round >= opts::scaling_max_rounds or
+                        (round > 1 and
+                         crt_fit <
+                             old_fit + opts::scaling_min_progress)) {
+                        break;
+                    }
+
+                }; // while true
+                LOG(info) << "scaling_result read ["
+                          << read_summary.read_id << "] strand [" << st
+                          << "] model [" << m_name << "] pm_params ["
+                          << crt_pm_params << "] st_params ["
+                          << crt_st_params[st] << "] fit [" << crt_fit
+                          << "] rounds [" << round << "]" << endl;
+            } // for m_name
+            if (opts::scaling_select_threshold.get() < INFINITY) {
+                auto it_max = alg::max_of(
+                    model_fit,
+                    [](const decltype(model_fit)::value_type& p) {
+                        return p.second;
+                    });
+                if (alg::all_of(model_fit, [&](const decltype(
+                                               model_fit)::value_type&
+                                                   p) {
+                        return &p == &*it_max or
+                               p.second +
+                                       opts::scaling_select_threshold
+                                           .get() <
+                                   it_max->second;
+                    })) {
+                    read_summary.preferred_model[st][st] =
+                        it_max->first;
+                    LOG(info) << "selected_model read ["
+                              << read_summary.read_id << "] strand ["
+                              << st << "] model [" << it_max->first
+                              << "]" << endl;
+                }
+            }
+        } // for st
+    }     // if not scale_strands_together
+} // train_read
 
 void write_fasta(ostream& os, const string& name, const string& seq)
 {
@@ -635,295 +896,445 @@ void write_fasta(ostream& os, const string& name, const string& seq)
     }
 } // write_fasta
 
-void basecall_reads(const Pore_Model_Dict_Type& models,
-                    const State_Transitions_Type& default_transitions,
-                    deque<Fast5_Summary_Type>& reads)
+void basecall_read(const Pore_Model_Dict_Type& models,
+                   const State_Transitions_Type& default_transitions,
+                   Fast5_Summary_Type& read_summary,
+                   ostream& oss)
 {
-    auto time_start_ms = get_cpu_time_ms();
-    strict_fstream::ofstream ofs;
-    ostream* os_p = nullptr;
-    if (not opts::output_fn.get().empty()) {
-        ofs.open(opts::output_fn);
-        os_p = &ofs;
+    // compute read statistics used to check scaling
+    array<pair<FLOAT_TYPE, FLOAT_TYPE>,num_strands> r_stats;
+    for (unsigned st = 0; st < num_strands; ++st) {
+        // if not enough events, ignore strand
+        if (read_summary.events(st).size() < opts::min_read_len)
+            continue;
+        r_stats[st] = alg::mean_stdv_of<FLOAT_TYPE>(
+            read_summary.events(st).mean(),
+            [](FLOAT_TYPE x) { return x; });
+        LOG(debug) << "mean_stdv read [" << read_summary.read_id
+                   << "] strand [" << st << "] ev_mean=["
+                   << r_stats[st].first << "] ev_stdv=["
+                   << r_stats[st].second << "]" << endl;
     }
-    else {
-        os_p = &cout;
-    }
-
-    unsigned crt_idx = 0;
-    pfor::pfor<unsigned, ostringstream>(
-        opts::num_threads, opts::chunk_size,
-        // get_item
-        [&](unsigned& i) {
-            if (crt_idx >= reads.size()) return false;
-            i = crt_idx++;
-            return true;
-        },
-        // process_item
-        [&](unsigned& i, ostringstream& oss) {
-            Fast5_Summary_Type& read_summary = reads[i];
-            if (read_summary.num_ed_events == 0) return;
-            global_assert::global_msg() = read_summary.read_id;
-            read_summary.load_events();
 
-            // compute read statistics used to check scaling
-            array<pair<FLOAT_TYPE, FLOAT_TYPE>,num_strands> r_stats;
-            for (unsigned st = 0; st < num_strands; ++st) {
-                // if not enough events, ignore strand
-                if (read_summary.events(st).size() < opts::min_read_len)
-                    continue;
-                r_stats[st] = alg::mean_stdv_of<FLOAT_TYPE>(
-                    read_summary.events(st),
-                    [](const Event_Type& ev) { return ev.mean; });
-                LOG(debug) << "mean_stdv read [" << read_summary.read_id
-                           << "] strand [" << st << "] ev_mean=["
-                           << r_stats[st].first << "] ev_stdv=["
-                           << r_stats[st].second << "]" << endl;
+    // basecalling jobs: (strand, model name, pm_params, st_params)
+    typedef tuple<unsigned, string, const Pore_Model_Parameters_Type*,
+                  const State_Transition_Parameters_Type*>
+        Basecall_Job_Type;
+    // basecalling functor: decode strands which share state transitions
+    // together, in lockstep
+    // returns: (path_prob, base_seq) for each job
+    auto basecall_strands = [&](const vector<Basecall_Job_Type>& jobs) {
+        vector<tuple<FLOAT_TYPE, string>> res(jobs.size());
+        vector<Pore_Model_Type> pm_v;
+        vector<shared_ptr<const State_Transitions_Type>> custom_transitions_v;
+        // jobs grouped by state transitions
+        vector<pair<const State_Transitions_Type*, vector<unsigned>>> groups;
+        pm_v.reserve(jobs.size());
+        for (unsigned i = 0; i < jobs.size(); ++i) {
+            unsigned st = get<0>(jobs[i]);
+            const string& m_name = get<1>(jobs[i]);
+            const Pore_Model_Parameters_Type& pm_params = *get<2>(jobs[i]);
+            const State_Transition_Parameters_Type& st_params = *get<3>(jobs[i]);
+            // scale model
+            pm_v.emplace_back(models.at(m_name));
+            Pore_Model_Type& pm = pm_v.back();
+            pm.scale(pm_params);
+            const State_Transitions_Type* transitions_ptr;
+            if (not st_params.is_default()) {
+                custom_transitions_v.push_back(
+                    State_Transitions_Type::get_fast(st_params));
+                transitions_ptr = custom_transitions_v.back().get();
             }
-
-            // basecalling functor
-            // returns: (path_prob, base_seq)
-            auto basecall_strand = [&](
-                unsigned st, string m_name,
-                const Pore_Model_Parameters_Type& pm_params,
-                const State_Transition_Parameters_Type& st_params) {
-                // scale model
-                Pore_Model_Type pm(models.at(m_name));
-                pm.scale(pm_params);
-                State_Transitions_Type custom_transitions;
-                const State_Transitions_Type* transitions_ptr;
-                if (not st_params.is_default()) {
-                    custom_transitions.compute_transitions_fast(st_params);
-                    transitions_ptr = &custom_transitions;
-                }
-                else {
-                    transitions_ptr = &default_transitions;
-                }
-                LOG(info) << "basecalling read [" << read_summary.read_id
-                          << "] strand [" << st << "] model [" << m_name
-                          << "] pm_params [" << pm_params << "] st_params ["
-                          << st_params << "]" << endl;
-                LOG(debug) << "mean_stdv read [" << read_summary.read_id
-                           << "] strand [" << st << "] model_mean ["
-                           << pm.mean() << "] model_stdv [" << pm.stdv() << "]"
-                           << endl;
-                if (abs(r_stats[st].first - pm.mean()) > 5.0) {
-                    LOG(warning) << "means_apart read [" << read_summary.read_id
-                                 << "] strand [" << st << "] model [" << m_name
-                                 << "] parameters [" << pm_params
-                                 << "] model_mean=[" << pm.mean()
-                                 << "] events_mean=[" << r_stats[st].first
-                                 << "]" << endl;
-                }
-                // correct drift
-                Event_Sequence_Type corrected_events = read_summary.events(st);
-                corrected_events.apply_drift_correction(pm_params.drift);
+            else {
+                transitions_ptr = &default_transitions;
+            }
+            auto it = find_if(groups.begin(), groups.end(), [&](
+                const pair<const State_Transitions_Type*, vector<unsigned>>& g) {
+                return g.first == transitions_ptr;
+            });
+            if (it == groups.end()) {
+                groups.emplace_back(transitions_ptr, vector<unsigned>());
+                it = groups.end() - 1;
+            }
+            it->second.push_back(i);
+            LOG(info) << "basecalling read [" << read_summary.read_id
+                      << "] strand [" << st << "] model [" << m_name
+                      << "] pm_params [" << pm_params << "] st_params ["
+                      << st_params << "]" << endl;
+            LOG(debug) << "mean_stdv read [" << read_summary.read_id
+                       << "] strand [" << st << "] model_mean ["
+                       << pm.mean() << "] model_stdv [" << pm.stdv() << "]"
+                       << endl;
+            if (abs(r_stats[st].first - pm.mean()) > 5.0) {
+                LOG(warning) << "means_apart read [" << read_summary.read_id
+                             << "] strand [" << st << "] model [" << m_name
+                             << "] parameters [" << pm_params
+                             << "] model_mean=[" << pm.mean()
+                             << "] events_mean=[" << r_stats[st].first
+                             << "]" << endl;
+            }
+        }
+        // correct drift on the fly
+        auto events_view = [&](unsigned i) {
+            return Event_Sequence_View_Type(
+                read_summary.events(get<0>(jobs[i])), get<2>(jobs[i])->drift);
+        };
+        for (const auto& g : groups) {
+            if (g.second.size() == 1) {
+                unsigned i = g.second[0];
                 Viterbi_Type vit;
-                vit.fill(pm, *transitions_ptr, corrected_events);
-                return std::make_tuple(vit.path_probability(), vit.base_seq());
-            };
-            LOG(info) << "2d_hmm=" << opts::two_d_hmm << endl;
-            LOG(info) << "scale_strands_together="
-                      << read_summary.scale_strands_together << endl;
-            bool can_do_2d =
-                min(read_summary.events(0).size(),
-                    read_summary.events(1).size()) >= opts::min_read_len;
-            bool do_2d = can_do_2d && opts::two_d_hmm;
-            if (opts::two_d_hmm && !can_do_2d) {
-                LOG(error)
-                    << "2D analysis cannot be performed, as there is not "
-                       "enough template or complement strand data"
-                    << endl;
+                vit.fill(pm_v[i], *g.first, events_view(i));
+                res[i] = std::make_tuple(vit.path_probability(), vit.base_seq());
+                continue;
             }
-            if (do_2d) {
-                LOG(info) << "2D analysis will be performed" << endl;
+            vector<const Pore_Model_Type*> pm_ptr_v;
+            vector<Event_Sequence_View_Type> ev_v;
+            for (unsigned i : g.second) {
+                pm_ptr_v.push_back(&pm_v[i]);
+                ev_v.push_back(events_view(i));
             }
-            string read_seqs[num_strands];
-
-            if (read_summary.scale_strands_together) {
-                // create list of models to try
-                list<array<string, num_strands>> model_sublist;
-                if (not read_summary.preferred_model[2][0].empty()) {
-                    // if we have a preferred model, use that
-                    model_sublist.push_back(read_summary.preferred_model[2]);
-                }
-                else {
-                    // no preferred model, try all for which we have scaling
-                    // parameters
-                    for (const auto& p : read_summary.pm_params_m) {
-                        if (p.first[0].empty() or p.first[1].empty()) continue;
+            Viterbi_Batch_Type vit_batch;
+            vit_batch.fill(pm_ptr_v, ev_v, *g.first);
+            for (unsigned r = 0; r < g.second.size(); ++r) {
+                res[g.second[r]] = std::make_tuple(
+                    vit_batch.path_probability(r), vit_batch.base_seq(r));
+            }
+        }
+        return res;
+    };
+    LOG(info) << "2d_hmm=" << opts::two_d_hmm << endl;
+    LOG(info) << "scale_strands_together="
+              << read_summary.scale_strands_together << endl;
+    bool can_do_2d =
+        min(read_summary.events(0).size(),
+            read_summary.events(1).size()) >= opts::min_read_len;
+    bool do_2d = can_do_2d && opts::two_d_hmm;
+    if (opts::two_d_hmm && !can_do_2d) {
+        LOG(error)
+            << "2D analysis cannot be performed, as there is not "
+               "enough template or complement strand data"
+            << endl;
+    }
+    if (do_2d) {
+        LOG(info) << "2D analysis will be performed" << endl;
+    }
+    string read_seqs[num_strands];
+
+    if (read_summary.scale_strands_together) {
+        // create list of models to try
+        list<array<string, num_strands>> model_sublist;
+        if (not read_summary.preferred_model[2][0].empty()) {
+            // if we have a preferred model, use that
+            model_sublist.push_back(read_summary.preferred_model[2]);
+        }
+        else {
+            // no preferred model, try all for which we have scaling
+            // parameters
+            for (const auto& p : read_summary.pm_params_m) {
+                if (p.first[0].empty() or p.first[1].empty()) continue;
+                model_sublist.push_back(p.first);
+            }
+        }
+        // basecall using applicable models
+        deque<tuple<FLOAT_TYPE, FLOAT_TYPE, FLOAT_TYPE, string, string,
+                    string, string>> results;
+        vector<Basecall_Job_Type> jobs;
+        for (const auto& m_name : model_sublist) {
+            for (unsigned st = 0; st < num_strands; ++st) {
+                jobs.emplace_back(st, m_name[st],
+                                  &read_summary.pm_params_m.at(m_name),
+                                  &read_summary.st_params_m.at(m_name)[st]);
+            }
+        }
+        auto job_results = basecall_strands(jobs);
+        unsigned i = 0;
+        for (const auto& m_name : model_sublist) {
+            auto& part_results_0 = job_results[i];
+            auto& part_results_1 = job_results[i + 1];
+            results.emplace_back(
+                get<0>(part_results_0) + get<0>(part_results_1),
+                get<0>(part_results_0), get<0>(part_results_1),
+                string(m_name[0]), string(m_name[1]),
+                move(get<1>(part_results_0)),
+                move(get<1>(part_results_1)));
+            i += num_strands;
+        }
+        // sort results by first component (log path probability)
+        sort(results.begin(), results.end());
+        array<FLOAT_TYPE, num_strands> best_log_path_prob{
+            {get<1>(results.back()), get<2>(results.back())}};
+        array<string, num_strands> best_m_name{
+            {get<3>(results.back()), get<4>(results.back())}};
+        array<const string*, num_strands> base_seq_ptr{
+            {&get<5>(results.back()), &get<6>(results.back())}};
+        string best_m_name_str = best_m_name[0] + '+' + best_m_name[1];
+        auto& best_pm_params = read_summary.pm_params_m.at(best_m_name);
+        auto& best_st_params = read_summary.st_params_m.at(best_m_name);
+        for (unsigned st = 0; st < num_strands; ++st) {
+            LOG(info) << "best_model read [" << read_summary.read_id
+                      << "] strand [" << st << "] model ["
+                      << best_m_name[st] << "] pm_params ["
+                      << best_pm_params << "] st_params ["
+                      << best_st_params[st] << "] log_path_prob ["
+                      << best_log_path_prob[st] << "]" << endl;
+            read_summary.preferred_model[st][st] = best_m_name[st];
+            read_summary.pm_params_m[read_summary.preferred_model[st]] =
+                best_pm_params;
+            read_summary
+                .st_params_m[read_summary.preferred_model[st]][st] =
+                best_st_params[st];
+            ostringstream tmp;
+            tmp << read_summary.read_id << ":"
+                << read_summary.base_file_name << ":" << st;
+            if (!do_2d) {
+                write_fasta(oss, tmp.str(), *base_seq_ptr[st]);
+            }
+            else {
+                read_seqs[st] = move(*base_seq_ptr[st]);
+            }
+        }
+    }
+    else // not scale_strands_together
+    {
+        for (unsigned st = 0; st < num_strands; ++st) {
+            // if not enough events, ignore strand
+            if (read_summary.events(st).size() < opts::min_read_len)
+                continue;
+            // create list of models to try
+            list<array<string, num_strands>> model_sublist;
+            if (not read_summary.preferred_model[st][st].empty()) {
+                // if we have a preferred model, use that
+                model_sublist.push_back(
+                    read_summary.preferred_model[st]);
+            }
+            else {
+                // no preferred model, try all for which we have
+                // scaling
+                for (const auto& p : read_summary.pm_params_m) {
+                    if (not p.first[st].empty() and
+                        p.first[1 - st].empty()) {
                         model_sublist.push_back(p.first);
                     }
                 }
-                // basecall using applicable models
-                deque<tuple<FLOAT_TYPE, FLOAT_TYPE, FLOAT_TYPE, string, string,
-                            string, string>> results;
-                for (const auto& m_name : model_sublist) {
-                    array<tuple<FLOAT_TYPE, string>, num_strands> part_results;
-                    for (unsigned st = 0; st < num_strands; ++st) {
-                        part_results[st] = basecall_strand(
-                            st, m_name[st], read_summary.pm_params_m.at(m_name),
-                            read_summary.st_params_m.at(m_name)[st]);
-                    }
-                    results.emplace_back(
-                        get<0>(part_results[0]) + get<0>(part_results[1]),
-                        get<0>(part_results[0]), get<0>(part_results[1]),
-                        string(m_name[0]), string(m_name[1]),
-                        move(get<1>(part_results[0])),
-                        move(get<1>(part_results[1])));
-                }
-                // sort results by first component (log path probability)
-                sort(results.begin(), results.end());
-                array<FLOAT_TYPE, num_strands> best_log_path_prob{
-                    {get<1>(results.back()), get<2>(results.back())}};
-                array<string, num_strands> best_m_name{
-                    {get<3>(results.back()), get<4>(results.back())}};
-                array<const string*, num_strands> base_seq_ptr{
-                    {&get<5>(results.back()), &get<6>(results.back())}};
-                string best_m_name_str = best_m_name[0] + '+' + best_m_name[1];
-                auto& best_pm_params = read_summary.pm_params_m.at(best_m_name);
-                auto& best_st_params = read_summary.st_params_m.at(best_m_name);
-                for (unsigned st = 0; st < num_strands; ++st) {
-                    LOG(info) << "best_model read [" << read_summary.read_id
-                              << "] strand [" << st << "] model ["
-                              << best_m_name[st] << "] pm_params ["
-                              << best_pm_params << "] st_params ["
-                              << best_st_params[st] << "] log_path_prob ["
-                              << best_log_path_prob[st] << "]" << endl;
-                    read_summary.preferred_model[st][st] = best_m_name[st];
-                    read_summary.pm_params_m[read_summary.preferred_model[st]] =
-                        best_pm_params;
-                    read_summary
-                        .st_params_m[read_summary.preferred_model[st]][st] =
-                        best_st_params[st];
-                    ostringstream tmp;
-                    tmp << read_summary.read_id << ":"
-                        << read_summary.base_file_name << ":" << st;
-                    if (!do_2d) {
-                        write_fasta(oss, tmp.str(), *base_seq_ptr[st]);
-                    }
-                    else {
-                        read_seqs[st] = move(*base_seq_ptr[st]);
-                    }
-                }
             }
-            else // not scale_strands_together
-            {
-                for (unsigned st = 0; st < num_strands; ++st) {
-                    // if not enough events, ignore strand
-                    if (read_summary.events(st).size() < opts::min_read_len)
-                        continue;
-                    // create list of models to try
-                    list<array<string, num_strands>> model_sublist;
-                    if (not read_summary.preferred_model[st][st].empty()) {
-                        // if we have a preferred model, use that
-                        model_sublist.push_back(
-                            read_summary.preferred_model[st]);
-                    }
-                    else {
-                        // no preferred model, try all for which we have
-                        // scaling
-                        for (const auto& p : read_summary.pm_params_m) {
-                            if (not p.first[st].empty() and
-                                p.first[1 - st].empty()) {
-                                model_sublist.push_back(p.first);
-                            }
-                        }
-                    }
-                    // deque of results
-                    deque<tuple<FLOAT_TYPE, string, string>> results;
-                    for (const auto& m_name : model_sublist) {
-                        auto r = basecall_strand(
-                            st, m_name[st], read_summary.pm_params_m.at(m_name),
-                            read_summary.st_params_m.at(m_name)[st]);
-                        results.emplace_back(get<0>(r), string(m_name[st]),
-                                             move(get<1>(r)));
-                    }
-                    sort(results.begin(), results.end());
-                    string& best_m_name = get<1>(results.back());
-                    string& base_seq = get<2>(results.back());
-                    array<string, num_strands> best_m_key;
-                    best_m_key[st] = best_m_name;
-                    LOG(info) << "best_model read [" << read_summary.read_id
-                              << "] strand [" << st << "] model ["
-                              << best_m_name << "] pm_params ["
-                              << read_summary.pm_params_m.at(best_m_key)
-                              << "] st_params ["
-                              << read_summary.st_params_m.at(best_m_key)[st]
-                              << "] log_path_prob [" << get<0>(results.back())
-                              << "]" << endl;
-                    read_summary.preferred_model[st][st] = best_m_name;
-                    ostringstream tmp;
-                    tmp << read_summary.read_id << ":"
-                        << read_summary.base_file_name << ":" << st;
-                    if (!do_2d) {
-                        write_fasta(oss, tmp.str(), base_seq);
-                    }
-                    else {
-                        read_seqs[st] = move(base_seq);
-                    }
-                } // for st
+            // deque of results
+            deque<tuple<FLOAT_TYPE, string, string>> results;
+            vector<Basecall_Job_Type> jobs;
+            for (const auto& m_name : model_sublist) {
+                jobs.emplace_back(st, m_name[st],
+                                  &read_summary.pm_params_m.at(m_name),
+                                  &read_summary.st_params_m.at(m_name)[st]);
+            }
+            auto job_results = basecall_strands(jobs);
+            unsigned i = 0;
+            for (const auto& m_name : model_sublist) {
+                auto& r = job_results[i++];
+                results.emplace_back(get<0>(r), string(m_name[st]),
+                                     move(get<1>(r)));
+            }
+            sort(results.begin(), results.end());
+            string& best_m_name = get<1>(results.back());
+            string& base_seq = get<2>(results.back());
+            array<string, num_strands> best_m_key;
+            best_m_key[st] = best_m_name;
+            LOG(info) << "best_model read [" << read_summary.read_id
+                      << "] strand [" << st << "] model ["
+                      << best_m_name << "] pm_params ["
+                      << read_summary.pm_params_m.at(best_m_key)
+                      << "] st_params ["
+                      << read_summary.st_params_m.at(best_m_key)[st]
+                      << "] log_path_prob [" << get<0>(results.back())
+                      << "]" << endl;
+            read_summary.preferred_model[st][st] = best_m_name;
+            ostringstream tmp;
+            tmp << read_summary.read_id << ":"
+                << read_summary.base_file_name << ":" << st;
+            if (!do_2d) {
+                write_fasta(oss, tmp.str(), base_seq);
             }
-            if (do_2d) {
-                LOG(info) << "beginning 2d alignment" << endl;
-                seqan::DnaString first(read_seqs[0]);
-                seqan::DnaString second(read_seqs[1]);
-                using TAlign = seqan::Align<seqan::DnaString, seqan::ArrayGaps>;
-                TAlign alignment;
-                resize(rows(alignment), num_strands);
-                assignSource(row(alignment, 0), first);
-                assignSource(row(alignment, 1), second);
-                int score = globalAlignment(
-                    alignment, seqan::Score<int, seqan::Simple>(0, -1, 1));
-                oss << "Score: " << score << endl;
-                oss << first << endl;
-                oss << second << endl;
-                oss << align << endl;
-                LOG(info) << "finished 2d alignment" << endl;
+            else {
+                read_seqs[st] = move(base_seq);
+            }
+        } // for st
+    }
+    if (do_2d) {
+        LOG(info) << "beginning 2d alignment" << endl;
+        seqan::DnaString first(read_seqs[0]);
+        seqan::DnaString second(read_seqs[1]);
+        using TAlign = seqan::Align<seqan::DnaString, seqan::ArrayGaps>;
+        TAlign alignment;
+        resize(rows(alignment), num_strands);
+        assignSource(row(alignment, 0), first);
+        assignSource(row(alignment, 1), second);
+        int score = globalAlignment(
+            alignment, seqan::Score<int, seqan::Simple>(0, -1, 1));
+        oss << "Score: " << score << endl;
+        oss << first << endl;
+        oss << second << endl;
+        oss << align << endl;
+        LOG(info) << "finished 2d alignment" << endl;
+    }
+} // basecall_read
+
+// Train and basecall reads, one at a time. Events are loaded by the I/O stage.
+void process_reads(const Pore_Model_Dict_Type& models,
+                   const State_Transitions_Type& default_transitions,
+                   Bounded_Queue<Read_Item_Type>& read_q,
+                   Bounded_Queue<Output_Item_Type>& output_q)
+{
+    Read_Item_Type item;
+    while (read_q.pop(item)) {
+        Fast5_Summary_Type& read_summary = item.second;
+        ostringstream oss;
+        if (read_summary.valid and read_summary.num_ed_events > 0) {
+            global_assert::global_msg() = read_summary.read_id;
+            if (opts::train) {
+                // do some rescaling
+                train_read(models, default_transitions, read_summary);
+            }
+            if (not opts::only_train) {
+                basecall_read(models, default_transitions, read_summary, oss);
             }
             read_summary.drop_events();
-        },
-        // output_chunk
-        [&](ostringstream& oss) { *os_p << oss.str(); },
-        // progress_report
-        [&](unsigned items, unsigned seconds) {
-            clog << "Processed " << setw(6) << right << items << " reads in "
-                 << setw(6) << right << seconds << " seconds\r";
-        }); // pfor
-    auto time_end_ms = get_cpu_time_ms();
-    LOG(info) << "basecalling user_cpu_secs="
-              << (time_end_ms - time_start_ms) / 1000 << endl;
-} // basecall_reads
+        }
+        output_q.push(
+            Output_Item_Type(item.first, move(read_summary), oss.str()));
+    }
+    output_q.close();
+} // process_reads
+
+// Write basecalls and stats in input order, skipping invalid files.
+// Returns the number of valid files.
+size_t write_reads(Bounded_Queue<Output_Item_Type>& output_q,
+                   Output_Window& output_window)
+{
+    strict_fstream::ofstream ofs;
+    ostream* os_p = nullptr;
+    if (not opts::only_train) {
+        if (not opts::output_fn.get().empty()) {
+            ofs.open(opts::output_fn);
+            os_p = &ofs;
+        }
+        else {
+            os_p = &cout;
+        }
+    }
+    strict_fstream::ofstream stats_ofs;
+    if (not opts::stats_fn.get().empty()) {
+        stats_ofs.open(opts::stats_fn);
+        Fast5_Summary_Type::write_tsv_header(stats_ofs);
+        stats_ofs << endl;
+    }
+    // items which arrive out of order wait here for their turn
+    map<size_t, Output_Item_Type> pending;
+    size_t next_idx = 0;
+    size_t num_valid = 0;
+    auto time_start = chrono::steady_clock::now();
+    unsigned last_seconds = 0;
+    Output_Item_Type item;
+    while (output_q.pop(item)) {
+        pending.emplace(get<0>(item), move(item));
+        while (not pending.empty() and pending.begin()->first == next_idx) {
+            auto& crt = pending.begin()->second;
+            if (get<1>(crt).valid) {
+                if (os_p) {
+                    *os_p << get<2>(crt);
+                }
+                if (stats_ofs.is_open()) {
+                    get<1>(crt).write_tsv(stats_ofs);
+                    stats_ofs << endl;
+                }
+                ++num_valid;
+            }
+            pending.erase(pending.begin());
+            ++next_idx;
+        }
+        output_window.advance(next_idx);
+        unsigned seconds = chrono::duration_cast<chrono::seconds>(
+                               chrono::steady_clock::now() - time_start)
+                               .count();
+        if (seconds > last_seconds) {
+            clog << "Processed " << setw(6) << right << next_idx
+                 << " reads in " << setw(6) << right << seconds
+                 << " seconds\r";
+            last_seconds = seconds;
+        }
+    }
+    assert(pending.empty());
+    return num_valid;
+} // write_reads
 
 int real_main()
 {
     Pore_Model_Dict_Type models;
     State_Transitions_Type default_transitions;
-    deque<Fast5_Summary_Type> reads;
-    list<string> files;
     // initialize structs
     init_models(models);
     init_transitions(default_transitions);
-    init_files(files);
-    init_reads(models, files, reads);
     if (opts::train) {
-        // do some rescaling
-        train_reads(models, default_transitions, reads);
-    }
-    if (not opts::only_train) {
-        // basecall reads
-        basecall_reads(models, default_transitions, reads);
+        Parameter_Trainer_Type::init();
     }
-    // print stats
-    if (not opts::stats_fn.get().empty()) {
-        strict_fstream::ofstream ofs(opts::stats_fn);
-        Fast5_Summary_Type::write_tsv_header(ofs);
-        ofs << endl;
-        for (const auto& s : reads) {
-            s.write_tsv(ofs);
-            ofs << endl;
+    if (not opts::event_cache.get().empty()) {
+        Event_Cache_Type::Options cache_opts;
+        cache_opts.double_strand_scaling = opts::double_strand_scaling;
+        cache_opts.min_read_len = opts::min_read_len;
+        cache_opts.max_read_len = opts::max_read_len;
+        if (not event_cache.open(opts::event_cache, cache_opts)) {
+            return EXIT_FAILURE;
         }
     }
+    //
+    // pipeline: discover files -> load reads -> train & basecall -> write;
+    // stages run concurrently, connected by bounded queues
+    //
+    unsigned num_threads = max(opts::num_threads.get(), 1u);
+    unsigned num_io_threads = max(opts::num_io_threads.get(), 1u);
+    size_t queue_size = size_t(num_threads) * opts::queue_size;
+    Bounded_Queue<File_Item_Type> file_q(queue_size);
+    // events are held from summarizing until processing; loaded reads are
+    // bounded both in number and in the memory held by their events
+    Bounded_Queue<Read_Item_Type> read_q(
+        queue_size, num_io_threads, size_t(opts::queue_mem) << 20);
+    Bounded_Queue<Output_Item_Type> output_q(queue_size, num_threads);
+    // reads loaded and not yet written: at most 2 full queues beyond those
+    // being loaded and processed
+    Output_Window output_window(2 * queue_size + num_io_threads + num_threads);
+    auto time_start_ms = get_cpu_time_ms();
+    size_t num_files = 0;
+    thread discover_thread([&]() {
+        num_files = init_files(file_q);
+        file_q.close();
+    });
+    vector<thread> io_threads;
+    for (unsigned k = 0; k < num_io_threads; ++k) {
+        io_threads.emplace_back([&]() {
+            load_reads(models, file_q, read_q, output_window);
+        });
+    }
+    vector<thread> process_threads;
+    for (unsigned k = 0; k < num_threads; ++k) {
+        process_threads.emplace_back([&]() {
+            process_reads(models, default_transitions, read_q, output_q);
+        });
+    }
+    size_t num_valid_files = write_reads(output_q, output_window);
+    discover_thread.join();
+    for (auto& t : io_threads) {
+        t.join();
+    }
+    for (auto& t : process_threads) {
+        t.join();
+    }
+    event_cache.close();
+    auto time_end_ms = get_cpu_time_ms();
+    LOG(info) << "num_files=" << num_files
+              << " num_valid_files=" << num_valid_files << endl;
+    if (num_valid_files == 0) {
+        LOG(error) << "no fast5 files to process" << endl;
+        return EXIT_FAILURE;
+    }
+    LOG(info) << "processing user_cpu_secs="
+              << (time_end_ms - time_start_ms) / 1000 << endl;
     assert(fast5::File::get_object_count() == 0);
     return EXIT_SUCCESS;
 }
@@ -937,17 +1348,29 @@ int main(int argc, char* argv[])
     LOG(info) << "version: " << opts::cmd_parser.getVersion() << endl;
     LOG(info) << "args: " << opts::cmd_parser.getOrigArgv() << endl;
     LOG(info) << "num_threads=" << opts::num_threads.get() << endl;
-#ifndef H5_HAVE_THREADSAFE
-    if (opts::num_threads > 1) {
-        LOG(warning) << "enabled multi-threading with non-threadsafe HDF5: "
-                        "using experimental locking"
-                     << endl;
-    }
-#endif
+    LOG(info) << "num_read_threads=" << opts::num_read_threads.get() << endl;
+    LOG(info) << "num_scan_threads=" << opts::num_scan_threads.get() << endl;
+    LOG(info) << "num_io_threads=" << opts::num_io_threads.get() << endl;
+    LOG(info) << "stage_dir=" << opts::stage_dir.get() << endl;
+    LOG(info) << "event_cache=" << opts::event_cache.get() << endl;
+    LOG(info) << "max_mem=" << opts::max_mem.get() << endl;
+    LOG(info) << "beam_width=" << opts::beam_width.get() << endl;
+    LOG(info) << "beam_size=" << opts::beam_size.get() << endl;
+    LOG(info) << "max_skip=" << opts::max_skip.get() << endl;
+    LOG(info) << "log_space=" << opts::log_space.get() << endl;
     State_Transition_Parameters_Type::default_p_stay() = opts::pr_stay;
     State_Transition_Parameters_Type::default_p_skip() = opts::pr_skip;
     Fast5_Summary_Type::min_read_len() = opts::min_read_len;
     Fast5_Summary_Type::max_read_len() = opts::max_read_len;
+    Fast5_Image::staging_dir() = opts::stage_dir;
+    Viterbi_Type::n_threads() = opts::num_read_threads;
+    Forward_Backward_Type::n_threads() = opts::num_read_threads;
+    Viterbi_Type::max_mem() = size_t(opts::max_mem) << 20;
+    Forward_Backward_Type::max_mem() = size_t(opts::max_mem) << 20;
+    Forward_Backward_Type::scaled() = not opts::log_space;
+    Viterbi_Type::beam_width() = opts::beam_width;
+    Viterbi_Type::beam_size() = opts::beam_size;
+    State_Transitions_Type::max_skip() = opts::max_skip;
     //
     // set training option
     //
@@ -990,6 +1413,24 @@ int main(int argc, char* argv[])
                    << opts::scaling_min_progress.get() << endl;
         return EXIT_FAILURE;
     }
+    if (not opts::stage_dir.get().empty() and
+        not is_directory(opts::stage_dir)) {
+        LOG(error) << "invalid stage_dir: " << opts::stage_dir.get() << endl;
+        return EXIT_FAILURE;
+    }
+    if (opts::max_skip < 1 or opts::max_skip > 5) {
+        LOG(error) << "invalid max_skip: " << opts::max_skip.get() << endl;
+        return EXIT_FAILURE;
+    }
+    if (opts::max_skip > 1 and Viterbi_Type::beam_enabled()) {
+        LOG(error) << "beam search is not available with max_skip > 1"
+                   << endl;
+        return EXIT_FAILURE;
+    }
+    // beam search runs on the explicit transition tables
+    if (Viterbi_Type::beam_enabled()) {
+        State_Transitions_Type::build_tables() = true;
+    }
     //
     // print training options
     //
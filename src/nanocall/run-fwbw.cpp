@@ -35,6 +35,7 @@ namespace opts
     ValueArg< string > ev_file_name("e", "events", "Events file name.", true, "", "file", cmd_parser);
     ValueArg< string > output_file_name("o", "output", "Output file name.", false, "", "file", cmd_parser);
     SwitchArg custom_fwbw("", "custom-fwbw", "Use custom fwbw.", cmd_parser);
+    SwitchArg log_space("", "log-space", "Run fwbw in log space instead of scaled probability space.", cmd_parser);
 } // namespace opts
 
 void real_main()
@@ -54,6 +55,7 @@ void real_main()
         }
     }
 
+    Forward_Backward_Type::scaled() = not opts::log_space;
     Forward_Backward_Type fwbw;
     Forward_Backward_Custom_Type fwbw_custom;
     if (not opts::custom_fwbw)
@@ -86,7 +88,16 @@ void real_main()
 
     if (not opts::output_file_name.get().empty())
     {
-        strict_fstream::ofstream(opts::output_file_name) << fwbw;
+        // write the tables that were filled
+        strict_fstream::ofstream ofs(opts::output_file_name);
+        if (not opts::custom_fwbw)
+        {
+            ofs << fwbw;
+        }
+        else
+        {
+            ofs << fwbw_custom;
+        }
     }
 }
 
@@ -6,6 +6,7 @@
 #include "State_Transitions.hpp"
 #include "Event.hpp"
 #include "Viterbi.hpp"
+#include "Online_Viterbi.hpp"
 #include "logger.hpp"
 #include "zstr.hpp"
 
@@ -19,6 +20,7 @@ typedef Pore_Model< FLOAT_TYPE > Pore_Model_Type;
 typedef Event< FLOAT_TYPE > Event_Type;
 typedef Event_Sequence< FLOAT_TYPE > Event_Sequence_Type;
 typedef Viterbi< FLOAT_TYPE > Viterbi_Type;
+typedef Online_Viterbi< FLOAT_TYPE > Online_Viterbi_Type;
 
 namespace opts
 {
@@ -30,6 +32,7 @@ namespace opts
     ValueArg< string > pm_file_name("p", "pore-model", "Scaled pore model file name.", true, "", "file", cmd_parser);
     ValueArg< string > st_file_name("s", "state-transitions", "State transitions file name.", true, "", "file", cmd_parser);
     ValueArg< string > ev_file_name("e", "events", "Events file name.", true, "", "file", cmd_parser);
+    SwitchArg online("", "online", "Decode events as they are read, printing bases as they settle.", cmd_parser);
 } // namespace opts
 
 void real_main()
@@ -39,6 +42,21 @@ void real_main()
     Event_Sequence_Type ev;
     zstr::ifstream(opts::pm_file_name) >> pm;
     zstr::ifstream(opts::st_file_name) >> st;
+    if (opts::online)
+    {
+        Online_Viterbi_Type vit;
+        vit.reset(pm, st);
+        zstr::ifstream ifs(opts::ev_file_name);
+        Event_Type e;
+        while (ifs >> e)
+        {
+            vit.push(e);
+            cout << vit.take_bases() << flush;
+        }
+        vit.finish();
+        cout << vit.take_bases() << std::endl;
+        return;
+    }
     {
         zstr::ifstream ifs(opts::ev_file_name);
         Event_Type e;